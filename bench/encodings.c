@@ -0,0 +1,139 @@
+/*  encodings.c
+
+    Copyright (C) 2019 Cranfield University
+
+    Author: Tomasz Kurowski <t.j.kurowski@cranfield.ac.uk>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+/*
+ * Compares the WAH and Roaring bit array encodings on the bit arrays of an
+ * existing database: storage size in each encoding and in the smaller of the
+ * two for each bit array, as well as the time taken to convert between them.
+ * Roaring is a storage-only format, so queries pay the decoding time once for
+ * each bit array they read.
+ *
+ * Usage: bench_encodings <db.tsi> [max_genomes]
+ */
+
+#include "bitarray.h"
+#include "roaring.h"
+#include "tersect_db.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define DEFAULT_MAX_GENOMES 16
+
+static double elapsed_ms(const struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e3
+           + (end.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static void benchmark_chromosome(const tersect_db *tdb,
+                                 const struct chromosome *chrom,
+                                 size_t ngenomes, const struct genome *genomes)
+{
+    struct bitarray *bas = malloc(ngenomes * sizeof *bas);
+    struct roaring **rs = malloc(ngenomes * sizeof *rs);
+    size_t wah_size = 0;
+    size_t roaring_size = 0;
+    size_t smaller_size = 0;
+    struct timespec start;
+    double encode_ms = 0;
+    for (size_t i = 0; i < ngenomes; ++i) {
+        tersect_db_get_bitarray(tdb, &genomes[i], chrom, &bas[i]);
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        size_t size = roaring_size_from_bitarray(&bas[i]);
+        rs[i] = malloc(size);
+        roaring_from_bitarray(&bas[i], chrom->variant_count, rs[i]);
+        encode_ms += elapsed_ms(&start);
+        size_t array_size = bas[i].size * sizeof *bas[i].array;
+        wah_size += array_size;
+        roaring_size += size;
+        smaller_size += size < array_size ? size : array_size;
+    }
+
+    // Decoding back to WAH, as done by queries on Roaring bit arrays
+    bool mismatch = false;
+    double decode_ms = 0;
+    for (size_t i = 0; i < ngenomes; ++i) {
+        struct bitarray *decoded;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        roaring_to_bitarray(rs[i], &decoded);
+        decode_ms += elapsed_ms(&start);
+        uint64_t weight = bitarray_weight(&bas[i]);
+        if (bitarray_weight(decoded) != weight
+            || bitarray_intersection_count(decoded, &bas[i]) != weight) {
+            mismatch = true;
+        }
+        free_bitarray(decoded);
+    }
+
+    printf("%s\t%zu\t%zu\t%zu\t%.3f\t%.3f%s\n",
+           chrom->name, wah_size, roaring_size, smaller_size, encode_ms,
+           decode_ms, mismatch ? "\tMISMATCH" : "");
+
+    for (size_t i = 0; i < ngenomes; ++i) {
+        free(rs[i]);
+    }
+    free(rs);
+    free(bas);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2) {
+        fprintf(stderr, "Usage: %s <db.tsi> [max_genomes]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    size_t max_genomes = argc > 2 ? strtoul(argv[2], NULL, 10)
+                                  : DEFAULT_MAX_GENOMES;
+    tersect_db *tdb = tersect_db_open_readonly(argv[1], TDB_ACCESS_DEFAULT);
+    if (tdb == NULL) {
+        fprintf(stderr, "Could not open %s\n", argv[1]);
+        return EXIT_FAILURE;
+    }
+    size_t ngenomes;
+    struct genome *genomes;
+    if (tersect_db_get_genomes(tdb, 0, NULL, 0, NULL,
+                               &ngenomes, &genomes) != SUCCESS
+        || !ngenomes) {
+        tersect_db_close(tdb);
+        return EXIT_FAILURE;
+    }
+    if (ngenomes > max_genomes) ngenomes = max_genomes;
+    size_t nchroms;
+    struct chromosome *chroms;
+    tersect_db_get_chromosomes(tdb, &nchroms, &chroms);
+    printf("#CHROM\tWAH_BYTES\tROARING_BYTES\tSMALLER_BYTES\tENCODE_MS"
+           "\tDECODE_MS\n");
+    for (size_t i = 0; i < nchroms; ++i) {
+        benchmark_chromosome(tdb, &chroms[i], ngenomes, genomes);
+    }
+    free(chroms);
+    free(genomes);
+    tersect_db_close(tdb);
+    return EXIT_SUCCESS;
+}
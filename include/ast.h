@@ -26,8 +26,11 @@ SOFTWARE. */
 #define AST_H
 
 #include "bitarray.h"
+#include "task_pool.h"
 #include "tersect_db.h"
 
+#include <stdbool.h>
+
 /**
  * AST node types (set theoretical operations / bit arrays / genomes).
  */
@@ -35,13 +38,40 @@ SOFTWARE. */
 #define AST_UNION 2
 #define AST_DIFFERENCE 3
 #define AST_SYMMETRIC_DIFFERENCE 4
+#define AST_NARY 5
+#define AST_COMPLEMENT 6
+#define AST_ATLEAST 7
+#define AST_ATMOST 8
+#define AST_EXACTLY 9
 #define AST_GENOME 10
+#define AST_ALL 11
+
+/**
+ * Binary operation nodes use the l and r children, while n-ary (AST_NARY) nodes
+ * apply their operation (one of the types above) to an array of nchildren
+ * children at once. Threshold operations (AST_ATLEAST, AST_ATMOST and
+ * AST_EXACTLY) are always n-ary and compare against the threshold member.
+ * Complement (AST_COMPLEMENT) nodes only use the l child and AST_ALL nodes,
+ * standing for all the variants in the queried region, have no children.
+ *
+ * Identical subtrees of a compiled query are shared, refs counting the number
+ * of parents of a node.
+ */
+struct query_program;
 
 struct ast_node {
     int type;
     struct ast_node *l;
     struct ast_node *r;
     struct genome *genome;
+    int operation;
+    size_t nchildren;
+    struct ast_node **children;
+    uint64_t threshold;
+    size_t refs;
+    bitarray_pool *pool; // Storage for intermediate results (root node only)
+    struct query_program *program; // Compiled query (root node only)
+    task_pool *tasks; // Threads evaluating subtrees (root node only)
 };
 
 /**
@@ -50,11 +80,27 @@ struct ast_node {
  */
 struct ast_node *create_subtree(int operation_type, size_t ngenomes,
                                 struct genome *genomes);
+struct ast_node *create_threshold_subtree(int operation_type,
+                                          uint64_t threshold,
+                                          size_t ngenomes,
+                                          struct genome *genomes);
 struct ast_node *create_ast_node(int operation_type, struct ast_node *l,
                                  struct ast_node *r);
 struct ast_node *create_genome_node(struct genome *genome);
+struct ast_node *create_all_node(void);
+struct ast_node *create_nary_node(int operation_type, size_t nchildren,
+                                  struct ast_node **children);
+bool ast_is_merged(const struct ast_node *node);
+void prepare_ast(struct ast_node *root, task_pool *tasks);
 struct bitarray *eval_ast(struct ast_node *root, const tersect_db *tdb,
                           const struct tersect_db_interval *ti);
+void release_ast_result(struct ast_node *root, struct bitarray *result);
+uint64_t count_ast(struct ast_node *root, const tersect_db *tdb,
+                   const struct tersect_db_interval *ti);
+void count_ast_bins(struct ast_node *root, const tersect_db *tdb,
+                    const struct tersect_db_interval *ti,
+                    size_t nbins, const struct tersect_db_interval *bins,
+                    uint64_t *counts);
 void free_ast(struct ast_node *root);
 
 #endif
@@ -25,6 +25,7 @@ SOFTWARE. */
 #ifndef BITARRAY_H
 #define BITARRAY_H
 
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdint.h>
 
@@ -38,22 +39,46 @@ extern const uint16_t bitarray_word_capacity; // number of booleans in word
 /*
  * The BitArray is a structure meant for compact storage and fast set
  * theoretical operations on sets of boolean values. The structure stores two
- * "sizes": the size element corresponds to the actual number of boolean values
- * stored, while the word_capacity element is an internal variable which tracks
- * the size of allocated storage (*array) in terms of multiples of an unsigned
- * integer type.
+ * "sizes": the size element corresponds to the number of words in use, while
+ * the capacity element tracks the size of allocated storage (*array). Bit
+ * arrays which do not own their storage (such as those extracted from a larger
+ * bit array or loaded from a database) have a capacity of zero.
+ *
+ * Words with the most significant bit set are literal words. Other words are
+ * fill words, standing for a run of words with no bits set (zero fills) or, if
+ * the second most significant bit is set, with all bits set (one fills).
  *
  * The start and end masks are used to delimit the valid bits in a sub-bit array
  * extracted from a larger one. Note that the internal *array of such an
- * extracted bit array points to the original array, not a copy.
+ * extracted bit array points to the original array, not a copy. If the first
+ * or last word is a fill, the corresponding mask holds the number of its words
+ * included in the array instead, and the start and end bits delimit the valid
+ * bits of the first and last words of a one fill.
+ *
+ * Bit arrays loaded from a database may also carry a skip index, used to jump
+ * close to a given position without decoding all the preceding words.
  */
 struct bitarray {
     size_t size; // Size in terms of bitarray_word variables
     size_t last_word; // Position of previously set bit
     size_t ncompressed; // Number of compressed words
+    size_t capacity; // Number of allocated words, zero if not owned
     bitarray_word *array;
     bitarray_word start_mask;
     bitarray_word end_mask;
+    bitarray_word start_bits;
+    bitarray_word end_bits;
+    const struct bitarray_skip_index *skip_index; // NULL if not available
+};
+
+/**
+ * Sampled index of a compressed bit array. For every interval-th word of the
+ * array, stores the number of uncompressed words preceding it.
+ */
+struct bitarray_skip_index {
+    uint32_t interval;
+    uint32_t count;
+    uint64_t offsets[];
 };
 
 /**
@@ -75,15 +100,80 @@ ba_bin_it *init_bitarray_bin_iterator(const struct bitarray *src_ba,
 void bitarray_bin_iterator_next(ba_bin_it *it, struct bitarray *out);
 void free_bitarray_bin_iterator(ba_bin_it *it);
 
+/**
+ * Iterator for traversing the indices of set bits in a bit array in ascending
+ * order. It does not allocate memory, so it can be declared on the stack and
+ * does not need to be freed.
+ */
+struct bitarray_set_iterator {
+    const struct bitarray *ba;
+    size_t pos; // Position of the next word to load
+    uint64_t next_word_index; // Uncompressed index of the next word to load
+    uint64_t nfill; // Words of the current one fill not yet loaded
+    uint64_t base; // Index of the first bit in the current word
+    bitarray_word word; // Set bits of the current word not yet returned
+};
+void init_bitarray_set_iterator(struct bitarray_set_iterator *it,
+                                const struct bitarray *ba);
+bool bitarray_set_iterator_next(struct bitarray_set_iterator *it,
+                                uint64_t *index);
+size_t bitarray_set_iterator_next_batch(struct bitarray_set_iterator *it,
+                                        size_t max_indices, uint64_t *indices);
+
+/**
+ * Builder writing out a compressed bit array directly from bits set in
+ * ascending order, either as sorted batches of indices or as dense blocks of 64
+ * bits. Storage is sized from a hint of the expected number of bits and grows
+ * geometrically. The finished array is handed over to the caller and the
+ * builder starts a new one.
+ */
+struct bitarray_builder {
+    struct bitarray *ba; // Array being built
+    size_t pos; // Number of words written to the array
+    uint64_t word_index; // Uncompressed index of the pending word
+    bitarray_word word; // Pending literal word
+    uint64_t size_hint; // Expected number of bits
+};
+void init_bitarray_builder(struct bitarray_builder *builder,
+                           uint64_t size_hint);
+int bitarray_builder_add(struct bitarray_builder *builder, size_t nindices,
+                         const uint64_t *indices);
+int bitarray_builder_add_block(struct bitarray_builder *builder,
+                               uint64_t start, uint64_t bits);
+struct bitarray *bitarray_builder_finish(struct bitarray_builder *builder,
+                                         uint64_t nbits);
+void free_bitarray_builder(struct bitarray_builder *builder);
+
+/**
+ * Iterator over the bits of nbas bit arrays (covering the same region) along
+ * with the number of arrays in which each bit is set, visiting only bits set
+ * in between min_count and max_count arrays (inclusive). A min_count of 0
+ * includes bits not set in any of the arrays.
+ */
+typedef struct bitarray_count_iterator ba_count_it;
+ba_count_it *init_bitarray_count_iterator(size_t nbas,
+                                          const struct bitarray *bas,
+                                          uint64_t min_count,
+                                          uint64_t max_count);
+size_t bitarray_count_iterator_next_batch(ba_count_it *it, size_t max_bits,
+                                          uint64_t *indices, uint64_t *counts);
+void free_bitarray_count_iterator(ba_count_it *it);
+
 /*
  * Initialisation/allocation, zeroing and deallocation routines.
  */
 struct bitarray *init_bitarray(uint64_t bit_size);
+struct bitarray *init_full_bitarray(const struct bitarray_interval *region);
 struct bitarray *copy_bitarray(const struct bitarray *ba);
+struct bitarray *bitarray_compact(const struct bitarray *ba);
 void clear_bitarray(struct bitarray *ba);
 void free_bitarray(struct bitarray *ba);
 void bitarray_shrinkwrap(struct bitarray *ba);
 void bitarray_resize(struct bitarray *ba, uint64_t new_size);
+void bitarray_reserve(struct bitarray *ba, size_t nwords);
+size_t bitarray_skip_index_size(const struct bitarray *ba, uint32_t interval);
+void bitarray_build_skip_index(const struct bitarray *ba, uint32_t interval,
+                               struct bitarray_skip_index *out);
 
 /*
  * Routines meant for randomising, printing, and writing the contents of bit
@@ -92,8 +182,19 @@ void bitarray_resize(struct bitarray *ba, uint64_t new_size);
 void print_bitarray(const struct bitarray *ba);
 void print_set_indices(const struct bitarray *ba);
 
+/**
+ * Pool of reusable bit arrays for intermediate results, so that evaluating a
+ * query does not need to allocate storage for every operation.
+ */
+typedef struct bitarray_pool bitarray_pool;
+bitarray_pool *init_bitarray_pool(void);
+struct bitarray *bitarray_pool_get(bitarray_pool *pool);
+void bitarray_pool_put(bitarray_pool *pool, struct bitarray *ba);
+void free_bitarray_pool(bitarray_pool *pool);
+
 /*
- * Routines for set theoretical operations.
+ * Routines for set theoretical operations. The _into variants write into an
+ * existing bit array, reusing its storage if it is large enough.
  */
 void bitarray_intersection(const struct bitarray *a,
                            const struct bitarray *b,
@@ -107,8 +208,30 @@ void bitarray_symmetric_difference(const struct bitarray *a,
 void bitarray_union(const struct bitarray *a,
                     const struct bitarray *b,
                     struct bitarray **out);
+void bitarray_complement(const struct bitarray *ba, struct bitarray **out);
+void bitarray_intersection_into(const struct bitarray *a,
+                                const struct bitarray *b,
+                                struct bitarray *out);
+void bitarray_difference_into(const struct bitarray *a,
+                              const struct bitarray *b,
+                              struct bitarray *out);
+void bitarray_symmetric_difference_into(const struct bitarray *a,
+                                        const struct bitarray *b,
+                                        struct bitarray *out);
+void bitarray_union_into(const struct bitarray *a, const struct bitarray *b,
+                         struct bitarray *out);
+void bitarray_complement_into(const struct bitarray *ba, struct bitarray *out);
 uint64_t bitarray_distance(const struct bitarray *a, const struct bitarray *b);
+uint64_t bitarray_intersection_count(const struct bitarray *a,
+                                     const struct bitarray *b);
+uint64_t bitarray_difference_count(const struct bitarray *a,
+                                   const struct bitarray *b);
+uint64_t bitarray_symmetric_difference_count(const struct bitarray *a,
+                                             const struct bitarray *b);
+uint64_t bitarray_union_count(const struct bitarray *a,
+                              const struct bitarray *b);
 uint64_t bitarray_weight(const struct bitarray *ba);
+size_t bitarray_fill_count(const struct bitarray *ba);
 void bitarray_extract_region(struct bitarray *dest_ba,
                              const struct bitarray *src_ba,
                              const struct bitarray_interval *region);
@@ -117,12 +240,95 @@ void bitarray_extract_bins(struct bitarray *dest_bas,
                            size_t nbins,
                            const struct bitarray_interval *bins);
 
+/*
+ * Multi-way variants of the set theoretical operations, taking an array of
+ * nbas bit arrays covering the same region.
+ */
+void bitarray_intersection_many(size_t nbas, const struct bitarray *bas,
+                                struct bitarray **out);
+void bitarray_symmetric_difference_many(size_t nbas,
+                                        const struct bitarray *bas,
+                                        struct bitarray **out);
+void bitarray_union_many(size_t nbas, const struct bitarray *bas,
+                         struct bitarray **out);
+void bitarray_atleast_many(size_t nbas, const struct bitarray *bas,
+                           uint64_t k, struct bitarray **out);
+void bitarray_atmost_many(size_t nbas, const struct bitarray *bas,
+                          uint64_t k, struct bitarray **out);
+void bitarray_exactly_many(size_t nbas, const struct bitarray *bas,
+                           uint64_t k, struct bitarray **out);
+void bitarray_intersection_many_into(size_t nbas, const struct bitarray *bas,
+                                     struct bitarray *out);
+void bitarray_symmetric_difference_many_into(size_t nbas,
+                                             const struct bitarray *bas,
+                                             struct bitarray *out);
+void bitarray_union_many_into(size_t nbas, const struct bitarray *bas,
+                              struct bitarray *out);
+void bitarray_atleast_many_into(size_t nbas, const struct bitarray *bas,
+                                uint64_t k, struct bitarray *out);
+void bitarray_atmost_many_into(size_t nbas, const struct bitarray *bas,
+                               uint64_t k, struct bitarray *out);
+void bitarray_exactly_many_into(size_t nbas, const struct bitarray *bas,
+                                uint64_t k, struct bitarray *out);
+
+/**
+ * Word-level programs combining any number of operand bit arrays (covering the
+ * same region) in a single pass. A program is a sequence of stack instructions
+ * applied to every word position at once, e.g. (A & B) \ C is:
+ *
+ *      PUSH 0, PUSH 1, AND, PUSH 2, ANDNOT
+ *
+ * Threshold instructions replace the top arg entries of the stack with the
+ * bits set in at least/at most/exactly k of them. Results used more than once
+ * can be kept in registers, e.g. (A & B) | ((A & B) ^ C) is:
+ *
+ *      PUSH 0, PUSH 1, AND, STORE 0, LOAD 0, PUSH 2, XOR, OR
+ */
+#define BA_OP_PUSH          0 // Push the words of operand arg
+#define BA_OP_PUSH_ALL      1 // Push full words
+#define BA_OP_AND           2
+#define BA_OP_OR            3
+#define BA_OP_ANDNOT        4
+#define BA_OP_XOR           5
+#define BA_OP_NOT           6
+#define BA_OP_ATLEAST       7
+#define BA_OP_ATMOST        8
+#define BA_OP_EXACTLY       9
+#define BA_OP_STORE        10 // Copy the top entry into register arg
+#define BA_OP_LOAD         11 // Push the entry held in register arg
+
+struct bitarray_instruction {
+    int opcode;
+    size_t arg;
+    uint64_t k;
+};
+
+struct bitarray_program {
+    size_t ninstructions;
+    size_t capacity;
+    struct bitarray_instruction *instructions;
+    size_t noperands;
+    size_t nregisters;
+    size_t depth; // Stack depth after the last instruction
+    size_t stack_size; // Maximum stack depth
+};
+
+struct bitarray_program *init_bitarray_program(void);
+void free_bitarray_program(struct bitarray_program *prog);
+void bitarray_program_append(struct bitarray_program *prog, int opcode,
+                             size_t arg, uint64_t k);
+void bitarray_program_eval_into(const struct bitarray_program *prog,
+                                const struct bitarray *operands,
+                                const struct bitarray_interval *region,
+                                struct bitarray *out);
+uint64_t bitarray_program_count(const struct bitarray_program *prog,
+                                const struct bitarray *operands,
+                                const struct bitarray_interval *region);
+
 /*
  * Routines for manipulating individual bits.
  */
 int bitarray_set_bit(struct bitarray *bitset, size_t pos);
 int bitarray_get_bit(const struct bitarray *ba, size_t pos);
-int bitarray_get_set_indices(const struct bitarray *ba,
-                             size_t *nset_indices, size_t **set_indices);
 
 #endif
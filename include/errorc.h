@@ -32,6 +32,7 @@ typedef enum error_t {
     E_NO_GENOME = 600,
     E_NO_TSI_FILE = 700,
     E_TSI_NOPEN = 701,
+    E_TSI_ACCESS_HINT = 702,
     E_BUILD_NO_OUTNAME = 5000,
     E_BUILD_NO_FILES = 5001,
     E_BUILD_CREATE = 5002,
@@ -41,16 +42,21 @@ typedef enum error_t {
     E_PARSE_REGION = 6000,
     E_PARSE_REGION_NO_CHROMOSOME = 6001,
     E_PARSE_REGION_BAD_BOUNDS = 6002,
+    E_PARSE_BIN_SIZE = 6003,
     E_PARSE_ALLELE = 7000,
     E_PARSE_ALLELE_NO_CHROMOSOME = 7001,
     E_PARSE_ALLELE_BAD_POSITION = 7002,
     E_PARSE_ALLELE_UNKNOWN = 7003,
     E_VCF_PARSE_FILE = 7100,
+    E_PARSE_QUERY = 7200,
     E_VIEW_NO_QUERY = 8000,
+    E_VIEW_BIN_NO_COUNT = 8001,
+    E_VIEW_THREADS = 8002,
     E_RENAME_NOPEN = 9000,
     E_RENAME_PARSE = 9001,
     E_DIST_BIN_REGIONS = 10000,
-    E_DIST_LIST_NOPEN = 10001
+    E_DIST_LIST_NOPEN = 10001,
+    E_FREQ_NO_GENLIST = 11000
 } error_t;
 
 extern struct error_desc {
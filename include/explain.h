@@ -0,0 +1,41 @@
+/*  explain.h
+
+    Copyright (C) 2019 Cranfield University
+
+    Author: Tomasz Kurowski <t.j.kurowski@cranfield.ac.uk>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#ifndef EXPLAIN_H
+#define EXPLAIN_H
+
+#include "ast.h"
+#include "tersect_db.h"
+
+#include <stdbool.h>
+#include <stdio.h>
+
+void explain_query(FILE *stream, const char *query, bool optimized,
+                   struct ast_node *root, const tersect_db *tdb, bool json);
+void analyze_query(FILE *stream, const char *query, bool optimized,
+                   struct ast_node *root, const tersect_db *tdb,
+                   size_t nregions, const struct genomic_interval *regions,
+                   bool json);
+
+#endif
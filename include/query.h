@@ -25,9 +25,41 @@ SOFTWARE. */
 #ifndef QUERY_H
 #define QUERY_H
 
-#include "bitarray.h"
+#include "ast.h"
+#include "errorc.h"
 #include "tersect_db.h"
 
-struct ast_node *run_set_parser(const char *query, const tersect_db *tdb);
+#include <stddef.h>
+#include <stdio.h>
+
+#define QUERY_ERROR_LENGTH 256
+
+/**
+ * Describes the first error found while parsing a query. The start and end
+ * offsets delimit the part of the query string the error refers to.
+ */
+struct query_error {
+    size_t start;
+    size_t end;
+    char message[QUERY_ERROR_LENGTH];
+};
+
+/**
+ * Result of a set query, which is either a single (possibly virtual) genome
+ * described by an AST or a list of genomes.
+ */
+struct query_result {
+    struct ast_node *ast;
+    size_t ngenomes;
+    struct genome *genomes;
+};
+
+error_t run_set_parser(const char *query, const tersect_db *tdb,
+                       struct query_result *result, struct query_error *error);
+error_t run_genlist_parser(const char *genlist, const tersect_db *tdb,
+                           size_t *ngenomes, struct genome **genomes,
+                           struct query_error *error);
+void print_query_error(FILE *stream, const char *query,
+                       const struct query_error *error);
 
 #endif
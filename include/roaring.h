@@ -0,0 +1,80 @@
+/*  roaring.h
+
+    Copyright (C) 2019 Cranfield University
+
+    Author: Tomasz Kurowski <t.j.kurowski@cranfield.ac.uk>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#ifndef ROARING_H
+#define ROARING_H
+
+#include "bitarray.h"
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* Container types */
+#define ROARING_ARRAY   0
+#define ROARING_BITMAP  1
+#define ROARING_RUN     2
+
+#define ROARING_CHUNK_BITS  16 // Each container covers 2^16 bits
+
+/*
+ * Roaring-style bitmap, an alternative to the WAH bit array for very sparse
+ * and very dense data. The bits are split into chunks of 65536 and each
+ * non-empty chunk is stored in one of three containers, whichever is smallest:
+ * a sorted array of 16-bit offsets, a plain 65536-bit bitmap, or a list of runs
+ * of set bits (stored as pairs of 16-bit start offsets and lengths minus one).
+ *
+ * The structure is a single contiguous block (header, container table and
+ * container contents) so that it can be stored directly in a memory-mapped
+ * database. Container offsets are in bytes from the start of the block.
+ *
+ * This is a storage-only format: queries convert Roaring bitmaps back into WAH
+ * bit arrays and run on those.
+ */
+struct roaring_container {
+    uint32_t key; // Index of the chunk, i.e. bit index >> ROARING_CHUNK_BITS
+    uint16_t type;
+    uint16_t reserved;
+    uint32_t cardinality; // Number of set bits
+    uint32_t length; // Number of array values, bitmap words or runs
+    uint64_t offset;
+};
+
+struct roaring {
+    uint64_t nbits; // Number of bits represented, both set and unset
+    uint32_t ncontainers;
+    uint32_t reserved;
+    struct roaring_container containers[];
+};
+
+/*
+ * Conversion between WAH bit arrays and Roaring bitmaps. The output of
+ * roaring_from_bitarray needs to be at least roaring_size_from_bitarray bytes
+ * long. The output of roaring_to_bitarray needs to be freed with free_bitarray.
+ */
+size_t roaring_size_from_bitarray(const struct bitarray *ba);
+void roaring_from_bitarray(const struct bitarray *ba, uint64_t nbits,
+                           struct roaring *out);
+void roaring_to_bitarray(const struct roaring *r, struct bitarray **out);
+
+#endif
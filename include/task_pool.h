@@ -0,0 +1,52 @@
+/*  task_pool.h
+
+    Copyright (C) 2019 Cranfield University
+
+    Author: Tomasz Kurowski <t.j.kurowski@cranfield.ac.uk>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#ifndef TASK_POOL_H
+#define TASK_POOL_H
+
+#include <stddef.h>
+
+/**
+ * Pool of worker threads running independent tasks. Each worker keeps its own
+ * deque of tasks, taking the most recently submitted task from its end and
+ * stealing the oldest task from the other end of the other deques when it runs
+ * out. Tasks submitted by threads outside the pool go into a shared deque.
+ *
+ * Tasks are submitted as part of a group, which is waited on as a whole. A
+ * waiting thread runs queued tasks itself until the group is finished, so that
+ * tasks may in turn submit and wait on tasks of their own.
+ */
+typedef struct task_pool task_pool;
+
+struct task_group {
+    size_t pending; // Number of submitted tasks yet to finish
+};
+
+task_pool *init_task_pool(size_t nworkers);
+void task_pool_submit(task_pool *pool, struct task_group *group,
+                      void (*run)(void *arg), void *arg);
+void task_pool_wait(task_pool *pool, struct task_group *group);
+void free_task_pool(task_pool *pool);
+
+#endif
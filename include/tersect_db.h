@@ -33,9 +33,23 @@ SOFTWARE. */
 #include <stdint.h>
 
 /* Database operation flags */
+#define TDB_READONLY    1
 #define TDB_FORCE       2
 #define TDB_VERBOSE     4
 
+/* Memory access hints for databases opened read-only */
+#define TDB_ACCESS_DEFAULT      0
+#define TDB_ACCESS_SEQUENTIAL   1
+#define TDB_ACCESS_RANDOM       2
+#define TDB_ACCESS_WILLNEED     4
+#define TDB_ACCESS_POPULATE     8
+#define TDB_ACCESS_HUGEPAGES    16
+
+/* Bit array encodings */
+#define TDB_ENCODING_WAH        0
+#define TDB_ENCODING_ROARING    1
+#define TDB_ENCODING_AUTO       2 // Smaller of the two for each bit array
+
 /* Opaque header handles */
 typedef struct chrom_hdr chrom_hdr;
 typedef struct genome_hdr genome_hdr;
@@ -53,6 +67,16 @@ struct chromosome {
 struct genome {
     char *name;
     genome_hdr *hdr;
+    uint32_t ordinal; // Order in which the genome was added to the database
+};
+
+/**
+ * Statistics of the bit arrays of a genome summed over all chromosomes, as
+ * recorded when the database was built.
+ */
+struct genome_stats {
+    uint64_t weight; // Number of variants, zero if not recorded
+    uint64_t size; // Size of the (compressed) bit arrays in bytes
 };
 
 /**
@@ -80,6 +104,19 @@ typedef struct tersect_db tersect_db;
 
 error_t tersect_db_create(const char *filename, int flags, tersect_db **tdb);
 tersect_db *tersect_db_open(const char *filename);
+
+/**
+ * Opens an existing database for querying only, without requiring write
+ * permission to the file. The hints argument combines TDB_ACCESS_* hints
+ * passed on to the kernel for the database mapping.
+ */
+tersect_db *tersect_db_open_readonly(const char *filename, int hints);
+
+/**
+ * Parses a comma-separated list of access hint names (default, sequential,
+ * random, willneed, populate, hugepages) into TDB_ACCESS_* flags.
+ */
+error_t tersect_db_parse_access(const char *names, int *hints);
 void tersect_db_close(tersect_db *tdb);
 error_t tersect_db_insert_allele(tersect_db *tdb, const struct allele *allele,
                                  struct variant *out);
@@ -97,11 +134,16 @@ error_t tersect_db_get_genomes(const tersect_db *tdb,
                                size_t ncont, char *const *contains,
                                size_t *ngenomes, struct genome **genomes);
 void tersect_db_add_bitarray(tersect_db *tdb, const char *genome,
-                             const char *chromosome, const struct bitarray *ba);
+                             const char *chromosome, const struct bitarray *ba,
+                             int encoding);
 void tersect_db_get_bitarray(const tersect_db *tdb,
                              const struct genome *gen,
                              const struct chromosome *chr,
                              struct bitarray *output);
+bool tersect_db_has_weights(const tersect_db *tdb);
+void tersect_db_get_genome_stats(const tersect_db *tdb, size_t ngenomes,
+                                 const struct genome *genomes,
+                                 struct genome_stats *stats);
 void tersect_db_get_chromosomes(const tersect_db *tdb,
                                 size_t *nchroms, struct chromosome **chroms);
 void tersect_db_get_chromosome(const tersect_db *tdb, const char *name,
@@ -134,6 +176,11 @@ error_t tersect_db_parse_regions(const tersect_db *tdb, size_t nregions,
                                  char **region_strings,
                                  struct genomic_interval **output);
 
+/**
+ * Parses a bin size, which must be a positive integer that fits in 32 bits.
+ */
+error_t tersect_db_parse_bin_size(const char *str, uint32_t *bin_size);
+
 error_t tersect_db_get_regions(const tersect_db *tdb,
                                size_t *nregions,
                                struct genomic_interval **output);
@@ -28,20 +28,34 @@ SOFTWARE. */
 #include "bitarray.h"
 #include "tersect_db.h"
 
+#include <stdio.h>
+
 /**
  * https://samtools.github.io/hts-specs/VCFv4.3.pdf
  */
 #define VCF_FORMAT "VCFv4.3"
 
 /**
- * Prints VCF lines from an interval based on a bit array index.
+ * Prints VCF lines from an interval based on a bit array index to a stream.
  */
-void vcf_print_bitarray(const tersect_db *tdb, const struct bitarray *ba,
+void vcf_print_bitarray(FILE *stream, const tersect_db *tdb,
+                        const struct bitarray *ba,
                         const struct tersect_db_interval *ti);
 
 /**
- * Prints VCF metadata lines and header.
+ * Prints VCF lines for the variants visited by a count iterator, with the
+ * number (AC) and fraction (AF) of the nsamples samples carrying each variant
+ * in the INFO field.
+ */
+void vcf_print_counts(const tersect_db *tdb, ba_count_it *it,
+                      uint64_t nsamples, const struct tersect_db_interval *ti);
+
+/**
+ * Prints VCF metadata lines and header. The count header also defines the INFO
+ * fields used by vcf_print_counts.
  */
 void vcf_print_header(const char *command, size_t nregions,
                       char **region_strings);
+void vcf_print_count_header(const char *command, size_t nregions,
+                            char **region_strings);
 #endif
@@ -23,13 +23,27 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE. */
 
 #include "ast.h"
+#include "hashmap.h"
 
+#include <inttypes.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 
-static struct bitarray *eval_node(struct ast_node *node,
-                                  const tersect_db *tdb,
-                                  const struct tersect_db_interval *ti);
+/*
+ * N-ary operations on genomes with more operands than this are evaluated
+ * separately by the multi-way merge, which only visits the operands holding set
+ * bits at each position, rather than fused into the query program.
+ */
+#define FUSED_NARY_MAX 16
+
+/*
+ * Operands evaluated by the multi-way merge are handed to other threads (if
+ * available) when their genomes span at least this many words in total.
+ * Smaller ones are evaluated inline, as they would not make up for the cost of
+ * scheduling them.
+ */
+#define PARALLEL_MIN_WORDS 16384
 
 /**
  * Allocate and initialise abstract syntax tree node for a binary operation.
@@ -41,6 +55,10 @@ struct ast_node *create_ast_node(int operation_type, struct ast_node *l,
     node->type = operation_type;
     node->l = l;
     node->r = r;
+    node->refs = 1;
+    node->pool = NULL;
+    node->program = NULL;
+    node->tasks = NULL;
     return node;
 }
 
@@ -50,86 +68,592 @@ struct ast_node *create_genome_node(struct genome *genome)
     node->type = AST_GENOME;
     node->genome = malloc(sizeof *node->genome);
     *(node->genome) = *genome;
+    node->refs = 1;
+    node->pool = NULL;
+    node->program = NULL;
+    node->tasks = NULL;
+    return node;
+}
+
+struct ast_node *create_all_node(void)
+{
+    struct ast_node *node = malloc(sizeof *node);
+    node->type = AST_ALL;
+    node->refs = 1;
+    node->pool = NULL;
+    node->program = NULL;
+    node->tasks = NULL;
+    return node;
+}
+
+/**
+ * Allocate and initialise abstract syntax tree node for an operation applied to
+ * any number of operands. Takes ownership of the children array.
+ */
+struct ast_node *create_nary_node(int operation_type, size_t nchildren,
+                                  struct ast_node **children)
+{
+    struct ast_node *node = malloc(sizeof *node);
+    node->type = AST_NARY;
+    node->operation = operation_type;
+    node->nchildren = nchildren;
+    node->children = children;
+    node->refs = 1;
+    node->pool = NULL;
+    node->program = NULL;
+    node->tasks = NULL;
     return node;
 }
 
 struct ast_node *create_subtree(int operation_type, size_t ngenomes,
                                 struct genome *genomes)
 {
-    struct ast_node *root = create_genome_node(&genomes[0]);
-    for (size_t i = 1; i < ngenomes; ++i) {
-        root = create_ast_node(operation_type, root,
-                               create_genome_node(&genomes[i]));
+    if (ngenomes == 1) {
+        return create_genome_node(&genomes[0]);
+    }
+    struct ast_node **children = malloc(ngenomes * sizeof *children);
+    for (size_t i = 0; i < ngenomes; ++i) {
+        children[i] = create_genome_node(&genomes[i]);
     }
-    return root;
+    return create_nary_node(operation_type, ngenomes, children);
 }
 
 /**
- * Allocates memory for the container struct.
+ * Create AST subtree selecting the variants found in at least/at most/exactly
+ * threshold genomes of a list and return its root. Unlike the other n-ary
+ * operations, a threshold over a single genome is kept as a n-ary node.
  */
-static struct bitarray *load_bitarray(const tersect_db *tdb, struct genome *genome,
-                                      const struct tersect_db_interval *ti)
+struct ast_node *create_threshold_subtree(int operation_type,
+                                          uint64_t threshold,
+                                          size_t ngenomes,
+                                          struct genome *genomes)
+{
+    struct ast_node **children = malloc(ngenomes * sizeof *children);
+    for (size_t i = 0; i < ngenomes; ++i) {
+        children[i] = create_genome_node(&genomes[i]);
+    }
+    struct ast_node *node = create_nary_node(operation_type, ngenomes,
+                                             children);
+    node->threshold = threshold;
+    return node;
+}
+
+static inline void extract_genome_region(const tersect_db *tdb,
+                                         struct genome *genome,
+                                         const struct tersect_db_interval *ti,
+                                         struct bitarray *out)
 {
     struct bitarray ba;
     tersect_db_get_bitarray(tdb, genome, &ti->chromosome, &ba);
-    struct bitarray *region_ba = malloc(sizeof *region_ba);
-    bitarray_extract_region(region_ba, &ba, &ti->interval);
-    return region_ba;
+    bitarray_extract_region(out, &ba, &ti->interval);
 }
 
-static inline struct bitarray *ast_node_operation(struct ast_node *node,
-                                                  void (*op)(const struct bitarray*,
-                                                             const struct bitarray*,
-                                                             struct bitarray**),
-                                                  const tersect_db *tdb,
-                                                  const struct tersect_db_interval *ti)
+/**
+ * Returns the pool of bit arrays used for the intermediate results of a query,
+ * creating it on first use. It is kept with the root node so that successive
+ * evaluations of the query (e.g. over different regions) reuse its storage.
+ */
+static bitarray_pool *query_pool(struct ast_node *root)
 {
-    struct bitarray *ba = eval_node(node->l, tdb, ti);
-    struct bitarray *bb = eval_node(node->r, tdb, ti);
-    struct bitarray *out;
-    op(ba, bb, &out);
-    if (node->l->type == AST_GENOME) {
-        free(ba);
-    } else {
-        free_bitarray(ba);
+    if (root->pool == NULL) {
+        root->pool = init_bitarray_pool();
     }
-    if (node->r->type == AST_GENOME) {
-        free(bb);
-    } else {
-        free_bitarray(bb);
+    return root->pool;
+}
+
+/**
+ * Combines all children (genomes) of an n-ary node in a single multi-way
+ * operation. Genome regions are extracted directly into the operand array.
+ */
+static void ast_nary_operation(struct ast_node *node, const tersect_db *tdb,
+                               const struct tersect_db_interval *ti,
+                               struct bitarray *out)
+{
+    struct bitarray *bas = malloc(node->nchildren * sizeof *bas);
+    for (size_t i = 0; i < node->nchildren; ++i) {
+        extract_genome_region(tdb, node->children[i]->genome, ti, &bas[i]);
     }
-    return out;
+    switch (node->operation) {
+    case AST_INTERSECTION:
+        bitarray_intersection_many_into(node->nchildren, bas, out);
+        break;
+    case AST_UNION:
+        bitarray_union_many_into(node->nchildren, bas, out);
+        break;
+    case AST_SYMMETRIC_DIFFERENCE:
+        bitarray_symmetric_difference_many_into(node->nchildren, bas, out);
+        break;
+    case AST_ATLEAST:
+        bitarray_atleast_many_into(node->nchildren, bas, node->threshold,
+                                   out);
+        break;
+    case AST_ATMOST:
+        bitarray_atmost_many_into(node->nchildren, bas, node->threshold,
+                                  out);
+        break;
+    case AST_EXACTLY:
+        bitarray_exactly_many_into(node->nchildren, bas, node->threshold,
+                                   out);
+        break;
+    }
+    free(bas);
 }
 
-static struct bitarray *eval_node(struct ast_node *node, const tersect_db *tdb,
-                                  const struct tersect_db_interval *ti)
+/**
+ * A query compiled into a single word-level bit array program. Its operands
+ * are genomes and n-ary nodes too wide to be fused into the program, which are
+ * evaluated by the multi-way merge beforehand. The results of shared subtrees
+ * are kept in the registers of the program.
+ */
+struct query_program {
+    struct bitarray_program *program;
+    size_t noperands;
+    struct ast_node **operands;
+    size_t nshared;
+    struct ast_node **shared; // Shared subtrees, indexed by register
+};
+
+static size_t count_nodes(const struct ast_node *node)
 {
     switch (node->type) {
+    case AST_GENOME:
+    case AST_ALL:
+        return 1;
+    case AST_COMPLEMENT:
+        return 1 + count_nodes(node->l);
+    case AST_NARY: {
+        size_t count = 1;
+        for (size_t i = 0; i < node->nchildren; ++i) {
+            count += count_nodes(node->children[i]);
+        }
+        return count;
+    }
+    default:
+        return 1 + count_nodes(node->l) + count_nodes(node->r);
+    }
+}
+
+/**
+ * Returns a key identifying a node whose children have already been shared,
+ * so that identical subtrees differ only in the address of their root.
+ */
+static char *node_key(const struct ast_node *node)
+{
+    size_t nchildren = node->type == AST_NARY ? node->nchildren : 2;
+    size_t size = 64 + nchildren * 24;
+    char *key = malloc(size);
+    int len;
+    switch (node->type) {
+    case AST_GENOME:
+        snprintf(key, size, "%d:%p", node->type, (void *)node->genome->hdr);
+        break;
+    case AST_ALL:
+        snprintf(key, size, "%d", node->type);
+        break;
+    case AST_COMPLEMENT:
+        snprintf(key, size, "%d:%p", node->type, (void *)node->l);
+        break;
+    case AST_NARY:
+        len = snprintf(key, size, "%d:%d:%" PRIu64, node->type,
+                       node->operation, node->threshold);
+        for (size_t i = 0; i < node->nchildren; ++i) {
+            len += snprintf(key + len, size - len, ":%p",
+                            (void *)node->children[i]);
+        }
+        break;
+    default:
+        snprintf(key, size, "%d:%p:%p", node->type, (void *)node->l,
+                 (void *)node->r);
+    }
+    return key;
+}
+
+/**
+ * Replaces identical subtrees with a single shared node (hash-consing), so
+ * that each is evaluated only once. Returns the node to use in place of the
+ * one passed in.
+ */
+static struct ast_node *share_subtrees(struct ast_node *node, HashMap *nodes)
+{
+    switch (node->type) {
+    case AST_GENOME:
+    case AST_ALL:
+        break;
+    case AST_COMPLEMENT:
+        node->l = share_subtrees(node->l, nodes);
+        break;
+    case AST_NARY:
+        for (size_t i = 0; i < node->nchildren; ++i) {
+            node->children[i] = share_subtrees(node->children[i], nodes);
+        }
+        break;
+    default:
+        node->l = share_subtrees(node->l, nodes);
+        node->r = share_subtrees(node->r, nodes);
+    }
+    char *key = node_key(node);
+    struct ast_node *shared = hashmap_get(nodes, key);
+    if (shared == NULL) {
+        hashmap_insert(nodes, key, node);
+        shared = node;
+    } else {
+        ++shared->refs;
+        free_ast(node);
+    }
+    free(key);
+    return shared;
+}
+
+static inline void compile_operand(struct query_program *qp,
+                                   struct ast_node *node)
+{
+    qp->operands = realloc(qp->operands,
+                           (qp->noperands + 1) * sizeof *qp->operands);
+    qp->operands[qp->noperands] = node;
+    bitarray_program_append(qp->program, BA_OP_PUSH, qp->noperands++, 0);
+}
+
+static int binary_opcode(int type)
+{
+    switch (type) {
     case AST_INTERSECTION:
-        return ast_node_operation(node, &bitarray_intersection, tdb, ti);
+        return BA_OP_AND;
     case AST_UNION:
-        return ast_node_operation(node, &bitarray_union, tdb, ti);
+        return BA_OP_OR;
     case AST_DIFFERENCE:
-        return ast_node_operation(node, &bitarray_difference, tdb, ti);
-    case AST_SYMMETRIC_DIFFERENCE:
-        return ast_node_operation(node, &bitarray_symmetric_difference, tdb, ti);
+        return BA_OP_ANDNOT;
+    default:
+        return BA_OP_XOR;
+    }
+}
+
+static int threshold_opcode(int operation)
+{
+    switch (operation) {
+    case AST_ATLEAST:
+        return BA_OP_ATLEAST;
+    case AST_ATMOST:
+        return BA_OP_ATMOST;
+    default:
+        return BA_OP_EXACTLY;
+    }
+}
+
+static bool genomes_only(const struct ast_node *node)
+{
+    for (size_t i = 0; i < node->nchildren; ++i) {
+        if (node->children[i]->type != AST_GENOME) return false;
+    }
+    return true;
+}
+
+/**
+ * Returns true if a node is evaluated on its own by the multi-way merge, and
+ * used as an operand of the compiled query program.
+ */
+bool ast_is_merged(const struct ast_node *node)
+{
+    return node->type == AST_NARY && node->nchildren > FUSED_NARY_MAX
+           && genomes_only(node);
+}
+
+static void compile_node(struct query_program *qp, struct ast_node *node);
+
+static void compile_expression(struct query_program *qp,
+                               struct ast_node *node)
+{
+    switch (node->type) {
     case AST_GENOME:
-        return load_bitarray(tdb, node->genome, ti);
+        compile_operand(qp, node);
+        break;
+    case AST_ALL:
+        bitarray_program_append(qp->program, BA_OP_PUSH_ALL, 0, 0);
+        break;
+    case AST_COMPLEMENT:
+        compile_node(qp, node->l);
+        bitarray_program_append(qp->program, BA_OP_NOT, 0, 0);
+        break;
+    case AST_NARY:
+        if (ast_is_merged(node)) {
+            compile_operand(qp, node);
+        } else if (node->operation == AST_ATLEAST
+                   || node->operation == AST_ATMOST
+                   || node->operation == AST_EXACTLY) {
+            for (size_t i = 0; i < node->nchildren; ++i) {
+                compile_node(qp, node->children[i]);
+            }
+            bitarray_program_append(qp->program,
+                                    threshold_opcode(node->operation),
+                                    node->nchildren, node->threshold);
+        } else {
+            compile_node(qp, node->children[0]);
+            for (size_t i = 1; i < node->nchildren; ++i) {
+                compile_node(qp, node->children[i]);
+                bitarray_program_append(qp->program,
+                                        binary_opcode(node->operation), 0, 0);
+            }
+        }
+        break;
+    default:
+        compile_node(qp, node->l);
+        compile_node(qp, node->r);
+        bitarray_program_append(qp->program, binary_opcode(node->type), 0, 0);
     }
-    return NULL;
 }
 
+/**
+ * Compiles a subtree, evaluating shared subtrees into a register the first
+ * time they are encountered and loading them from it afterwards.
+ */
+static void compile_node(struct query_program *qp, struct ast_node *node)
+{
+    if (node->refs == 1 || node->type == AST_ALL) {
+        compile_expression(qp, node);
+        return;
+    }
+    for (size_t i = 0; i < qp->nshared; ++i) {
+        if (qp->shared[i] == node) {
+            bitarray_program_append(qp->program, BA_OP_LOAD, i, 0);
+            return;
+        }
+    }
+    compile_expression(qp, node);
+    qp->shared = realloc(qp->shared, (qp->nshared + 1) * sizeof *qp->shared);
+    qp->shared[qp->nshared] = node;
+    bitarray_program_append(qp->program, BA_OP_STORE, qp->nshared++, 0);
+}
+
+/**
+ * Returns the compiled program of a query, compiling it on first use.
+ */
+static struct query_program *query_program(struct ast_node *root)
+{
+    if (root->program == NULL) {
+        struct query_program *qp = malloc(sizeof *qp);
+        *qp = (struct query_program) {
+            .program = init_bitarray_program()
+        };
+        HashMap *nodes = init_hashmap(count_nodes(root));
+        root = share_subtrees(root, nodes);
+        free_hashmap(nodes);
+        compile_node(qp, root);
+        root->program = qp;
+    }
+    return root->program;
+}
+
+/**
+ * Compiles a query and sets up the storage for its intermediate results ahead
+ * of its evaluation, as both are otherwise created on first use. Needed before
+ * a query is evaluated by several threads at once. Independent subtrees are
+ * evaluated in parallel on the tasks pool, unless it is NULL.
+ */
+void prepare_ast(struct ast_node *root, task_pool *tasks)
+{
+    query_program(root);
+    query_pool(root);
+    root->tasks = tasks;
+}
+
+/**
+ * Operand evaluated by the multi-way merge on another thread.
+ */
+struct operand_task {
+    struct ast_node *node;
+    const tersect_db *tdb;
+    const struct tersect_db_interval *ti;
+    struct bitarray *out;
+};
+
+static void run_operand_task(void *arg)
+{
+    struct operand_task *task = arg;
+    ast_nary_operation(task->node, task->tdb, task->ti, task->out);
+}
+
+/**
+ * Loads the operands of a compiled query for an interval. Operands evaluated
+ * by the multi-way merge are taken from the pool and need to be returned to it
+ * through release_operands. Large ones are evaluated concurrently if a pool of
+ * threads is available.
+ */
+static struct bitarray *load_operands(const struct query_program *qp,
+                                      const tersect_db *tdb,
+                                      const struct tersect_db_interval *ti,
+                                      bitarray_pool *pool, task_pool *tasks,
+                                      struct bitarray ***results)
+{
+    struct bitarray *bas = malloc(qp->noperands * sizeof *bas);
+    *results = malloc(qp->noperands * sizeof **results);
+    struct operand_task *operand_tasks = NULL;
+    struct task_group group = { 0 };
+    uint64_t nwords = ti->interval.end_index / bitarray_word_capacity
+                      - ti->interval.start_index / bitarray_word_capacity + 1;
+    for (size_t i = 0; i < qp->noperands; ++i) {
+        struct ast_node *node = qp->operands[i];
+        if (node->type == AST_GENOME) {
+            extract_genome_region(tdb, node->genome, ti, &bas[i]);
+            (*results)[i] = NULL;
+            continue;
+        }
+        (*results)[i] = bitarray_pool_get(pool);
+        if (tasks == NULL || node->nchildren * nwords < PARALLEL_MIN_WORDS) {
+            ast_nary_operation(node, tdb, ti, (*results)[i]);
+            continue;
+        }
+        if (operand_tasks == NULL) {
+            operand_tasks = malloc(qp->noperands * sizeof *operand_tasks);
+        }
+        operand_tasks[i] = (struct operand_task) {
+            .node = node,
+            .tdb = tdb,
+            .ti = ti,
+            .out = (*results)[i]
+        };
+        task_pool_submit(tasks, &group, run_operand_task, &operand_tasks[i]);
+    }
+    if (operand_tasks != NULL) {
+        task_pool_wait(tasks, &group);
+        free(operand_tasks);
+    }
+    for (size_t i = 0; i < qp->noperands; ++i) {
+        if ((*results)[i] != NULL) {
+            bas[i] = *(*results)[i];
+        }
+    }
+    return bas;
+}
+
+static void release_operands(const struct query_program *qp,
+                             bitarray_pool *pool, struct bitarray *bas,
+                             struct bitarray **results)
+{
+    for (size_t i = 0; i < qp->noperands; ++i) {
+        if (results[i] != NULL) {
+            bitarray_pool_put(pool, results[i]);
+        }
+    }
+    free(results);
+    free(bas);
+}
+
+/**
+ * Evaluates a query into a bit array taken from the query pool, in a single
+ * pass over all its operands.
+ */
+static struct bitarray *eval_program(struct ast_node *root,
+                                     const tersect_db *tdb,
+                                     const struct tersect_db_interval *ti)
+{
+    struct query_program *qp = query_program(root);
+    bitarray_pool *pool = query_pool(root);
+    struct bitarray **results;
+    struct bitarray *bas = load_operands(qp, tdb, ti, pool, root->tasks,
+                                         &results);
+    struct bitarray *out = bitarray_pool_get(pool);
+    bitarray_program_eval_into(qp->program, bas, &ti->interval, out);
+    release_operands(qp, pool, bas, results);
+    return out;
+}
+
+/**
+ * Evaluates a query over an interval. The result needs to be returned with
+ * release_ast_result, which lets the storage of the result be reused by later
+ * evaluations of the query.
+ */
 struct bitarray *eval_ast(struct ast_node *root, const tersect_db *tdb,
-                   const struct tersect_db_interval *ti)
+                          const struct tersect_db_interval *ti)
 {
     if (root->type == AST_GENOME) {
-        struct bitarray *ba = load_bitarray(tdb, root->genome, ti);
-        struct bitarray *out = copy_bitarray(ba);
-        free(ba);
-        return out;
+        struct bitarray ba;
+        extract_genome_region(tdb, root->genome, ti, &ba);
+        return copy_bitarray(&ba);
+    }
+    return eval_program(root, tdb, ti);
+}
+
+/**
+ * Returns the result of eval_ast to the pool of the query it was taken from.
+ */
+void release_ast_result(struct ast_node *root, struct bitarray *result)
+{
+    if (root->type == AST_GENOME) {
+        // Genome results are copies made outside the pool
+        free_bitarray(result);
     } else {
-        return eval_node(root, tdb, ti);
+        bitarray_pool_put(query_pool(root), result);
+    }
+}
+
+/**
+ * Count the variants in the result of a query without building the result.
+ */
+uint64_t count_ast(struct ast_node *root, const tersect_db *tdb,
+                   const struct tersect_db_interval *ti)
+{
+    if (root->type == AST_ALL) {
+        return ti->nvariants;
+    } else if (root->type == AST_GENOME) {
+        struct bitarray ba;
+        extract_genome_region(tdb, root->genome, ti, &ba);
+        return bitarray_weight(&ba);
+    }
+    struct query_program *qp = query_program(root);
+    bitarray_pool *pool = query_pool(root);
+    struct bitarray **results;
+    struct bitarray *bas = load_operands(qp, tdb, ti, pool, root->tasks,
+                                         &results);
+    uint64_t count = bitarray_program_count(qp->program, bas, &ti->interval);
+    release_operands(qp, pool, bas, results);
+    return count;
+}
+
+/**
+ * Count the variants in the result of a query separately for each bin of a
+ * region. The bins should be successive and lie within the region. Bins
+ * containing no variants are given a count of zero.
+ *
+ * Genomes are split into bins directly from the database, while other queries
+ * are evaluated over the whole region first.
+ */
+void count_ast_bins(struct ast_node *root, const tersect_db *tdb,
+                    const struct tersect_db_interval *ti,
+                    size_t nbins, const struct tersect_db_interval *bins,
+                    uint64_t *counts)
+{
+    // Only bins containing variants can be extracted from bit arrays
+    struct bitarray_interval *intervals = malloc(nbins * sizeof *intervals);
+    size_t nintervals = 0;
+    for (size_t i = 0; i < nbins; ++i) {
+        if (bins[i].nvariants) {
+            intervals[nintervals++] = bins[i].interval;
+        }
     }
+    struct bitarray *bin_bas = malloc(nintervals * sizeof *bin_bas);
+    struct bitarray *result = NULL;
+    if (nintervals && root->type == AST_GENOME) {
+        struct bitarray ba;
+        tersect_db_get_bitarray(tdb, root->genome, &ti->chromosome, &ba);
+        bitarray_extract_bins(bin_bas, &ba, nintervals, intervals);
+    } else if (nintervals) {
+        // Evaluated bit arrays start at the word containing the region start
+        uint64_t offset = (ti->interval.start_index / bitarray_word_capacity)
+                          * bitarray_word_capacity;
+        for (size_t i = 0; i < nintervals; ++i) {
+            intervals[i].start_index -= offset;
+            intervals[i].end_index -= offset;
+        }
+        result = eval_program(root, tdb, ti);
+        bitarray_extract_bins(bin_bas, result, nintervals, intervals);
+    }
+    for (size_t i = 0, j = 0; i < nbins; ++i) {
+        counts[i] = bins[i].nvariants ? bitarray_weight(&bin_bas[j++]) : 0;
+    }
+    if (result != NULL) {
+        bitarray_pool_put(query_pool(root), result);
+    }
+    free(bin_bas);
+    free(intervals);
 }
 
 /**
@@ -137,11 +661,28 @@ struct bitarray *eval_ast(struct ast_node *root, const tersect_db *tdb,
  */
 void free_ast(struct ast_node *root)
 {
-    if (root->type != AST_GENOME) {
+    if (--root->refs) return;
+    if (root->pool != NULL) {
+        free_bitarray_pool(root->pool);
+    }
+    if (root->program != NULL) {
+        free_bitarray_program(root->program->program);
+        free(root->program->operands);
+        free(root->program->shared);
+        free(root->program);
+    }
+    if (root->type == AST_GENOME) {
+        free(root->genome);
+    } else if (root->type == AST_COMPLEMENT) {
+        free_ast(root->l);
+    } else if (root->type == AST_NARY) {
+        for (size_t i = 0; i < root->nchildren; ++i) {
+            free_ast(root->children[i]);
+        }
+        free(root->children);
+    } else if (root->type != AST_ALL) {
         free_ast(root->l);
         free_ast(root->r);
-    } else {
-        free(root->genome);
     }
     free(root);
 }
@@ -23,9 +23,13 @@ OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE. */
 
 #include "bitarray.h"
+#include "bitarray_simd.h"
+#include "heap.h"
 
 #include <inttypes.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -34,6 +38,13 @@ SOFTWARE. */
 static const bitarray_word WORD_MAX = (bitarray_word)~0;
 static const bitarray_word MSB = (bitarray_word)1
                                  << (CHAR_BIT * sizeof(bitarray_word) - 1);
+// Set in fill words standing for runs of words with all bits set
+static const bitarray_word ONE_FILL = (bitarray_word)1
+                                      << (CHAR_BIT * sizeof(bitarray_word) - 2);
+// Bits of a fill word storing the number of words in the fill minus one
+static const bitarray_word FILL_LENGTH = ((bitarray_word)1
+                                          << (CHAR_BIT * sizeof(bitarray_word)
+                                              - 2)) - 1;
 
 // Number of boolean bits in the internal bit array storage type.
 const uint16_t bitarray_word_capacity = CHAR_BIT * sizeof(bitarray_word) - 1;
@@ -43,6 +54,22 @@ static inline size_t bit_to_word_size(size_t bit_size)
     return (bit_size + bitarray_word_capacity - 1) / bitarray_word_capacity;
 }
 
+/**
+ * Returns the masks of the valid bits in the first and last words of a region.
+ */
+static inline bitarray_word region_start_bits(const struct bitarray_interval
+                                              *region)
+{
+    return WORD_MAX << region->start_index % bitarray_word_capacity;
+}
+
+static inline bitarray_word region_end_bits(const struct bitarray_interval
+                                            *region)
+{
+    return WORD_MAX >> (bitarray_word_capacity
+                        - region->end_index % bitarray_word_capacity) | MSB;
+}
+
 /*
  * Allocate and initialise bit array. All the bits are unset (i.e. set to 0).
  */
@@ -54,10 +81,32 @@ struct bitarray *init_bitarray(uint64_t bit_size)
     ba->size = bit_to_word_size(bit_size);
     ba->last_word = 0;
     ba->ncompressed = 0;
+    ba->capacity = ba->size;
     ba->array = calloc(ba->size, sizeof *(ba->array));
     ba->array[0] = ba->size - 1;
     ba->start_mask = WORD_MAX;
     ba->end_mask = WORD_MAX;
+    ba->start_bits = WORD_MAX;
+    ba->end_bits = WORD_MAX;
+    ba->skip_index = NULL;
+    return ba;
+}
+
+/*
+ * Allocate bit array with all the bits of a region set. Like a bit array
+ * extracted from a larger one, it starts at the word containing the first bit
+ * of the region.
+ */
+struct bitarray *init_full_bitarray(const struct bitarray_interval *region)
+{
+    uint64_t nwords = region->end_index / bitarray_word_capacity
+                      - region->start_index / bitarray_word_capacity + 1;
+    struct bitarray *ba = init_bitarray(bitarray_word_capacity);
+    ba->array[0] = ONE_FILL | (nwords - 1);
+    ba->start_mask = nwords - 1;
+    ba->end_mask = nwords - 1;
+    ba->start_bits = region_start_bits(region);
+    ba->end_bits = region_end_bits(region);
     return ba;
 }
 
@@ -72,9 +121,12 @@ struct bitarray *copy_bitarray(const struct bitarray *ba)
         .size = ba->size,
         .last_word = ba->last_word,
         .ncompressed = ba->ncompressed,
+        .capacity = ba->size,
         .array = malloc(array_size),
         .start_mask = ba->start_mask,
-        .end_mask = ba->end_mask
+        .end_mask = ba->end_mask,
+        .start_bits = ba->start_bits,
+        .end_bits = ba->end_bits
     };
     memcpy(copied_ba->array, ba->array, array_size);
     return copied_ba;
@@ -89,6 +141,8 @@ void clear_bitarray(struct bitarray *ba)
     ba->ncompressed = 0;
     ba->start_mask = WORD_MAX;
     ba->end_mask = WORD_MAX;
+    ba->start_bits = WORD_MAX;
+    ba->end_bits = WORD_MAX;
     memset(ba->array, 0, ba->size * sizeof *(ba->array));
     ba->array[0] = ba->size - 1;
 }
@@ -130,266 +184,1924 @@ void print_bitarray(const struct bitarray *ba)
  */
 void print_set_indices(const struct bitarray *ba)
 {
-    size_t nset;
-    size_t *set_indices;
-    bitarray_get_set_indices(ba, &nset, &set_indices);
-    for (size_t i = 0; i < nset; ++i) {
-        printf("%lu,", set_indices[i]);
+    struct bitarray_set_iterator it;
+    init_bitarray_set_iterator(&it, ba);
+    uint64_t index;
+    while (bitarray_set_iterator_next(&it, &index)) {
+        printf("%"PRIu64",", index);
     }
-    free(set_indices);
     printf("\n");
 }
 
 /**
- * Returns the number of words compressed in a zero fill word at a given
- * position in a bit array.
+ * Returns the number of words compressed in a fill word at a given position in
+ * a bit array.
  */
-static inline size_t load_zerofill(const struct bitarray *ba, size_t pos)
+static inline size_t load_fill(const struct bitarray *ba, size_t pos)
 {
     if (pos == 0) {
         return ba->start_mask + 1;
     } else if (pos + 1 == ba->size) {
         return ba->end_mask + 1;
     } else {
-        return ba->array[pos] + 1;
+        return (ba->array[pos] & FILL_LENGTH) + 1;
+    }
+}
+
+/**
+ * Returns the number of uncompressed words represented by the word at a given
+ * position in a bit array.
+ */
+static inline size_t word_length(const struct bitarray *ba, size_t pos)
+{
+    return (ba->array[pos] & MSB) ? 1 : load_fill(ba, pos);
+}
+
+/**
+ * Returns the literal equivalent of each word in a fill, i.e. either an empty
+ * literal word (only MSB set) or a full one (all bits set).
+ */
+static inline bitarray_word fill_literal(bitarray_word fill)
+{
+    return (fill & ONE_FILL) ? WORD_MAX : MSB;
+}
+
+/**
+ * Uses the skip index (if available) to find the last sampled word which does
+ * not follow the specified uncompressed word. Outputs the position of the
+ * sampled word and the number of words compressed before it; both are zero if
+ * there is no skip index.
+ */
+static inline void skip_to_word(const struct bitarray *ba, uint64_t word_index,
+                                size_t *pos, size_t *ncompressed)
+{
+    const struct bitarray_skip_index *si = ba->skip_index;
+    *pos = 0;
+    *ncompressed = 0;
+    if (si == NULL || !si->count) return;
+    size_t lo = 0;
+    size_t hi = si->count;
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (si->offsets[mid] <= word_index) {
+            lo = mid;
+        } else {
+            hi = mid;
+        }
+    }
+    *pos = lo * si->interval;
+    *ncompressed = si->offsets[lo] - *pos;
+}
+
+/**
+ * Returns the size (in bytes) of a skip index sampling every interval-th word
+ * of a bit array.
+ */
+size_t bitarray_skip_index_size(const struct bitarray *ba, uint32_t interval)
+{
+    size_t count = (ba->size + interval - 1) / interval;
+    return sizeof(struct bitarray_skip_index) + count * sizeof(uint64_t);
+}
+
+/**
+ * Builds a skip index sampling every interval-th word of a bit array. The
+ * output needs to be at least bitarray_skip_index_size bytes long.
+ */
+void bitarray_build_skip_index(const struct bitarray *ba, uint32_t interval,
+                               struct bitarray_skip_index *out)
+{
+    out->interval = interval;
+    out->count = (ba->size + interval - 1) / interval;
+    uint64_t nwords = 0;
+    for (size_t i = 0; i < ba->size; ++i) {
+        if (i % interval == 0) {
+            out->offsets[i / interval] = nwords;
+        }
+        nwords += word_length(ba, i);
     }
 }
 
+/**
+ * Minimum ratio between the sizes (in compressed words) of the operands of an
+ * intersection or difference for the larger one to be skipped through, rather
+ * than walked word by word, wherever the smaller one leaves the result empty.
+ */
+#define GALLOP_RATIO 16
+
+/* Operations on pairs of bit arrays */
+#define OP_INTERSECTION          0
+#define OP_UNION                 1
+#define OP_DIFFERENCE            2
+#define OP_SYMMETRIC_DIFFERENCE  3
+
 static inline void load_masks(const struct bitarray *a,
                               const struct bitarray *b,
                               struct bitarray *out)
 {
-    if (a->array[0] & MSB) {
-        out->start_mask = a->start_mask;
-    } else if (b->array[0] & MSB) {
-        out->start_mask = b->start_mask;
+    if (a->array[0] & MSB) {
+        out->start_mask = a->start_mask;
+    } else if (b->array[0] & MSB) {
+        out->start_mask = b->start_mask;
+    }
+    if (a->array[a->size - 1] & MSB) {
+        out->end_mask = a->end_mask;
+    } else if (b->array[b->size - 1] & MSB) {
+        out->end_mask = b->end_mask;
+    }
+    out->start_bits = a->start_bits & b->start_bits;
+    out->end_bits = a->end_bits & b->end_bits;
+}
+
+/**
+ * Returns the maximum length of a run of literal words shared by two bit arrays
+ * at the specified positions, or zero if either is not at a literal word.
+ */
+static inline size_t literal_run_bound(const struct bitarray *a, size_t a_pos,
+                                       const struct bitarray *b, size_t b_pos)
+{
+    if (a_pos >= a->size || b_pos >= b->size
+        || !(a->array[a_pos] & b->array[b_pos] & MSB)) {
+        return 0;
+    }
+    return (a->size - a_pos < b->size - b_pos) ? a->size - a_pos
+                                               : b->size - b_pos;
+}
+
+/**
+ * Allocates a bit array with no storage, to be used as the output of the _into
+ * variants of the set theoretical operations.
+ */
+static struct bitarray *init_output(void)
+{
+    struct bitarray *ba = malloc(sizeof *ba);
+    *ba = (struct bitarray) {
+        .start_mask = WORD_MAX,
+        .end_mask = WORD_MAX,
+        .start_bits = WORD_MAX,
+        .end_bits = WORD_MAX
+    };
+    return ba;
+}
+
+/**
+ * Prepares a bit array to receive the result of an operation of up to
+ * max_words words, reusing its storage if large enough. The storage is not
+ * cleared, as every output word is written by the operation.
+ */
+static inline void reset_output(struct bitarray *out, size_t max_words)
+{
+    bitarray_reserve(out, max_words);
+    out->size = max_words;
+    out->last_word = 0;
+    out->ncompressed = 0;
+    out->start_mask = WORD_MAX;
+    out->end_mask = WORD_MAX;
+    out->start_bits = WORD_MAX;
+    out->end_bits = WORD_MAX;
+    out->skip_index = NULL;
+}
+
+/**
+ * Sets the size of an output bit array once nwords words have been written,
+ * turning the start and end masks of fill words into their lengths.
+ */
+static inline void finish_output(struct bitarray *out, size_t nwords)
+{
+    out->size = nwords;
+    out->last_word = nwords - 1;
+    if (!(out->array[0] & MSB)) {
+        out->start_mask = out->array[0] & FILL_LENGTH;
+        if (out->size == 1) {
+            out->end_mask = out->start_mask;
+        }
+    }
+    if (!(out->array[out->size - 1] & MSB)) {
+        out->end_mask = out->array[out->size - 1] & FILL_LENGTH;
+    }
+}
+
+/**
+ * Either adds a fill word corresponding to n compressed zero (or one) words at
+ * the specified position and increments the position by one, or extends the
+ * preceding fill word if it is of the same kind.
+ */
+static inline void append_fill(struct bitarray *ba, size_t *pos, uint64_t n,
+                               bool ones)
+{
+    bitarray_word type = ones ? ONE_FILL : 0;
+    if (*pos && (ba->array[(*pos) - 1] & (MSB | ONE_FILL)) == type) {
+        ba->array[(*pos) - 1] += n;
+    } else {
+        ba->array[(*pos)++] = type | (n - 1);
+    }
+}
+
+/**
+ * Adds a literal word at the specified position, storing it as a fill if it is
+ * either empty or full.
+ */
+static inline void append_word(struct bitarray *ba, size_t *pos,
+                               bitarray_word word)
+{
+    if (word == MSB) {
+        append_fill(ba, pos, 1, false);
+    } else if (word == WORD_MAX) {
+        append_fill(ba, pos, 1, true);
+    } else {
+        ba->array[(*pos)++] = word;
+    }
+}
+
+/**
+ * Combines two words, either of which may be a literal equivalent standing in
+ * for a fill word. The MSB of the result is not meaningful.
+ */
+static inline bitarray_word combine_words(int operation, bitarray_word a,
+                                          bitarray_word b)
+{
+    switch (operation) {
+    case OP_INTERSECTION:
+        return a & b;
+    case OP_UNION:
+        return a | b;
+    case OP_DIFFERENCE:
+        return a & ~b;
+    default:
+        return a ^ b;
+    }
+}
+
+static inline size_t combine_literal_run(int operation, const bitarray_word *a,
+                                         const bitarray_word *b,
+                                         bitarray_word *out, size_t n)
+{
+    switch (operation) {
+    case OP_INTERSECTION:
+        return literal_kernels.and_words(a, b, out, n);
+    case OP_UNION:
+        return literal_kernels.or_words(a, b, out, n);
+    case OP_DIFFERENCE:
+        return literal_kernels.andnot_words(a, b, out, n);
+    default:
+        return literal_kernels.xor_words(a, b, out, n);
+    }
+}
+
+static inline size_t count_literal_run(int operation, const bitarray_word *a,
+                                       const bitarray_word *b, size_t n,
+                                       uint64_t *count)
+{
+    switch (operation) {
+    case OP_INTERSECTION:
+        return literal_kernels.and_popcount(a, b, n, count);
+    case OP_UNION:
+        return literal_kernels.or_popcount(a, b, n, count);
+    case OP_DIFFERENCE:
+        return literal_kernels.andnot_popcount(a, b, n, count);
+    default:
+        return literal_kernels.xor_popcount(a, b, n, count);
+    }
+}
+
+/**
+ * Position within a bit array used in operations on pairs of bit arrays. An
+ * array which runs out of words is treated as an endless zero fill.
+ */
+struct wah_pair_cursor {
+    const struct bitarray *ba;
+    size_t pos; // Position of the next word to load
+    uint64_t ncomp; // Number of words left in the current fill
+    bitarray_word fill; // Literal equivalent of the words of that fill
+};
+
+/**
+ * Loads the fill word at the current position, if there is one and the
+ * previous fill has been used up.
+ */
+static inline void pair_cursor_load(struct wah_pair_cursor *c)
+{
+    if (!c->ncomp && c->pos < c->ba->size && !(c->ba->array[c->pos] & MSB)) {
+        c->fill = fill_literal(c->ba->array[c->pos]);
+        c->ncomp = load_fill(c->ba, c->pos++);
+    }
+}
+
+/**
+ * True if the cursor is either inside a fill or past the end of its array.
+ */
+static inline bool pair_cursor_in_fill(const struct wah_pair_cursor *c)
+{
+    return c->ncomp || c->pos >= c->ba->size;
+}
+
+/**
+ * Returns the current word (or its literal equivalent) and moves to the next.
+ */
+static inline bitarray_word pair_cursor_next(struct wah_pair_cursor *c)
+{
+    if (c->ncomp) {
+        --c->ncomp;
+        return c->fill;
+    }
+    return c->pos < c->ba->size ? c->ba->array[c->pos++] : MSB;
+}
+
+/**
+ * Skips over the words for which both cursors are inside fills. Returns the
+ * number of skipped words and outputs whether the result of the operation is
+ * a one fill over them.
+ */
+static inline uint64_t pair_cursor_skip(int operation,
+                                        struct wah_pair_cursor *a,
+                                        struct wah_pair_cursor *b, bool *ones)
+{
+    uint64_t to_skip = a->ncomp ? a->ncomp : b->ncomp;
+    if (b->ncomp && b->ncomp < to_skip) {
+        to_skip = b->ncomp;
+    }
+    bitarray_word res = combine_words(operation, a->ncomp ? a->fill : MSB,
+                                      b->ncomp ? b->fill : MSB);
+    *ones = (res | MSB) == WORD_MAX;
+    if (a->ncomp) a->ncomp -= to_skip;
+    if (b->ncomp) b->ncomp -= to_skip;
+    return to_skip;
+}
+
+/**
+ * Returns true if one of two bit arrays is at least GALLOP_RATIO times larger
+ * (in compressed words) than the other.
+ */
+static inline bool imbalanced(const struct bitarray *a,
+                              const struct bitarray *b)
+{
+    return a->size >= GALLOP_RATIO * b->size
+           || b->size >= GALLOP_RATIO * a->size;
+}
+
+/**
+ * Moves a cursor at the specified uncompressed word index forward by n words.
+ * If its bit array has a skip index, an exponential search over it jumps close
+ * to the target first. The remaining words are stepped over by their lengths
+ * without being decoded.
+ */
+static inline void pair_cursor_advance(struct wah_pair_cursor *c,
+                                       uint64_t index, uint64_t n)
+{
+    if (c->ncomp >= n) {
+        c->ncomp -= n;
+        return;
+    }
+    const struct bitarray *ba = c->ba;
+    uint64_t target = index + n;
+    index += c->ncomp; // Uncompressed index of the word at c->pos
+    c->ncomp = 0;
+    const struct bitarray_skip_index *si = ba->skip_index;
+    if (si != NULL && c->pos / si->interval < si->count) {
+        size_t lo = c->pos / si->interval;
+        size_t step = 1;
+        while (lo + step < si->count && si->offsets[lo + step] <= target) {
+            lo += step;
+            step *= 2;
+        }
+        size_t hi = lo + step < si->count ? lo + step : si->count;
+        while (hi - lo > 1) {
+            size_t mid = lo + (hi - lo) / 2;
+            if (si->offsets[mid] <= target) {
+                lo = mid;
+            } else {
+                hi = mid;
+            }
+        }
+        if (lo * si->interval > c->pos) {
+            c->pos = lo * si->interval;
+            index = si->offsets[lo];
+        }
+    }
+    while (index < target && c->pos < ba->size) {
+        uint64_t length = word_length(ba, c->pos);
+        if (index + length > target) {
+            // Target inside a fill, the rest of which is left to use
+            c->fill = fill_literal(ba->array[c->pos]);
+            c->ncomp = index + length - target;
+            ++c->pos;
+            return;
+        }
+        index += length;
+        ++c->pos;
+    }
+}
+
+/**
+ * If either cursor is inside a zero fill which empties the result of an
+ * intersection (or the first one for a difference) while the other is not
+ * inside a fill, moves the other cursor past the fill without combining any
+ * words. Returns the number of words skipped, zero if there was no such fill.
+ */
+static inline uint64_t pair_cursor_gallop(int operation,
+                                          struct wah_pair_cursor *a,
+                                          struct wah_pair_cursor *b,
+                                          uint64_t index)
+{
+    uint64_t n = 0;
+    if (a->ncomp && a->fill == MSB && !pair_cursor_in_fill(b)) {
+        n = a->ncomp;
+        a->ncomp = 0;
+        pair_cursor_advance(b, index, n);
+    } else if (operation == OP_INTERSECTION && b->ncomp && b->fill == MSB
+               && !pair_cursor_in_fill(a)) {
+        n = b->ncomp;
+        b->ncomp = 0;
+        pair_cursor_advance(a, index, n);
+    }
+    return n;
+}
+
+/**
+ * Computes the result of an operation on two bit arrays covering the same
+ * region. Spans where both inputs are inside fills of either kind are skipped
+ * over in one step, and empty or full result words are stored as fills. For
+ * intersections and differences of operands of very different sizes, the
+ * larger one is also skipped through wherever the smaller one empties the
+ * result.
+ *
+ * Every output word consumes at least one compressed word of either input, so
+ * the output never needs more words than both inputs combined.
+ */
+static void bitarray_operation(int operation, const struct bitarray *a,
+                               const struct bitarray *b, struct bitarray *out)
+{
+    reset_output(out, a->size + b->size);
+    load_masks(a, b, out);
+
+    struct wah_pair_cursor ca = { .ba = a };
+    struct wah_pair_cursor cb = { .ba = b };
+    size_t out_pos = 0;
+    uint64_t index = 0; // Uncompressed index of the current word
+    bool gallop = (operation == OP_INTERSECTION
+                   || operation == OP_DIFFERENCE) && imbalanced(a, b);
+
+    for (;;) {
+        if (!ca.ncomp && !cb.ncomp) {
+            size_t run = literal_run_bound(a, ca.pos, b, cb.pos);
+            if (run) {
+                // Processing literal words in vector-wide blocks
+                size_t n = combine_literal_run(operation, &a->array[ca.pos],
+                                               &b->array[cb.pos],
+                                               &out->array[out_pos], run);
+                if (n) {
+                    ca.pos += n;
+                    cb.pos += n;
+                    out_pos += n;
+                    index += n;
+                    continue;
+                }
+            }
+        }
+        pair_cursor_load(&ca);
+        pair_cursor_load(&cb);
+        if (gallop) {
+            uint64_t skipped = pair_cursor_gallop(operation, &ca, &cb, index);
+            if (skipped) {
+                append_fill(out, &out_pos, skipped, false);
+                index += skipped;
+                continue;
+            }
+        }
+        if (pair_cursor_in_fill(&ca) && pair_cursor_in_fill(&cb)) {
+            if (!ca.ncomp && !cb.ncomp) break; // Both arrays exhausted
+            bool ones;
+            uint64_t skipped = pair_cursor_skip(operation, &ca, &cb, &ones);
+            append_fill(out, &out_pos, skipped, ones);
+            index += skipped;
+            continue;
+        }
+        bitarray_word a_word = pair_cursor_next(&ca);
+        bitarray_word b_word = pair_cursor_next(&cb);
+        append_word(out, &out_pos,
+                    combine_words(operation, a_word, b_word) | MSB);
+        ++index;
+    }
+    finish_output(out, out_pos);
+}
+
+/*
+ * The _into variants write their result into an existing bit array (e.g. one
+ * taken from a bit array pool), reusing its storage if it is large enough.
+ * The other variants allocate a new bit array sized to fit the result.
+ */
+void bitarray_union_into(const struct bitarray *a, const struct bitarray *b,
+                         struct bitarray *out)
+{
+    bitarray_operation(OP_UNION, a, b, out);
+}
+
+void bitarray_intersection_into(const struct bitarray *a,
+                                const struct bitarray *b,
+                                struct bitarray *out)
+{
+    bitarray_operation(OP_INTERSECTION, a, b, out);
+}
+
+void bitarray_difference_into(const struct bitarray *a,
+                              const struct bitarray *b,
+                              struct bitarray *out)
+{
+    bitarray_operation(OP_DIFFERENCE, a, b, out);
+}
+
+void bitarray_symmetric_difference_into(const struct bitarray *a,
+                                        const struct bitarray *b,
+                                        struct bitarray *out)
+{
+    bitarray_operation(OP_SYMMETRIC_DIFFERENCE, a, b, out);
+}
+
+void bitarray_union(const struct bitarray *a, const struct bitarray *b,
+                    struct bitarray **out)
+{
+    *out = init_output();
+    bitarray_union_into(a, b, *out);
+    bitarray_shrinkwrap(*out);
+}
+
+void bitarray_intersection(const struct bitarray *a,
+                           const struct bitarray *b,
+                           struct bitarray **out)
+{
+    *out = init_output();
+    bitarray_intersection_into(a, b, *out);
+    bitarray_shrinkwrap(*out);
+}
+
+void bitarray_difference(const struct bitarray *a, const struct bitarray *b,
+                         struct bitarray **out)
+{
+    *out = init_output();
+    bitarray_difference_into(a, b, *out);
+    bitarray_shrinkwrap(*out);
+}
+
+void bitarray_symmetric_difference(const struct bitarray *a,
+                                   const struct bitarray *b,
+                                   struct bitarray **out)
+{
+    *out = init_output();
+    bitarray_symmetric_difference_into(a, b, *out);
+    bitarray_shrinkwrap(*out);
+}
+
+/**
+ * Complement of a bit array, i.e. the bits of its region which are not set.
+ * Fill words simply swap their kind, so the result is built in a single pass
+ * over the compressed words.
+ */
+void bitarray_complement_into(const struct bitarray *ba, struct bitarray *out)
+{
+    reset_output(out, ba->size);
+    out->start_mask = ba->start_mask;
+    out->end_mask = ba->end_mask;
+    out->start_bits = ba->start_bits;
+    out->end_bits = ba->end_bits;
+    size_t out_pos = 0;
+    for (size_t i = 0; i < ba->size; ++i) {
+        bitarray_word word = ba->array[i];
+        if (word & MSB) {
+            append_word(out, &out_pos, ~word | MSB);
+        } else {
+            append_fill(out, &out_pos, load_fill(ba, i), !(word & ONE_FILL));
+        }
+    }
+    finish_output(out, out_pos);
+}
+
+void bitarray_complement(const struct bitarray *ba, struct bitarray **out)
+{
+    *out = init_output();
+    bitarray_complement_into(ba, *out);
+    bitarray_shrinkwrap(*out);
+}
+
+/**
+ * Position within a bit array used in multi-way operations. Outside of
+ * initialisation, a cursor always points either at a literal word, inside a
+ * one fill (with the number of its words left, including the current one,
+ * stored in the nones member), or past the end of the array. The index member
+ * holds the uncompressed index of the current word.
+ */
+struct wah_cursor {
+    const struct bitarray *ba;
+    size_t pos;
+    uint64_t index;
+    uint64_t nones;
+};
+
+/**
+ * Moves the cursor past any zero fill words, accumulating their lengths, and
+ * stops at the start of a one fill.
+ */
+static inline void cursor_skip_fills(struct wah_cursor *c)
+{
+    while (c->pos < c->ba->size && !(c->ba->array[c->pos] & MSB)) {
+        if (c->ba->array[c->pos] & ONE_FILL) {
+            c->nones = load_fill(c->ba, c->pos);
+            return;
+        }
+        c->index += load_fill(c->ba, c->pos++);
+    }
+}
+
+static inline void cursor_next(struct wah_cursor *c)
+{
+    ++c->index;
+    if (c->nones && --c->nones) return;
+    ++c->pos;
+    cursor_skip_fills(c);
+}
+
+/**
+ * Moves the cursor to the first word with set bits at or after the target
+ * index, jumping straight through one fills.
+ */
+static inline void cursor_advance(struct wah_cursor *c, uint64_t target)
+{
+    while (c->pos < c->ba->size && c->index < target) {
+        if (c->nones > target - c->index) {
+            c->nones -= target - c->index;
+            c->index = target;
+        } else {
+            if (c->nones) {
+                // Moving to the last word of the one fill
+                c->index += c->nones - 1;
+                c->nones = 1;
+            }
+            cursor_next(c);
+        }
+    }
+}
+
+static inline bitarray_word cursor_word(const struct wah_cursor *c)
+{
+    return c->nones ? WORD_MAX : c->ba->array[c->pos];
+}
+
+static inline bool cursor_done(const struct wah_cursor *c)
+{
+    return c->pos >= c->ba->size;
+}
+
+static int cursor_cmp(const void *a, const void *b)
+{
+    uint64_t ia = ((const struct wah_cursor *)a)->index;
+    uint64_t ib = ((const struct wah_cursor *)b)->index;
+    return (ia > ib) - (ia < ib);
+}
+
+/**
+ * Returns the number of words in a bit array after decompression.
+ */
+static uint64_t uncompressed_size(const struct bitarray *ba)
+{
+    uint64_t nwords = 0;
+    for (size_t i = 0; i < ba->size; ++i) {
+        nwords += word_length(ba, i);
+    }
+    return nwords;
+}
+
+/**
+ * Prepares cursors and an output bit array for a multi-way operation. The
+ * output is allocated to hold as many words as the result could possibly need,
+ * which is limited by both the compressed and the uncompressed size of the
+ * inputs. Returns the uncompressed size.
+ */
+static uint64_t init_multiway(size_t nbas, const struct bitarray *bas,
+                              struct wah_cursor *cursors, struct bitarray *out)
+{
+    uint64_t nwords = 0;
+    size_t max_words = 1;
+    for (size_t i = 0; i < nbas; ++i) {
+        max_words += 2 * bas[i].size;
+        uint64_t ba_nwords = uncompressed_size(&bas[i]);
+        if (ba_nwords > nwords) {
+            nwords = ba_nwords;
+        }
+        cursors[i] = (struct wah_cursor) { .ba = &bas[i] };
+        cursor_skip_fills(&cursors[i]);
+    }
+    if (nwords && max_words > nwords) {
+        max_words = nwords;
+    }
+    reset_output(out, max_words);
+    for (size_t i = 0; i < nbas; ++i) {
+        if (bas[i].array[0] & MSB) {
+            out->start_mask = bas[i].start_mask;
+            break;
+        }
+    }
+    for (size_t i = 0; i < nbas; ++i) {
+        if (bas[i].array[bas[i].size - 1] & MSB) {
+            out->end_mask = bas[i].end_mask;
+            break;
+        }
+    }
+    for (size_t i = 0; i < nbas; ++i) {
+        out->start_bits &= bas[i].start_bits;
+        out->end_bits &= bas[i].end_bits;
+    }
+    return nwords;
+}
+
+/* Operations supported by bitarray_merge_many */
+#define MERGE_UNION                 0
+#define MERGE_SYMMETRIC_DIFFERENCE  1
+#define MERGE_ATLEAST               2
+#define MERGE_ATMOST                3
+#define MERGE_EXACTLY               4
+
+/**
+ * Returns true if a threshold operation holds for a given number of set bits.
+ */
+static inline bool threshold_holds(int operation, uint64_t count, uint64_t k)
+{
+    switch (operation) {
+    case MERGE_ATLEAST:
+        return count >= k;
+    case MERGE_ATMOST:
+        return count <= k;
+    case MERGE_EXACTLY:
+        return count == k;
+    default:
+        return false;
+    }
+}
+
+/**
+ * Adds the set bits of a word to vertical (bit-sliced) counters through a
+ * ripple of half adders, so that each slice holds one bit of the count of
+ * every position.
+ */
+static inline void slices_add(size_t nslices, bitarray_word *slices,
+                              bitarray_word word)
+{
+    for (size_t s = 0; word && s < nslices; ++s) {
+        bitarray_word sum = slices[s] ^ word;
+        word &= slices[s];
+        slices[s] = sum;
+    }
+}
+
+/**
+ * Compares bit-sliced counters against k one slice at a time, starting with
+ * the most significant, marking the positions whose count is greater than or
+ * equal to k.
+ */
+static inline void slices_compare(size_t nslices, const bitarray_word *slices,
+                                  uint64_t k, bitarray_word *greater,
+                                  bitarray_word *equal)
+{
+    *greater = 0;
+    *equal = WORD_MAX;
+    for (size_t s = nslices; s--;) {
+        bitarray_word k_bit = ((k >> s) & 1) ? WORD_MAX : 0;
+        *greater |= *equal & slices[s] & ~k_bit;
+        *equal &= ~(slices[s] ^ k_bit);
+    }
+}
+
+/**
+ * Applies a threshold operation to the words of the active cursors by counting
+ * their set bits in bit-sliced counters.
+ */
+static inline bitarray_word threshold_words(int operation, uint64_t k,
+                                            size_t nactive,
+                                            struct wah_cursor **active,
+                                            size_t nslices,
+                                            bitarray_word *slices)
+{
+    if (nactive < k && operation != MERGE_ATMOST) {
+        return MSB; // Too few inputs with set bits to reach k
+    }
+    memset(slices, 0, nslices * sizeof *slices);
+    for (size_t i = 0; i < nactive; ++i) {
+        slices_add(nslices, slices, cursor_word(active[i]) & ~MSB);
+    }
+    bitarray_word greater, equal;
+    slices_compare(nslices, slices, k, &greater, &equal);
+    switch (operation) {
+    case MERGE_ATLEAST:
+        return greater | equal | MSB;
+    case MERGE_ATMOST:
+        return ~greater | MSB;
+    default:
+        return equal | MSB;
+    }
+}
+
+/**
+ * Merges any number of bit arrays in a single pass, combining their words with
+ * either OR (union), XOR (symmetric difference) or a threshold on the number
+ * of arrays in which each bit is set.
+ *
+ * Cursors resting at a word with set bits at the current position are kept in
+ * an active list, while those inside zero fills wait in a heap ordered by the
+ * position of their next such word. Positions where no input has set bits are
+ * skipped over in one step, and so (for unions) are one fills.
+ */
+static void bitarray_merge_many(size_t nbas, const struct bitarray *bas,
+                                int operation, uint64_t k,
+                                struct bitarray *out)
+{
+    struct wah_cursor *cursors = malloc(nbas * sizeof *cursors);
+    struct wah_cursor **active = malloc(nbas * sizeof *active);
+    uint64_t nwords = init_multiway(nbas, bas, cursors, out);
+    Heap *waiting = init_heap(nbas, cursor_cmp);
+    for (size_t i = 0; i < nbas; ++i) {
+        if (!cursor_done(&cursors[i])) {
+            heap_push(waiting, &cursors[i]);
+        }
+    }
+    // Counters wide enough to hold both nbas and k
+    size_t nslices = 1;
+    while (nslices < 64 && ((nbas | k) >> nslices)) {
+        ++nslices;
+    }
+    bitarray_word slices[64];
+    // Whether positions with no set bits in any input are set in the output
+    bool empty_set = threshold_holds(operation, 0, k);
+
+    size_t nactive = 0;
+    size_t out_pos = 0;
+    uint64_t index = 0; // Uncompressed position in output
+    while (nactive || waiting->size) {
+        if (!nactive) {
+            // Skipping to the nearest word with set bits
+            uint64_t next = ((struct wah_cursor *)heap_peek(waiting))->index;
+            if (next > index) {
+                append_fill(out, &out_pos, next - index, empty_set);
+                index = next;
+            }
+        }
+        while (waiting->size
+               && ((struct wah_cursor *)heap_peek(waiting))->index == index) {
+            active[nactive++] = heap_pop(waiting);
+        }
+        uint64_t nones = 0; // Longest one fill among the active cursors
+        if (operation == MERGE_UNION) {
+            for (size_t i = 0; i < nactive; ++i) {
+                if (active[i]->nones > nones) {
+                    nones = active[i]->nones;
+                }
+            }
+        }
+        if (nones) {
+            // Union is full over the whole fill, overtaking the other inputs
+            append_fill(out, &out_pos, nones, true);
+            index += nones;
+            while (waiting->size
+                   && ((struct wah_cursor *)heap_peek(waiting))->index
+                      < index) {
+                active[nactive++] = heap_pop(waiting);
+            }
+            for (size_t i = 0; i < nactive; ++i) {
+                cursor_advance(active[i], index);
+            }
+        } else {
+            bitarray_word res = 0;
+            if (operation == MERGE_UNION) {
+                for (size_t i = 0; i < nactive; ++i) {
+                    res |= cursor_word(active[i]);
+                }
+            } else if (operation == MERGE_SYMMETRIC_DIFFERENCE) {
+                for (size_t i = 0; i < nactive; ++i) {
+                    res ^= cursor_word(active[i]);
+                }
+            } else {
+                res = threshold_words(operation, k, nactive, active,
+                                      nslices, slices);
+            }
+            append_word(out, &out_pos, res | MSB);
+            ++index;
+            for (size_t i = 0; i < nactive; ++i) {
+                cursor_next(active[i]);
+            }
+        }
+        for (size_t i = 0; i < nactive;) {
+            if (cursor_done(active[i])) {
+                active[i] = active[--nactive];
+            } else if (active[i]->index != index) {
+                heap_push(waiting, active[i]);
+                active[i] = active[--nactive];
+            } else {
+                ++i;
+            }
+        }
+    }
+    if (index < nwords) {
+        append_fill(out, &out_pos, nwords - index, empty_set);
+    }
+    finish_output(out, out_pos);
+
+    free_heap(waiting);
+    free(active);
+    free(cursors);
+}
+
+/**
+ * Union of any number of bit arrays (covering the same region), computed in a
+ * single merged pass rather than through a chain of intermediate results.
+ */
+void bitarray_union_many_into(size_t nbas, const struct bitarray *bas,
+                              struct bitarray *out)
+{
+    bitarray_merge_many(nbas, bas, MERGE_UNION, 0, out);
+}
+
+/**
+ * Symmetric difference of any number of bit arrays, i.e. the bits set in an
+ * odd number of them.
+ */
+void bitarray_symmetric_difference_many_into(size_t nbas,
+                                             const struct bitarray *bas,
+                                             struct bitarray *out)
+{
+    bitarray_merge_many(nbas, bas, MERGE_SYMMETRIC_DIFFERENCE, 0, out);
+}
+
+/*
+ * Threshold operations, i.e. the bits set in at least, at most, or exactly k
+ * of the nbas bit arrays. All three are evaluated in a single merged pass.
+ */
+void bitarray_atleast_many_into(size_t nbas, const struct bitarray *bas,
+                                uint64_t k, struct bitarray *out)
+{
+    bitarray_merge_many(nbas, bas, MERGE_ATLEAST, k, out);
+}
+
+void bitarray_atmost_many_into(size_t nbas, const struct bitarray *bas,
+                               uint64_t k, struct bitarray *out)
+{
+    bitarray_merge_many(nbas, bas, MERGE_ATMOST, k, out);
+}
+
+void bitarray_exactly_many_into(size_t nbas, const struct bitarray *bas,
+                                uint64_t k, struct bitarray *out)
+{
+    bitarray_merge_many(nbas, bas, MERGE_EXACTLY, k, out);
+}
+
+void bitarray_union_many(size_t nbas, const struct bitarray *bas,
+                         struct bitarray **out)
+{
+    *out = init_output();
+    bitarray_union_many_into(nbas, bas, *out);
+    bitarray_shrinkwrap(*out);
+}
+
+void bitarray_symmetric_difference_many(size_t nbas,
+                                        const struct bitarray *bas,
+                                        struct bitarray **out)
+{
+    *out = init_output();
+    bitarray_symmetric_difference_many_into(nbas, bas, *out);
+    bitarray_shrinkwrap(*out);
+}
+
+void bitarray_atleast_many(size_t nbas, const struct bitarray *bas,
+                           uint64_t k, struct bitarray **out)
+{
+    *out = init_output();
+    bitarray_atleast_many_into(nbas, bas, k, *out);
+    bitarray_shrinkwrap(*out);
+}
+
+void bitarray_atmost_many(size_t nbas, const struct bitarray *bas,
+                          uint64_t k, struct bitarray **out)
+{
+    *out = init_output();
+    bitarray_atmost_many_into(nbas, bas, k, *out);
+    bitarray_shrinkwrap(*out);
+}
+
+void bitarray_exactly_many(size_t nbas, const struct bitarray *bas,
+                           uint64_t k, struct bitarray **out)
+{
+    *out = init_output();
+    bitarray_exactly_many_into(nbas, bas, k, *out);
+    bitarray_shrinkwrap(*out);
+}
+
+struct bitarray_count_iterator {
+    struct wah_cursor *cursors;
+    struct wah_cursor **active;
+    size_t nactive;
+    Heap *waiting;
+    uint64_t min_count;
+    uint64_t max_count;
+    uint64_t index; // Uncompressed index of the next word
+    uint64_t nwords;
+    bitarray_word start_bits;
+    bitarray_word end_bits;
+    size_t nslices;
+    bitarray_word slices[64]; // Counts of the bits of the current word
+    uint64_t base; // Index of the first bit in the current word
+    bitarray_word word; // Bits of the current word not yet returned
+};
+
+ba_count_it *init_bitarray_count_iterator(size_t nbas,
+                                          const struct bitarray *bas,
+                                          uint64_t min_count,
+                                          uint64_t max_count)
+{
+    ba_count_it *it = malloc(sizeof *it);
+    *it = (struct bitarray_count_iterator) {
+        .cursors = malloc(nbas * sizeof *it->cursors),
+        .active = malloc(nbas * sizeof *it->active),
+        .waiting = init_heap(nbas, cursor_cmp),
+        .min_count = min_count,
+        .max_count = max_count < nbas ? max_count : nbas,
+        .start_bits = WORD_MAX,
+        .end_bits = WORD_MAX,
+        .nslices = 1
+    };
+    for (size_t i = 0; i < nbas; ++i) {
+        uint64_t ba_nwords = uncompressed_size(&bas[i]);
+        if (ba_nwords > it->nwords) {
+            it->nwords = ba_nwords;
+        }
+        it->start_bits &= bas[i].start_bits;
+        it->end_bits &= bas[i].end_bits;
+        it->cursors[i] = (struct wah_cursor) { .ba = &bas[i] };
+        cursor_skip_fills(&it->cursors[i]);
+        if (!cursor_done(&it->cursors[i])) {
+            heap_push(it->waiting, &it->cursors[i]);
+        }
+    }
+    if (it->min_count > it->max_count) {
+        it->nwords = 0; // No bit can satisfy both bounds
+    }
+    while (it->nslices < 64 && (nbas >> it->nslices)) {
+        ++it->nslices;
+    }
+    return it;
+}
+
+/**
+ * Loads the counts of the next word containing bits within the count bounds
+ * (if any) into the iterator. Words with fewer than min_count inputs holding
+ * set bits are skipped without counting. Returns false once there are no
+ * further such words.
+ */
+static bool count_iterator_load(ba_count_it *it)
+{
+    while (it->index < it->nwords) {
+        if (!it->nactive && it->min_count) {
+            if (!it->waiting->size) break;
+            // Skipping to the nearest word with set bits
+            it->index = ((struct wah_cursor *)heap_peek(it->waiting))->index;
+        }
+        while (it->waiting->size
+               && ((struct wah_cursor *)heap_peek(it->waiting))->index
+                  == it->index) {
+            it->active[it->nactive++] = heap_pop(it->waiting);
+        }
+        bitarray_word word = 0;
+        if (it->nactive >= it->min_count) {
+            memset(it->slices, 0, it->nslices * sizeof *it->slices);
+            for (size_t i = 0; i < it->nactive; ++i) {
+                slices_add(it->nslices, it->slices,
+                           cursor_word(it->active[i]) & ~MSB);
+            }
+            bitarray_word min_greater, min_equal, max_greater, max_equal;
+            slices_compare(it->nslices, it->slices, it->min_count,
+                           &min_greater, &min_equal);
+            slices_compare(it->nslices, it->slices, it->max_count,
+                           &max_greater, &max_equal);
+            word = (min_greater | min_equal) & ~max_greater & ~MSB;
+            if (!it->index) {
+                word &= it->start_bits;
+            }
+            if (it->index + 1 == it->nwords) {
+                word &= it->end_bits;
+            }
+        }
+        it->base = it->index++ * bitarray_word_capacity;
+        for (size_t i = 0; i < it->nactive;) {
+            cursor_next(it->active[i]);
+            if (cursor_done(it->active[i])) {
+                it->active[i] = it->active[--it->nactive];
+            } else if (it->active[i]->index != it->index) {
+                heap_push(it->waiting, it->active[i]);
+                it->active[i] = it->active[--it->nactive];
+            } else {
+                ++i;
+            }
+        }
+        if (word) {
+            it->word = word;
+            return true;
+        }
+    }
+    return false;
+}
+
+/**
+ * Outputs the indices of up to max_bits following bits within the count
+ * bounds, along with their counts. Returns the number of bits written, which
+ * is lower than max_bits only once all such bits have been returned.
+ */
+size_t bitarray_count_iterator_next_batch(ba_count_it *it, size_t max_bits,
+                                          uint64_t *indices, uint64_t *counts)
+{
+    size_t n = 0;
+    while (n < max_bits) {
+        if (!it->word && !count_iterator_load(it)) break;
+        while (it->word && n < max_bits) {
+            unsigned bit = __builtin_ctzll(it->word);
+            uint64_t count = 0;
+            for (size_t s = 0; s < it->nslices; ++s) {
+                count |= (uint64_t)((it->slices[s] >> bit) & 1) << s;
+            }
+            indices[n] = it->base + bit;
+            counts[n++] = count;
+            it->word &= it->word - 1;
+        }
+    }
+    return n;
+}
+
+void free_bitarray_count_iterator(ba_count_it *it)
+{
+    free_heap(it->waiting);
+    free(it->active);
+    free(it->cursors);
+    free(it);
+}
+
+/**
+ * Intersection of any number of bit arrays (covering the same region).
+ *
+ * The cursors leapfrog over each other: each is moved up to the furthest
+ * position reached so far, and if it lands inside a zero fill the target moves
+ * to the end of that run. Words are only combined once all the cursors agree
+ * on a position, and spans where all of them are inside one fills are output
+ * in one step.
+ */
+void bitarray_intersection_many_into(size_t nbas,
+                                     const struct bitarray *bas,
+                                     struct bitarray *out)
+{
+    struct wah_cursor *cursors = malloc(nbas * sizeof *cursors);
+    uint64_t nwords = init_multiway(nbas, bas, cursors, out);
+
+    size_t out_pos = 0;
+    uint64_t index = 0; // Uncompressed position in output
+    for (;;) {
+        uint64_t target = index;
+        size_t nagreed = 0;
+        for (size_t i = 0; nagreed < nbas; i = (i + 1) % nbas) {
+            struct wah_cursor *c = &cursors[i];
+            cursor_advance(c, target);
+            if (cursor_done(c)) {
+                goto done;
+            }
+            if (c->index > target) {
+                target = c->index;
+                nagreed = 1;
+            } else {
+                ++nagreed;
+            }
+        }
+        if (target > index) {
+            append_fill(out, &out_pos, target - index, false);
+        }
+        bitarray_word res = WORD_MAX;
+        uint64_t nones = UINT64_MAX; // Words where all cursors are in one fills
+        for (size_t i = 0; i < nbas; ++i) {
+            res &= cursor_word(&cursors[i]);
+            if (cursors[i].nones < nones) {
+                nones = cursors[i].nones;
+            }
+        }
+        if (nones) {
+            append_fill(out, &out_pos, nones, true);
+            index = target + nones;
+            for (size_t i = 0; i < nbas; ++i) {
+                cursor_advance(&cursors[i], index);
+            }
+        } else {
+            append_word(out, &out_pos, res);
+            index = target + 1;
+            for (size_t i = 0; i < nbas; ++i) {
+                cursor_next(&cursors[i]);
+            }
+        }
+    }
+done:
+    if (index < nwords) {
+        append_fill(out, &out_pos, nwords - index, false);
+    }
+    finish_output(out, out_pos);
+
+    free(cursors);
+}
+
+void bitarray_intersection_many(size_t nbas, const struct bitarray *bas,
+                                struct bitarray **out)
+{
+    *out = init_output();
+    bitarray_intersection_many_into(nbas, bas, *out);
+    bitarray_shrinkwrap(*out);
+}
+
+/* Number of words evaluated at a time by bit array programs */
+#define PROGRAM_BLOCK 32
+
+static uint64_t bitarray_operation_count(int operation,
+                                         const struct bitarray *a,
+                                         const struct bitarray *b);
+
+struct bitarray_program *init_bitarray_program(void)
+{
+    struct bitarray_program *prog = malloc(sizeof *prog);
+    *prog = (struct bitarray_program) { 0 };
+    return prog;
+}
+
+void free_bitarray_program(struct bitarray_program *prog)
+{
+    free(prog->instructions);
+    free(prog);
+}
+
+/**
+ * Appends an instruction to a program, keeping track of the number of operands
+ * and the stack depth it needs.
+ */
+void bitarray_program_append(struct bitarray_program *prog, int opcode,
+                             size_t arg, uint64_t k)
+{
+    if (prog->ninstructions == prog->capacity) {
+        prog->capacity = prog->capacity ? 2 * prog->capacity : 16;
+        prog->instructions = realloc(prog->instructions, prog->capacity
+                                     * sizeof *prog->instructions);
+    }
+    prog->instructions[prog->ninstructions++] = (struct bitarray_instruction) {
+        .opcode = opcode,
+        .arg = arg,
+        .k = k
+    };
+    switch (opcode) {
+    case BA_OP_PUSH:
+        if (arg >= prog->noperands) {
+            prog->noperands = arg + 1;
+        }
+        // fall through
+    case BA_OP_PUSH_ALL:
+    case BA_OP_LOAD:
+        if (++prog->depth > prog->stack_size) {
+            prog->stack_size = prog->depth;
+        }
+        break;
+    case BA_OP_STORE:
+        if (arg >= prog->nregisters) {
+            prog->nregisters = arg + 1;
+        }
+        break;
+    case BA_OP_NOT:
+        break;
+    case BA_OP_ATLEAST:
+    case BA_OP_ATMOST:
+    case BA_OP_EXACTLY:
+        prog->depth -= arg - 1;
+        break;
+    default:
+        --prog->depth;
+    }
+}
+
+/**
+ * Returns the number of words the operand behind a cursor can supply in a
+ * single block: either the rest of a fill, or a run of literal words. Arrays
+ * which have run out supply an endless zero fill.
+ */
+static inline size_t operand_available(struct wah_pair_cursor *c, size_t max)
+{
+    pair_cursor_load(c);
+    if (c->ncomp) {
+        return c->ncomp < max ? c->ncomp : max;
+    }
+    size_t n = 0;
+    if (c->pos >= c->ba->size) return max;
+    while (n < max && c->pos + n < c->ba->size
+           && (c->ba->array[c->pos + n] & MSB)) {
+        ++n;
+    }
+    return n;
+}
+
+/**
+ * Copies the following n words of an operand (or their literal equivalents)
+ * and moves past them.
+ */
+static inline void operand_fetch(struct wah_pair_cursor *c, size_t n,
+                                 bitarray_word *words)
+{
+    if (c->ncomp || c->pos >= c->ba->size) {
+        bitarray_word fill = c->ncomp ? c->fill : MSB;
+        for (size_t i = 0; i < n; ++i) {
+            words[i] = fill;
+        }
+        if (c->ncomp) c->ncomp -= n;
+    } else {
+        memcpy(words, &c->ba->array[c->pos], n * sizeof *words);
+        c->pos += n;
+    }
+}
+
+/**
+ * Combines two entries of a program stack, storing the result in the first.
+ */
+static inline void program_combine(int opcode, size_t n, bitarray_word *a,
+                                   const bitarray_word *b)
+{
+    switch (opcode) {
+    case BA_OP_AND:
+        for (size_t j = 0; j < n; ++j) a[j] &= b[j];
+        break;
+    case BA_OP_OR:
+        for (size_t j = 0; j < n; ++j) a[j] |= b[j];
+        break;
+    case BA_OP_ANDNOT:
+        for (size_t j = 0; j < n; ++j) a[j] &= ~b[j];
+        break;
+    default:
+        for (size_t j = 0; j < n; ++j) a[j] ^= b[j];
+    }
+}
+
+/**
+ * Replaces the top arg entries of a program stack (starting with first) with
+ * the bits set in at least, at most or exactly k of them.
+ */
+static inline void program_threshold(const struct bitarray_instruction *ins,
+                                     size_t n, bitarray_word *first)
+{
+    if (ins->k > ins->arg) {
+        // Beyond the number of operands, only "at most" can be satisfied
+        bitarray_word word = ins->opcode == BA_OP_ATMOST ? ~MSB : 0;
+        for (size_t j = 0; j < n; ++j) {
+            first[j] = word;
+        }
+        return;
+    }
+    size_t nslices = 1;
+    while (nslices < 64 && (ins->arg >> nslices)) {
+        ++nslices;
+    }
+    bitarray_word slices[64];
+    for (size_t j = 0; j < n; ++j) {
+        memset(slices, 0, nslices * sizeof *slices);
+        for (size_t i = 0; i < ins->arg; ++i) {
+            slices_add(nslices, slices, first[i * PROGRAM_BLOCK + j] & ~MSB);
+        }
+        bitarray_word greater, equal;
+        slices_compare(nslices, slices, ins->k, &greater, &equal);
+        switch (ins->opcode) {
+        case BA_OP_ATLEAST:
+            first[j] = greater | equal;
+            break;
+        case BA_OP_ATMOST:
+            first[j] = ~greater;
+            break;
+        default:
+            first[j] = equal;
+        }
+    }
+}
+
+/**
+ * Runs a program over a block of n words. In the constant case, all operands
+ * are inside fills (or exhausted) and only their fill words are used, without
+ * moving the cursors. Returns the words of the result (MSB not meaningful).
+ * The registers of the program follow its stack.
+ */
+static const bitarray_word *program_block(const struct bitarray_program *prog,
+                                          struct wah_pair_cursor *cursors,
+                                          size_t n, bool constant,
+                                          bitarray_word *stack)
+{
+    bitarray_word *registers = &stack[(prog->stack_size + 1) * PROGRAM_BLOCK];
+    size_t sp = 0; // Number of entries on the stack
+    for (size_t i = 0; i < prog->ninstructions; ++i) {
+        const struct bitarray_instruction *ins = &prog->instructions[i];
+        bitarray_word *top = &stack[sp * PROGRAM_BLOCK];
+        switch (ins->opcode) {
+        case BA_OP_PUSH:
+            if (constant) {
+                struct wah_pair_cursor *c = &cursors[ins->arg];
+                top[0] = c->ncomp ? c->fill : MSB;
+            } else {
+                operand_fetch(&cursors[ins->arg], n, top);
+            }
+            ++sp;
+            break;
+        case BA_OP_PUSH_ALL:
+            for (size_t j = 0; j < n; ++j) top[j] = WORD_MAX;
+            ++sp;
+            break;
+        case BA_OP_NOT:
+            top -= PROGRAM_BLOCK;
+            for (size_t j = 0; j < n; ++j) top[j] = ~top[j];
+            break;
+        case BA_OP_STORE:
+            memcpy(&registers[ins->arg * PROGRAM_BLOCK], top - PROGRAM_BLOCK,
+                   n * sizeof *top);
+            break;
+        case BA_OP_LOAD:
+            memcpy(top, &registers[ins->arg * PROGRAM_BLOCK],
+                   n * sizeof *top);
+            ++sp;
+            break;
+        case BA_OP_AND:
+        case BA_OP_OR:
+        case BA_OP_ANDNOT:
+        case BA_OP_XOR:
+            --sp;
+            program_combine(ins->opcode, n, &stack[(sp - 1) * PROGRAM_BLOCK],
+                            &stack[sp * PROGRAM_BLOCK]);
+            break;
+        default:
+            // Threshold over the top arg entries, counted in bit slices
+            sp -= ins->arg;
+            program_threshold(ins, n, &stack[sp * PROGRAM_BLOCK]);
+            ++sp;
+        }
+    }
+    return stack;
+}
+
+/**
+ * Mask of the valid bits of a word of a region nwords long.
+ */
+static inline bitarray_word valid_bits(uint64_t index, uint64_t nwords,
+                                       bitarray_word start_bits,
+                                       bitarray_word end_bits)
+{
+    bitarray_word mask = WORD_MAX;
+    if (!index) mask &= start_bits;
+    if (index + 1 == nwords) mask &= end_bits;
+    return mask;
+}
+
+/**
+ * Sets the possible values of a threshold instruction applied to the arg
+ * entries starting at can0/can1, for each of the 64 lanes (see below).
+ */
+static inline void forcing_threshold(const struct bitarray_instruction *ins,
+                                     uint64_t *can0, uint64_t *can1)
+{
+    uint64_t res0 = 0;
+    uint64_t res1 = 0;
+    for (unsigned int lane = 0; lane < 64; ++lane) {
+        uint64_t min = 0; // Operands certainly set
+        uint64_t max = 0; // Operands possibly set
+        for (size_t i = 0; i < ins->arg; ++i) {
+            min += !(can0[i] >> lane & 1);
+            max += can1[i] >> lane & 1;
+        }
+        bool set;
+        bool unset;
+        switch (ins->opcode) {
+        case BA_OP_ATLEAST:
+            set = max >= ins->k;
+            unset = min < ins->k;
+            break;
+        case BA_OP_ATMOST:
+            set = min <= ins->k;
+            unset = max > ins->k;
+            break;
+        default:
+            set = min <= ins->k && ins->k <= max;
+            unset = min != ins->k || max != ins->k;
+        }
+        res0 |= (uint64_t)unset << lane;
+        res1 |= (uint64_t)set << lane;
+    }
+    can0[0] = res0;
+    can1[0] = res1;
+}
+
+/**
+ * Works out which value (if any) the result of a program is bound to take
+ * while a given operand is inside a zero or a one fill, whatever the other
+ * operands hold. Returns an array holding, for the zero and then the one fill
+ * of each operand, either that value (0 or 1) or -1.
+ *
+ * Uses three-valued logic, each stack entry recording whether it can be zero
+ * and whether it can be one. The bits of these words are separate lanes, so
+ * that 64 operands are examined at once.
+ */
+static signed char *program_forcing(const struct bitarray_program *prog)
+{
+    signed char *forced = malloc(2 * prog->noperands);
+    uint64_t *can0 = malloc(prog->stack_size * sizeof *can0);
+    uint64_t *can1 = malloc(prog->stack_size * sizeof *can1);
+    uint64_t *reg0 = malloc(prog->nregisters * sizeof *reg0);
+    uint64_t *reg1 = malloc(prog->nregisters * sizeof *reg1);
+    for (size_t base = 0; base < prog->noperands; base += 64) {
+        for (int value = 0; value < 2; ++value) {
+            size_t sp = 0;
+            for (size_t i = 0; i < prog->ninstructions; ++i) {
+                const struct bitarray_instruction *ins = &prog->instructions[i];
+                uint64_t a0 = sp > 1 ? can0[sp - 2] : 0;
+                uint64_t a1 = sp > 1 ? can1[sp - 2] : 0;
+                uint64_t b0 = sp ? can0[sp - 1] : 0;
+                uint64_t b1 = sp ? can1[sp - 1] : 0;
+                switch (ins->opcode) {
+                case BA_OP_PUSH: {
+                    uint64_t lane = ins->arg - base < 64
+                                    ? (uint64_t)1 << (ins->arg - base) : 0;
+                    can0[sp] = value ? ~lane : ~(uint64_t)0;
+                    can1[sp] = value ? ~(uint64_t)0 : ~lane;
+                    ++sp;
+                    break;
+                }
+                case BA_OP_PUSH_ALL:
+                    can0[sp] = 0;
+                    can1[sp] = ~(uint64_t)0;
+                    ++sp;
+                    break;
+                case BA_OP_NOT:
+                    can0[sp - 1] = b1;
+                    can1[sp - 1] = b0;
+                    break;
+                case BA_OP_STORE:
+                    reg0[ins->arg] = b0;
+                    reg1[ins->arg] = b1;
+                    break;
+                case BA_OP_LOAD:
+                    can0[sp] = reg0[ins->arg];
+                    can1[sp] = reg1[ins->arg];
+                    ++sp;
+                    break;
+                case BA_OP_AND:
+                    can0[--sp - 1] = a0 | b0;
+                    can1[sp - 1] = a1 & b1;
+                    break;
+                case BA_OP_OR:
+                    can0[--sp - 1] = a0 & b0;
+                    can1[sp - 1] = a1 | b1;
+                    break;
+                case BA_OP_ANDNOT:
+                    can0[--sp - 1] = a0 | b1;
+                    can1[sp - 1] = a1 & b0;
+                    break;
+                case BA_OP_XOR:
+                    can0[--sp - 1] = (a0 & b0) | (a1 & b1);
+                    can1[sp - 1] = (a0 & b1) | (a1 & b0);
+                    break;
+                default:
+                    sp -= ins->arg;
+                    forcing_threshold(ins, &can0[sp], &can1[sp]);
+                    ++sp;
+                }
+            }
+            for (size_t i = base; i < prog->noperands && i < base + 64; ++i) {
+                bool set = can1[0] >> (i - base) & 1;
+                bool unset = can0[0] >> (i - base) & 1;
+                forced[2 * i + value] = set == unset ? -1 : set;
+            }
+        }
+    }
+    free(reg1);
+    free(reg0);
+    free(can1);
+    free(can0);
+    return forced;
+}
+
+/**
+ * Runs a program over all the words of a region, in blocks limited by the
+ * shortest run of literal or fill words among the operands. Spans where all
+ * operands are inside fills are evaluated once and skipped in one step. If the
+ * operands differ widely in size, so are spans where a fill in one of them
+ * determines the result on its own, with the other operands skipped through.
+ * The result is either written into out or, if out is NULL, only counted.
+ */
+static uint64_t program_run(const struct bitarray_program *prog,
+                            const struct bitarray *operands,
+                            const struct bitarray_interval *region,
+                            struct bitarray *out)
+{
+    uint64_t nwords = region->end_index / bitarray_word_capacity
+                      - region->start_index / bitarray_word_capacity + 1;
+    bitarray_word start_bits = region_start_bits(region);
+    bitarray_word end_bits = region_end_bits(region);
+    struct wah_pair_cursor *cursors = malloc(prog->noperands
+                                             * sizeof *cursors);
+    bitarray_word *stack = malloc((prog->stack_size + 1 + prog->nregisters)
+                                  * PROGRAM_BLOCK * sizeof *stack);
+    size_t max_words = 1;
+    size_t min_size = SIZE_MAX;
+    size_t max_size = 0;
+    for (size_t i = 0; i < prog->noperands; ++i) {
+        cursors[i] = (struct wah_pair_cursor) { .ba = &operands[i] };
+        max_words += operands[i].size;
+        if (operands[i].size < min_size) min_size = operands[i].size;
+        if (operands[i].size > max_size) max_size = operands[i].size;
+    }
+    if (max_words > nwords) {
+        max_words = nwords;
+    }
+    signed char *forced = NULL;
+    if (prog->noperands > 1 && max_size >= GALLOP_RATIO * min_size) {
+        forced = program_forcing(prog);
+    }
+    size_t out_pos = 0;
+    if (out != NULL) {
+        reset_output(out, max_words);
+        out->start_mask = start_bits;
+        out->end_mask = end_bits;
+        out->start_bits = start_bits;
+        out->end_bits = end_bits;
+    }
+
+    uint64_t count = 0;
+    uint64_t index = 0;
+    while (index < nwords) {
+        uint64_t fill_run = nwords - index;
+        bool all_fills = true;
+        size_t decider = SIZE_MAX; // Operand whose fill determines the result
+        uint64_t decider_run = 0;
+        bool ones = false;
+        for (size_t i = 0; i < prog->noperands; ++i) {
+            pair_cursor_load(&cursors[i]);
+            if (cursors[i].ncomp) {
+                if (cursors[i].ncomp < fill_run) {
+                    fill_run = cursors[i].ncomp;
+                }
+                if (forced != NULL && cursors[i].ncomp > decider_run) {
+                    signed char value = forced[2 * i + (cursors[i].fill
+                                                        == WORD_MAX)];
+                    if (value >= 0) {
+                        decider = i;
+                        decider_run = cursors[i].ncomp;
+                        ones = value;
+                    }
+                }
+            } else if (cursors[i].pos < operands[i].size) {
+                all_fills = false;
+            }
+        }
+        if (decider != SIZE_MAX && (!all_fills || decider_run > fill_run)) {
+            if (decider_run > nwords - index) {
+                decider_run = nwords - index;
+            }
+            fill_run = decider_run;
+            for (size_t i = 0; i < prog->noperands; ++i) {
+                pair_cursor_advance(&cursors[i], index, fill_run);
+            }
+        } else if (all_fills) {
+            ones = (*program_block(prog, cursors, 1, true, stack) | MSB)
+                   == WORD_MAX;
+            for (size_t i = 0; i < prog->noperands; ++i) {
+                if (cursors[i].ncomp) cursors[i].ncomp -= fill_run;
+            }
+        }
+        if (decider != SIZE_MAX || all_fills) {
+            if (out != NULL) {
+                append_fill(out, &out_pos, fill_run, ones);
+            } else if (ones) {
+                count += fill_run * bitarray_word_capacity;
+                if (!index) {
+                    bitarray_word first = valid_bits(0, nwords, start_bits,
+                                                     end_bits);
+                    count -= bitarray_word_capacity
+                             - __builtin_popcountll(first & ~MSB);
+                }
+                if (index + fill_run == nwords && nwords > 1) {
+                    count -= bitarray_word_capacity
+                             - __builtin_popcountll(end_bits & ~MSB);
+                }
+            }
+            index += fill_run;
+            continue;
+        }
+        size_t n = nwords - index < PROGRAM_BLOCK ? nwords - index
+                                                  : PROGRAM_BLOCK;
+        for (size_t i = 0; i < prog->noperands; ++i) {
+            n = operand_available(&cursors[i], n);
+        }
+        const bitarray_word *res = program_block(prog, cursors, n, false,
+                                                 stack);
+        for (size_t j = 0; j < n; ++j) {
+            if (out != NULL) {
+                append_word(out, &out_pos, res[j] | MSB);
+            } else {
+                count += __builtin_popcountll(res[j] & ~MSB
+                                & valid_bits(index + j, nwords, start_bits,
+                                             end_bits));
+            }
+        }
+        index += n;
+    }
+    if (out != NULL) {
+        finish_output(out, out_pos);
+    }
+    free(forced);
+    free(stack);
+    free(cursors);
+    return count;
+}
+
+/**
+ * Returns the pairwise operation performed by a program which only combines
+ * two operands, or -1 for any other program. Such programs are run by the
+ * routines for pairs of bit arrays, which use wider literal kernels and skip
+ * through the larger operand of an imbalanced intersection or difference.
+ */
+static int pairwise_operation(const struct bitarray_program *prog)
+{
+    if (prog->ninstructions != 3
+        || prog->instructions[0].opcode != BA_OP_PUSH
+        || prog->instructions[1].opcode != BA_OP_PUSH) {
+        return -1;
     }
-    if (a->array[a->size - 1] & MSB) {
-        out->end_mask = a->end_mask;
-    } else if (b->array[b->size - 1] & MSB) {
-        out->end_mask = b->end_mask;
+    switch (prog->instructions[2].opcode) {
+    case BA_OP_AND:
+        return OP_INTERSECTION;
+    case BA_OP_OR:
+        return OP_UNION;
+    case BA_OP_ANDNOT:
+        return OP_DIFFERENCE;
+    case BA_OP_XOR:
+        return OP_SYMMETRIC_DIFFERENCE;
+    default:
+        return -1;
     }
 }
 
 /**
- * Either adds a zero fill word corresponding to zf_num compressed zero words
- * at the specified position and increments the position by one, or increases
- * the preceding zero fill word if one exists.
+ * Evaluates a program over operands covering the same region, writing the
+ * result into out in a single pass without intermediate bit arrays.
  */
-static inline void append_zerofills(struct bitarray *ba, size_t *pos,
-                                    size_t zf_num)
+void bitarray_program_eval_into(const struct bitarray_program *prog,
+                                const struct bitarray *operands,
+                                const struct bitarray_interval *region,
+                                struct bitarray *out)
 {
-    if (*pos && !(ba->array[(*pos) - 1] & MSB)) {
-        ba->array[(*pos) - 1] += zf_num;
+    int operation = pairwise_operation(prog);
+    if (operation >= 0) {
+        bitarray_operation(operation, &operands[prog->instructions[0].arg],
+                           &operands[prog->instructions[1].arg], out);
     } else {
-        ba->array[(*pos)++] = zf_num - 1;
+        program_run(prog, operands, region, out);
     }
 }
 
-void bitarray_union(const struct bitarray *a, const struct bitarray *b,
-                    struct bitarray **out)
+/**
+ * Counts the set bits in the result of a program without building it.
+ */
+uint64_t bitarray_program_count(const struct bitarray_program *prog,
+                                const struct bitarray *operands,
+                                const struct bitarray_interval *region)
 {
-    *out = init_bitarray((a->size + a->ncompressed + b->size + b->ncompressed)
-                         * bitarray_word_capacity);
-    load_masks(a, b, *out);
+    int operation = pairwise_operation(prog);
+    if (operation >= 0) {
+        return bitarray_operation_count(operation,
+                                        &operands[prog->instructions[0].arg],
+                                        &operands[prog->instructions[1].arg]);
+    }
+    return program_run(prog, operands, region, NULL);
+}
 
-    size_t a_pos = 0;
-    size_t a_ncomp = 0; // Number of compressed empty words in a
-    size_t b_pos = 0;
-    size_t b_ncomp = 0; // Number of compressed empty words in b
-    size_t out_pos = 0;
+/**
+ * Returns true if a bit array covers a single (uncompressed) word.
+ */
+static inline bool single_word(const struct bitarray *ba)
+{
+    return ba->size == 1 && word_length(ba, 0) == 1;
+}
 
-    while (a_pos < a->size || b_pos < b->size) {
-        if (!(a->array[a_pos] & MSB)) {
-            a_ncomp += load_zerofill(a, a_pos++);
-        }
-        if (!(b->array[b_pos] & MSB)) {
-            b_ncomp += load_zerofill(b, b_pos++);
-        }
-        if (a_ncomp) {
-            if (b_ncomp) {
-                // Skipping over the smaller set of compressed words
-                size_t to_skip = (a_ncomp > b_ncomp) ? b_ncomp : a_ncomp;
-                append_zerofills(*out, &out_pos, to_skip);
-                a_ncomp -= to_skip;
-                b_ncomp -= to_skip;
-            } else {
-                // Only b word set
-                (*out)->array[out_pos++] = b->array[b_pos++];
-                --a_ncomp;
-            }
-            continue;
-        } else if (b_ncomp) {
-            // Only a word set
-            (*out)->array[out_pos++] = a->array[a_pos++];
-            --b_ncomp;
-            continue;
-        }
-        (*out)->array[out_pos++] = a->array[a_pos++] | b->array[b_pos++];
+/**
+ * Returns the number of bits set by an operation in the first and last words
+ * of its result which are excluded by the start and end masks.
+ */
+static inline uint64_t count_masked_out(int operation,
+                                        const struct bitarray *a,
+                                        const struct bitarray *b)
+{
+    bitarray_word a_first = (a->array[0] & MSB) ? a->array[0]
+                                                : fill_literal(a->array[0]);
+    bitarray_word b_first = (b->array[0] & MSB) ? b->array[0]
+                                                : fill_literal(b->array[0]);
+    bitarray_word start_mask = (a->array[0] & MSB) ? a->start_mask
+                               : (b->array[0] & MSB) ? b->start_mask
+                               : a->start_bits & b->start_bits;
+    bitarray_word first = combine_words(operation, a_first, b_first) & ~MSB;
+    if (single_word(a) || single_word(b)) {
+        // Region covers a single word, both masks apply to it
+        bitarray_word end_mask = (a->array[0] & MSB) ? a->end_mask
+                                 : (b->array[0] & MSB) ? b->end_mask
+                                 : a->end_bits & b->end_bits;
+        return __builtin_popcountll(first & ~(start_mask & end_mask));
     }
-    (*out)->last_word = out_pos - 1;
-    bitarray_shrinkwrap(*out);
+    bitarray_word a_last = a->array[a->size - 1];
+    bitarray_word b_last = b->array[b->size - 1];
+    bitarray_word end_mask = (a_last & MSB) ? a->end_mask
+                             : (b_last & MSB) ? b->end_mask
+                             : a->end_bits & b->end_bits;
+    bitarray_word last = combine_words(operation,
+                                       (a_last & MSB) ? a_last
+                                                      : fill_literal(a_last),
+                                       (b_last & MSB) ? b_last
+                                                      : fill_literal(b_last))
+                         & ~MSB;
+    return __builtin_popcountll(first & ~start_mask)
+           + __builtin_popcountll(last & ~end_mask);
 }
 
-void bitarray_intersection(const struct bitarray *a,
-                           const struct bitarray *b,
-                           struct bitarray **out)
+/**
+ * Counts the bits set in the result of an operation without building it.
+ */
+static uint64_t bitarray_operation_count(int operation,
+                                         const struct bitarray *a,
+                                         const struct bitarray *b)
 {
-    *out = init_bitarray((a->size + a->ncompressed + b->size + b->ncompressed)
-                         * bitarray_word_capacity);
-    load_masks(a, b, *out);
-
-    size_t a_pos = 0;
-    size_t a_ncomp = 0; // Number of compressed empty words in a
-    size_t b_pos = 0;
-    size_t b_ncomp = 0; // Number of compressed empty words in b
-    size_t out_pos = 0;
+    uint64_t count = 0;
+    struct wah_pair_cursor ca = { .ba = a };
+    struct wah_pair_cursor cb = { .ba = b };
+    uint64_t index = 0; // Uncompressed index of the current word
+    bool gallop = (operation == OP_INTERSECTION
+                   || operation == OP_DIFFERENCE) && imbalanced(a, b);
 
-    while (a_pos < a->size || b_pos < b->size) {
-        if (a_pos < a->size) {
-            if (!(a->array[a_pos] & MSB)) {
-                a_ncomp += load_zerofill(a, a_pos++);
+    for (;;) {
+        if (!ca.ncomp && !cb.ncomp) {
+            size_t run = literal_run_bound(a, ca.pos, b, cb.pos);
+            if (run) {
+                size_t n = count_literal_run(operation, &a->array[ca.pos],
+                                             &b->array[cb.pos], run, &count);
+                ca.pos += n;
+                cb.pos += n;
+                index += n;
+                continue;
             }
         }
-        if (b_pos < b->size) {
-            if (!(b->array[b_pos] & MSB)) {
-                b_ncomp += load_zerofill(b, b_pos++);
+        pair_cursor_load(&ca);
+        pair_cursor_load(&cb);
+        if (gallop) {
+            uint64_t skipped = pair_cursor_gallop(operation, &ca, &cb, index);
+            if (skipped) {
+                index += skipped;
+                continue;
             }
         }
-        if (a_ncomp) {
-            if (b_ncomp) {
-                // Skipping over the smaller set of compressed words
-                size_t to_skip = (a_ncomp > b_ncomp) ? b_ncomp : a_ncomp;
-                append_zerofills(*out, &out_pos, to_skip);
-                a_ncomp -= to_skip;
-                b_ncomp -= to_skip;
-            } else {
-                // Only b word set
-                append_zerofills(*out, &out_pos, 1);
-                --a_ncomp;
-                ++b_pos;
+        if (pair_cursor_in_fill(&ca) && pair_cursor_in_fill(&cb)) {
+            if (!ca.ncomp && !cb.ncomp) break; // Both arrays exhausted
+            bool ones;
+            uint64_t skipped = pair_cursor_skip(operation, &ca, &cb, &ones);
+            if (ones) {
+                count += skipped * bitarray_word_capacity;
             }
+            index += skipped;
             continue;
-        } else if (b_ncomp) {
-            // Only a word set
-            append_zerofills(*out, &out_pos, 1);
-            --b_ncomp;
-            ++a_pos;
-            continue;
-        }
-        bitarray_word res = a->array[a_pos++] & b->array[b_pos++];
-        if (res == MSB) {
-            // Only MSB set, no intersection
-            append_zerofills(*out, &out_pos, 1);
-        } else {
-            (*out)->array[out_pos++] = res;
         }
+        bitarray_word a_word = pair_cursor_next(&ca);
+        bitarray_word b_word = pair_cursor_next(&cb);
+        count += __builtin_popcountll(combine_words(operation, a_word, b_word)
+                                      & ~MSB);
+        ++index;
     }
-    (*out)->last_word = out_pos - 1;
-    bitarray_shrinkwrap(*out);
+
+    return count - count_masked_out(operation, a, b);
 }
 
-void bitarray_difference(const struct bitarray *a, const struct bitarray *b,
-                         struct bitarray **out)
+/*
+ * Routines counting the bits set in the result of a set theoretical operation
+ * without allocating the result.
+ */
+uint64_t bitarray_intersection_count(const struct bitarray *a,
+                                     const struct bitarray *b)
 {
-    *out = init_bitarray((a->size + a->ncompressed + b->size + b->ncompressed)
-                         * bitarray_word_capacity);
-    load_masks(a, b, *out);
-
-    size_t a_pos = 0;
-    size_t a_ncomp = 0; // Number of compressed empty words in a
-    size_t b_pos = 0;
-    size_t b_ncomp = 0; // Number of compressed empty words in b
-    size_t out_pos = 0;
-
-    while (a_pos < a->size || b_pos < b->size) {
-        if (!(a->array[a_pos] & MSB)) {
-            a_ncomp += load_zerofill(a, a_pos++);
-        }
-        if (!(b->array[b_pos] & MSB)) {
-            b_ncomp += load_zerofill(b, b_pos++);
-        }
-        if (a_ncomp) {
-            if (b_ncomp) {
-                // Skipping over the smaller set of compressed words
-                size_t to_skip = (a_ncomp > b_ncomp) ? b_ncomp : a_ncomp;
-                append_zerofills(*out, &out_pos, to_skip);
-                a_ncomp -= to_skip;
-                b_ncomp -= to_skip;
-            } else {
-                // Only b word set
-                append_zerofills(*out, &out_pos, 1);
-                --a_ncomp;
-                ++b_pos;
-            }
-            continue;
-        } else if (b_ncomp) {
-            // Only a word set
-            (*out)->array[out_pos++] = a->array[a_pos++];
-            --b_ncomp;
-            continue;
-        }
-        bitarray_word res = a->array[a_pos++] & ~b->array[b_pos++];
-        if (res == 0) {
-            // MSB is not set due to ~
-            append_zerofills(*out, &out_pos, 1);
-        } else {
-            (*out)->array[out_pos++] = res | MSB;
-        }
-    }
-    (*out)->last_word = out_pos - 1;
-    bitarray_shrinkwrap(*out);
+    return bitarray_operation_count(OP_INTERSECTION, a, b);
 }
 
-void bitarray_symmetric_difference(const struct bitarray *a,
-                                   const struct bitarray *b,
-                                   struct bitarray **out)
+uint64_t bitarray_union_count(const struct bitarray *a,
+                              const struct bitarray *b)
 {
-    *out = init_bitarray((a->size + a->ncompressed + b->size + b->ncompressed)
-                         * bitarray_word_capacity);
-    load_masks(a, b, *out);
+    return bitarray_operation_count(OP_UNION, a, b);
+}
 
-    size_t a_pos = 0;
-    size_t a_ncomp = 0; // Number of compressed empty words in a
-    size_t b_pos = 0;
-    size_t b_ncomp = 0; // Number of compressed empty words in b
-    size_t out_pos = 0;
+uint64_t bitarray_difference_count(const struct bitarray *a,
+                                   const struct bitarray *b)
+{
+    return bitarray_operation_count(OP_DIFFERENCE, a, b);
+}
 
-    while (a_pos < a->size || b_pos < b->size) {
-        if (!(a->array[a_pos] & MSB)) {
-            a_ncomp += load_zerofill(a, a_pos++);
-        }
-        if (!(b->array[b_pos] & MSB)) {
-            b_ncomp += load_zerofill(b, b_pos++);
-        }
-        if (a_ncomp) {
-            if (b_ncomp) {
-                // Skipping over the smaller set of compressed words
-                size_t to_skip = (a_ncomp > b_ncomp) ? b_ncomp : a_ncomp;
-                append_zerofills(*out, &out_pos, to_skip);
-                a_ncomp -= to_skip;
-                b_ncomp -= to_skip;
-            } else {
-                // Only b word set
-                (*out)->array[out_pos++] = b->array[b_pos++];
-                --a_ncomp;
-            }
-            continue;
-        } else if (b_ncomp) {
-            // Only a word set
-            (*out)->array[out_pos++] = a->array[a_pos++];
-            --b_ncomp;
-            continue;
-        }
-        bitarray_word res = a->array[a_pos++] ^ b->array[b_pos++];
-        if (res == 0) {
-            append_zerofills(*out, &out_pos, 1);
-        } else {
-            (*out)->array[out_pos++] = res | MSB;
-        }
-    }
-    (*out)->last_word = out_pos - 1;
-    bitarray_shrinkwrap(*out);
+uint64_t bitarray_symmetric_difference_count(const struct bitarray *a,
+                                             const struct bitarray *b)
+{
+    return bitarray_operation_count(OP_SYMMETRIC_DIFFERENCE, a, b);
 }
 
 /**
@@ -398,94 +2110,96 @@ void bitarray_symmetric_difference(const struct bitarray *a,
  */
 uint64_t bitarray_distance(const struct bitarray *a, const struct bitarray *b)
 {
-    uint64_t distance = 0;
     if (!a->size && !b->size) {
-        return distance;
+        return 0;
     }
+    return bitarray_symmetric_difference_count(a, b);
+}
 
-    size_t a_pos = 0;
-    size_t a_ncomp = 0; // Number of compressed empty words in a
-    size_t b_pos = 0;
-    size_t b_ncomp = 0; // Number of compressed empty words in b
+/**
+ * Returns the number of bits set in a one fill at a given position in a bit
+ * array, leaving out those excluded by the start and end bits.
+ */
+static inline uint64_t one_fill_weight(const struct bitarray *ba, size_t pos)
+{
+    bitarray_word first = pos ? WORD_MAX : ba->start_bits;
+    bitarray_word last = (pos + 1 < ba->size) ? WORD_MAX : ba->end_bits;
+    uint64_t nwords = load_fill(ba, pos);
+    if (nwords == 1) {
+        return __builtin_popcountll(first & last & ~MSB);
+    }
+    return (nwords - 2) * bitarray_word_capacity
+           + __builtin_popcountll(first & ~MSB)
+           + __builtin_popcountll(last & ~MSB);
+}
 
-    while (a_pos < a->size || b_pos < b->size) {
-        if (!(a->array[a_pos] & MSB)) {
-            a_ncomp += load_zerofill(a, a_pos++);
-        }
-        if (!(b->array[b_pos] & MSB)) {
-            b_ncomp += load_zerofill(b, b_pos++);
-        }
-        if (a_ncomp) {
-            if (b_ncomp) {
-                // Skipping over the smaller set of compressed words
-                size_t to_skip = (a_ncomp > b_ncomp) ? b_ncomp : a_ncomp;
-                a_ncomp -= to_skip;
-                b_ncomp -= to_skip;
-            } else {
-                // Only b word set
-                distance += __builtin_popcountll(b->array[b_pos++]) - 1;
-                --a_ncomp;
+/*
+ * Get the number of non-zero bits (Hamming weight) in the bit array.
+ */
+uint64_t bitarray_weight(const struct bitarray *ba)
+{
+    uint64_t weight = 0;
+    for (size_t i = 0; i < ba->size; ++i) {
+        bitarray_word word = ba->array[i];
+        if (!(word & MSB)) {
+            if (word & ONE_FILL) {
+                weight += one_fill_weight(ba, i);
             }
             continue;
-        } else if (b_ncomp) {
-            // Only a word set
-            distance += __builtin_popcountll(a->array[a_pos++]) - 1;
-            --b_ncomp;
-            continue;
         }
-        distance += __builtin_popcountll(a->array[a_pos++]
-                                            ^ b->array[b_pos++]);
-    }
-
-    // Removing bits masked by start
-    if ((a->array[0] & MSB) && (b->array[0] & MSB)) {
-        distance -= __builtin_popcountll((a->array[0] ^ b->array[0])
-                                         & ~a->start_mask);
-    } else if (a->array[0] & MSB) {
-        distance -= __builtin_popcountll(a->array[0] & ~a->start_mask);
-    } else if (b->array[0] & MSB) {
-        distance -= __builtin_popcountll(b->array[0] & ~b->start_mask);
+        if (!i) {
+            word &= ba->start_mask;
+        }
+        if (i + 1 == ba->size) {
+            word &= ba->end_mask;
+        }
+        weight += __builtin_popcountll(word & ~MSB);
     }
+    return weight;
+}
 
-    // Removing bits masked by end
-    size_t a_last = a->size - 1;
-    size_t b_last = b->size - 1;
-    if ((a->array[a_last] & MSB) && (b->array[b_last] & MSB)) {
-        distance -= __builtin_popcountll((a->array[a_last] ^ b->array[b_last])
-                                         & ~a->end_mask);
-    } else if (a->array[a_last] & MSB) {
-        distance -= __builtin_popcountll(a->array[a_last] & ~a->end_mask);
-    } else if (b->array[b_last] & MSB) {
-        distance -= __builtin_popcountll(b->array[b_last] & ~b->end_mask);
+/*
+ * Get the number of fill words in the bit array (all others being literals).
+ */
+size_t bitarray_fill_count(const struct bitarray *ba)
+{
+    size_t nfills = 0;
+    for (size_t i = 0; i < ba->size; ++i) {
+        nfills += !(ba->array[i] & MSB);
     }
-
-    return distance;
+    return nfills;
 }
 
 /*
- * Get the number of non-zero bits (Hamming weight) in the bit array.
+ * Copy bit array, storing any full literal words as one fills. Needs to be
+ * freed manually.
  */
-uint64_t bitarray_weight(const struct bitarray *ba)
+struct bitarray *bitarray_compact(const struct bitarray *ba)
 {
-    uint64_t weight = 0;
-    if (ba->size == 1 && (ba->array[0] & MSB)) {
-        return __builtin_popcountll(ba->array[0]
-                                    & ba->start_mask
-                                    & ba->end_mask) - 1;
-    }
-    if (ba->array[0] & MSB) {
-        weight += __builtin_popcountll(ba->array[0] & ba->start_mask) - 1;
-    }
-    if (ba->array[ba->size - 1] & MSB) {
-        weight += __builtin_popcountll(ba->array[ba->size - 1]
-                                       & ba->end_mask) - 1;
-    }
-    for (size_t i = 1; i < ba->size - 1; ++i) {
-        if (ba->array[i] & MSB) {
-            weight += __builtin_popcountll(ba->array[i]) - 1;
+    struct bitarray *compacted = init_bitarray(ba->size
+                                               * bitarray_word_capacity);
+    compacted->start_mask = ba->start_mask;
+    compacted->end_mask = ba->end_mask;
+    compacted->start_bits = ba->start_bits;
+    compacted->end_bits = ba->end_bits;
+    size_t pos = 0;
+    for (size_t i = 0; i < ba->size; ++i) {
+        bitarray_word word = ba->array[i];
+        if (!(word & MSB)) {
+            append_fill(compacted, &pos, load_fill(ba, i), word & ONE_FILL);
+            continue;
+        }
+        if (!i) {
+            word &= ba->start_mask;
+        }
+        if (i + 1 == ba->size) {
+            word &= ba->end_mask;
         }
+        append_word(compacted, &pos, word);
     }
-    return weight;
+    compacted->last_word = pos - 1;
+    bitarray_shrinkwrap(compacted);
+    return compacted;
 }
 
 static inline void bitarray_resize_internal(struct bitarray *ba,
@@ -493,11 +2207,17 @@ static inline void bitarray_resize_internal(struct bitarray *ba,
 {
     size_t old_size = ba->size;
     ba->size = new_size_words;
+    ba->capacity = new_size_words;
     ba->array = realloc(ba->array, ba->size * sizeof *(ba->array));
     if (new_size_words > old_size) {
         memset(&ba->array[old_size], 0,
             (ba->size - old_size) * sizeof *(ba->array));
-        ba->array[ba->last_word + 1] = ba->size - ba->last_word - 2;
+        if (!ba->last_word && !(ba->array[0] & MSB)) {
+            // Empty bit array, a single fill word
+            ba->array[0] = ba->size - 1;
+        } else {
+            ba->array[ba->last_word + 1] = ba->size - ba->last_word - 2;
+        }
     } else {
         // TODO: Handle shrinking (primarily adjusting last word and end mask)
     }
@@ -523,6 +2243,27 @@ void bitarray_resize(struct bitarray *ba, uint64_t new_size)
     }
 }
 
+/**
+ * Makes sure a bit array has storage for at least nwords words, keeping its
+ * contents. Storage is grown geometrically so that a bit array reused for
+ * results of varying size is only reallocated a few times. A bit array whose
+ * storage it does not own (e.g. one extracted from a database) is given new
+ * storage instead.
+ */
+void bitarray_reserve(struct bitarray *ba, size_t nwords)
+{
+    if (ba->capacity >= nwords) return;
+    if (!ba->capacity) {
+        ba->array = NULL;
+    }
+    size_t new_capacity = ba->capacity * GROWTH_FACTOR;
+    if (new_capacity < nwords) {
+        new_capacity = nwords;
+    }
+    ba->array = realloc(ba->array, new_capacity * sizeof *(ba->array));
+    ba->capacity = new_capacity;
+}
+
 /*
  * Set the bit at the specified position to 1.
  * Returns 0 on success, -1 on failure.
@@ -580,103 +2321,260 @@ int bitarray_set_bit(struct bitarray *ba, size_t pos)
     return 0;
 }
 
+static void builder_start(struct bitarray_builder *builder)
+{
+    builder->ba = init_output();
+    bitarray_reserve(builder->ba, bit_to_word_size(builder->size_hint));
+    builder->pos = 0;
+    builder->word_index = 0;
+    builder->word = MSB;
+}
+
+void init_bitarray_builder(struct bitarray_builder *builder,
+                           uint64_t size_hint)
+{
+    builder->size_hint = size_hint ? size_hint : bitarray_word_capacity;
+    builder_start(builder);
+}
+
+/**
+ * Writes out the pending word and any empty words preceding the word at
+ * word_index, which becomes the pending word. Returns -1 if word_index is
+ * before the pending word.
+ */
+static inline int builder_seek(struct bitarray_builder *builder,
+                               uint64_t word_index)
+{
+    if (word_index == builder->word_index) return 0;
+    if (word_index < builder->word_index) return -1;
+    // At most one literal and one fill word are added
+    bitarray_reserve(builder->ba, builder->pos + 2);
+    append_word(builder->ba, &builder->pos, builder->word);
+    if (word_index > builder->word_index + 1) {
+        append_fill(builder->ba, &builder->pos,
+                    word_index - builder->word_index - 1, false);
+    }
+    builder->word_index = word_index;
+    builder->word = MSB;
+    return 0;
+}
+
 /*
- * Get the value (0 or 1) of the bit at a particular position.
+ * Sets the bits at the specified positions, which should be sorted in
+ * ascending order and no lower than any position set previously (repeated
+ * positions are allowed).
+ * Returns 0 on success, -1 on failure.
  */
-int bitarray_get_bit(const struct bitarray *ba, size_t pos)
+int bitarray_builder_add(struct bitarray_builder *builder, size_t nindices,
+                         const uint64_t *indices)
 {
-    size_t word_index = pos / bitarray_word_capacity;
-    bitarray_word mask = ((bitarray_word)1 << pos % bitarray_word_capacity);
-    if (word_index == 0) {
-        if (!(ba->array[0] & MSB) || !(ba->array[0] & mask & ba->start_mask)) {
-            // Bit in first word and not set or not covered by start mask
-            return 0;
-        } else {
-            return 1;
+    for (size_t i = 0; i < nindices; ++i) {
+        if (builder_seek(builder, indices[i] / bitarray_word_capacity)) {
+            return -1;
         }
+        builder->word |= (bitarray_word)1
+                         << indices[i] % bitarray_word_capacity;
     }
-    if (word_index == ba->size + ba->ncompressed - 1) {
-        if (!(ba->array[ba->size - 1] & MSB)
-            || !(ba->array[ba->size - 1] & mask & ba->end_mask)) {
-            // Bit in last word and not set or not covered by end mask
-            return 0;
-        } else {
-            return 1;
-        }
+    return 0;
+}
+
+/*
+ * Sets the bits of a 64-bit block starting at the specified position, with the
+ * least significant bit of the block corresponding to that position. The
+ * block should not precede any position set previously.
+ * Returns 0 on success, -1 on failure.
+ */
+int bitarray_builder_add_block(struct bitarray_builder *builder,
+                               uint64_t start, uint64_t bits)
+{
+    if (!bits) return 0;
+    uint64_t word_index = start / bitarray_word_capacity;
+    unsigned int offset = start % bitarray_word_capacity;
+    // A 64-bit block spans at most two words
+    bitarray_word low = (bitarray_word)bits << offset & ~MSB;
+    bitarray_word high = (bitarray_word)bits >> (bitarray_word_capacity
+                                                 - offset);
+    if (low) {
+        if (builder_seek(builder, word_index)) return -1;
+        builder->word |= low;
     }
-    size_t ncompressed = 0;
-    if (!(ba->array[0] & MSB)) {
-        // Include the compression at the start
-        // (or only part of it, depending on the start mask)
-        ncompressed += (ba->array[0] > ba->start_mask) ? ba->start_mask
-                                                       : ba->array[0];
+    if (high) {
+        if (builder_seek(builder, word_index + 1)) return -1;
+        builder->word |= high;
     }
-    for (size_t i = 1; i < ba->size - 1; ++i) {
-        if (i + ncompressed > word_index) {
-            // Index was in the compressed interval
-            return 0;
-        }
-        if (i + ncompressed == word_index) {
-            return (ba->array[i] & MSB) && (ba->array[i] & mask);
-        }
-        if (!(ba->array[i] & MSB)) {
-            ncompressed += ba->array[i];
+    return 0;
+}
+
+/*
+ * Completes the bit array with the remaining empty words up to nbits bits and
+ * returns it with its storage trimmed to size, with masks matching those of the
+ * region [0, nbits - 1] extracted from a larger bit array. The returned bit
+ * array needs to be freed manually.
+ */
+struct bitarray *bitarray_builder_finish(struct bitarray_builder *builder,
+                                         uint64_t nbits)
+{
+    uint64_t nwords = bit_to_word_size(nbits);
+    struct bitarray *ba = builder->ba;
+    if (builder->word_index < nwords) {
+        builder_seek(builder, nwords);
+    }
+    finish_output(ba, builder->pos);
+    ba->end_bits = region_end_bits(&(struct bitarray_interval) {
+        .start_index = 0,
+        .end_index = nbits - 1
+    });
+    if (ba->array[ba->size - 1] & MSB) {
+        ba->end_mask = ba->end_bits;
+    }
+    ba->capacity = ba->size;
+    ba->array = realloc(ba->array, ba->size * sizeof *(ba->array));
+    builder_start(builder);
+    return ba;
+}
+
+void free_bitarray_builder(struct bitarray_builder *builder)
+{
+    free_bitarray(builder->ba);
+    builder->ba = NULL;
+}
+
+/*
+ * Get the value (0 or 1) of the bit at a particular position.
+ */
+int bitarray_get_bit(const struct bitarray *ba, size_t pos)
+{
+    uint64_t word_index = pos / bitarray_word_capacity;
+    bitarray_word mask = ((bitarray_word)1 << pos % bitarray_word_capacity);
+    size_t i;
+    size_t ncompressed;
+    skip_to_word(ba, word_index, &i, &ncompressed);
+    uint64_t index = i + ncompressed; // Uncompressed index of word i
+    for (; i < ba->size; ++i) {
+        size_t length = word_length(ba, i);
+        if (word_index < index + length) {
+            if (!(ba->array[i] & MSB)) {
+                // Index was in the compressed interval
+                if (!(ba->array[i] & ONE_FILL)) return 0;
+                bitarray_word word = mask;
+                if (!i && word_index == index) {
+                    word &= ba->start_bits;
+                }
+                if (i + 1 == ba->size && word_index + 1 == index + length) {
+                    word &= ba->end_bits;
+                }
+                return word != 0;
+            }
+            bitarray_word word = ba->array[i] & mask;
+            if (!i) {
+                word &= ba->start_mask;
+            }
+            if (i + 1 == ba->size) {
+                word &= ba->end_mask;
+            }
+            return word != 0;
         }
+        index += length;
     }
     return 0;
 }
 
-/*
- * Get array of the indices of set (i.e. true) bits in the bit array.
- * Allocates memory to the first argument; this needs to be freed independently.
- */
-int bitarray_get_set_indices(const struct bitarray *ba,
-                             size_t *nset_indices, size_t **set_indices)
-{
-    *set_indices = malloc(bitarray_word_capacity * ba->size
-                          * sizeof **set_indices);
-    *nset_indices = 0;
-    uint64_t ncompressed = 0;
-    bitarray_word current_word;
-    for (uint64_t i = 0; i < ba->size; ++i) {
-        if (!(ba->array[i] & MSB))  {
-            // MSB is 0, fill word (run-length of zeroes)
-            ncompressed += ba->array[i];
+void init_bitarray_set_iterator(struct bitarray_set_iterator *it,
+                                const struct bitarray *ba)
+{
+    *it = (struct bitarray_set_iterator) {
+        .ba = ba
+    };
+}
+
+/**
+ * Loads the next word containing set bits (if any) into the iterator. Returns
+ * false if there are no further set bits in the bit array.
+ */
+static inline bool set_iterator_load(struct bitarray_set_iterator *it)
+{
+    const struct bitarray *ba = it->ba;
+    for (;;) {
+        if (it->nfill) {
+            // Next word of a one fill
+            bitarray_word word = WORD_MAX;
+            if (!it->next_word_index) {
+                word &= ba->start_bits;
+            }
+            if (it->nfill == 1 && it->pos == ba->size) {
+                word &= ba->end_bits;
+            }
+            --it->nfill;
+            it->base = it->next_word_index++ * bitarray_word_capacity;
+            it->word = word & ~MSB;
+            if (it->word) return true;
             continue;
         }
-        current_word = ba->array[i];
-        if (!i) {
-            current_word &= ba->start_mask;
+        if (it->pos >= ba->size) break;
+        size_t pos = it->pos++;
+        bitarray_word word = ba->array[pos];
+        if (!(word & MSB)) {
+            if (word & ONE_FILL) {
+                it->nfill = load_fill(ba, pos);
+            } else {
+                it->next_word_index += load_fill(ba, pos);
+            }
+            continue;
         }
-        if (i + 1 == ba->size) {
-            current_word &= ba->end_mask;
+        if (!pos) {
+            word &= ba->start_mask;
         }
-        for (uint16_t j = 0; j < bitarray_word_capacity; ++j) {
-            if (current_word & ((bitarray_word)1 << j)) {
-                (*set_indices)[(*nset_indices)++] = bitarray_word_capacity
-                                                    * (i + ncompressed) + j;
-            }
+        if (pos + 1 == ba->size) {
+            word &= ba->end_mask;
         }
+        it->base = it->next_word_index++ * bitarray_word_capacity;
+        it->word = word & ~MSB;
+        if (it->word) return true;
     }
-    // Truncate to final size
-    *set_indices = realloc(*set_indices,
-                           (*nset_indices) * sizeof **set_indices);
-    return 0;
+    return false;
 }
 
-void bitarray_shrinkwrap(struct bitarray *ba)
+/**
+ * Outputs the index of the next set bit. Returns false (leaving the index
+ * unchanged) once all set bits have been returned.
+ */
+bool bitarray_set_iterator_next(struct bitarray_set_iterator *it,
+                                uint64_t *index)
 {
-    ba->size = ba->last_word + 1;
-    ba->array = realloc(ba->array, ba->size * sizeof *(ba->array));
-    if (!(ba->array[0] & MSB)) {
-        ba->start_mask = ba->array[0];
-        if (ba->size == 1) {
-            ba->end_mask = ba->start_mask;
-        }
+    if (!it->word && !set_iterator_load(it)) {
+        return false;
     }
-    if (!(ba->array[ba->size - 1] & MSB)) {
-        ba->end_mask = ba->array[ba->size - 1];
+    *index = it->base + __builtin_ctzll(it->word);
+    it->word &= it->word - 1; // Clearing lowest set bit
+    return true;
+}
+
+/**
+ * Outputs the indices of up to max_indices following set bits. Returns the
+ * number of indices written, which is lower than max_indices only once all
+ * set bits have been returned.
+ */
+size_t bitarray_set_iterator_next_batch(struct bitarray_set_iterator *it,
+                                        size_t max_indices, uint64_t *indices)
+{
+    size_t n = 0;
+    while (n < max_indices) {
+        if (!it->word && !set_iterator_load(it)) break;
+        bitarray_word word = it->word;
+        while (word && n < max_indices) {
+            indices[n++] = it->base + __builtin_ctzll(word);
+            word &= word - 1;
+        }
+        it->word = word;
     }
+    return n;
+}
+
+void bitarray_shrinkwrap(struct bitarray *ba)
+{
+    finish_output(ba, ba->last_word + 1);
+    ba->capacity = ba->size;
+    ba->array = realloc(ba->array, ba->size * sizeof *(ba->array));
 }
 
 /**
@@ -687,11 +2585,12 @@ void bitarray_shrinkwrap(struct bitarray *ba)
  * same bit array, e.g. in binning, as we keep track of the number of traversed
  * words instead of traversing from the beginning for each bin.
  *
- * TODO: make src_array const and bit array contents immutable (const struct
- * elements).
+ * The source is only read, so that regions can be extracted from the same bit
+ * array by several threads at once. The extracted bit array points into it and
+ * does not own its storage (zero capacity), which makes it read-only as well.
  */
 static inline void extract_region(struct bitarray *dest_ba,
-                                  bitarray_word *src_array,
+                                  const bitarray_word *src_array,
                                   const struct bitarray_interval *region,
                                   size_t *index, size_t *ncompressed)
 {
@@ -704,41 +2603,47 @@ static inline void extract_region(struct bitarray *dest_ba,
     size_t i;
     for (i = *index; i <= internal_end_index; ++i) {
         if (src_array[i] & MSB) continue; // no compression
+        bitarray_word fill = src_array[i] & FILL_LENGTH;
         if (internal_start_index >= i) {
-            if (internal_start_index <= i + src_array[i]) {
-                dest_ba->start_mask = src_array[i] - (internal_start_index - i);
+            if (internal_start_index <= i + fill) {
+                dest_ba->start_mask = fill - (internal_start_index - i);
                 internal_start_index = i;
             } else {
-                internal_start_index -= src_array[i];
+                internal_start_index -= fill;
             }
         }
-        if (internal_end_index <= i + src_array[i]) {
+        if (internal_end_index <= i + fill) {
             dest_ba->end_mask = internal_end_index - i;
             internal_end_index = i;
         } else {
-            internal_end_index -= src_array[i];
+            internal_end_index -= fill;
         }
-        *ncompressed += src_array[i];
+        *ncompressed += fill;
     }
     *index = i - 1;
     if (!(src_array[internal_end_index] & MSB)) {
-        *ncompressed -= src_array[*index];
+        *ncompressed -= src_array[*index] & FILL_LENGTH;
     }
 
     dest_ba->size = 1 + internal_end_index - internal_start_index;
     dest_ba->last_word = 0;
     dest_ba->ncompressed = *ncompressed;
-    dest_ba->array = &(src_array[internal_start_index]);
+    dest_ba->array = (bitarray_word *)&src_array[internal_start_index];
+    dest_ba->skip_index = NULL;
+    dest_ba->capacity = 0;
+    dest_ba->start_bits = region_start_bits(region);
+    dest_ba->end_bits = region_end_bits(region);
     if (src_array[internal_start_index] & MSB) {
-        dest_ba->start_mask = WORD_MAX << region->start_index
-                                          % bitarray_word_capacity;
+        dest_ba->start_mask = dest_ba->start_bits;
     }
-
     if (src_array[internal_end_index] & MSB) {
-        dest_ba->end_mask = WORD_MAX >> (bitarray_word_capacity
-                                         - region->end_index
-                                           % bitarray_word_capacity)
-                            | MSB;
+        dest_ba->end_mask = dest_ba->end_bits;
+    }
+    if (dest_ba->size == 1 && !(src_array[internal_start_index] & MSB)) {
+        // Region within a single fill, both masks hold its exact length
+        dest_ba->start_mask = region->end_index / bitarray_word_capacity
+                              - region->start_index / bitarray_word_capacity;
+        dest_ba->end_mask = dest_ba->start_mask;
     }
 }
 
@@ -754,12 +2659,19 @@ void bitarray_extract_bins(struct bitarray *dest_bas,
                            size_t nbins,
                            const struct bitarray_interval *bins)
 {
-    size_t index = 0;
-    size_t ncompressed = 0;
+    if (!nbins) return;
+    size_t index;
+    size_t ncompressed;
+    skip_to_word(src_ba, bins[0].start_index / bitarray_word_capacity,
+                 &index, &ncompressed);
     for (size_t i = 0; i < nbins; ++i) {
         extract_region(&dest_bas[i], src_ba->array, &bins[i],
                        &index, &ncompressed);
     }
+    if (bins[0].start_index < bitarray_word_capacity) {
+        // The first bin starts with the source, so its skip index still holds
+        dest_bas[0].skip_index = src_ba->skip_index;
+    }
 }
 
 /**
@@ -767,8 +2679,9 @@ void bitarray_extract_bins(struct bitarray *dest_bas,
  *
  * If an extracted region starts/ends on a literal word, the start/end mask is
  * a normal mask on that word.
- * If an extracted region starts/ends on a fill woed, the start/end mask is the
- * number of words in that fill included in the region minus one.
+ * If an extracted region starts/ends on a fill word, the start/end mask is the
+ * number of words in that fill included in the region minus one, while the
+ * start/end bits mask the first/last word of the region in either case.
  * e.g. with a 64-bit word, if the first word is a zero-fill of ten words
  * (i.e. 630 consecutive 0 bits) and the region includes all 630, the start_mask
  * will be 9 (10 - 1).
@@ -780,12 +2693,8 @@ void bitarray_extract_region(struct bitarray *dest_ba,
     bitarray_extract_bins(dest_ba, src_ba, 1, region);
 }
 
-/*
- * TODO: make src_array const and bit array contents immutable (const struct
- * elements).
- */
 struct bitarray_bin_iterator {
-    bitarray_word *src_array;
+    const bitarray_word *src_array;
     size_t nbins;
     const struct bitarray_interval *bins;
     size_t index;
@@ -800,6 +2709,10 @@ ba_bin_it *init_bitarray_bin_iterator(const struct bitarray *src_ba,
     it->src_array = src_ba->array;
     it->nbins = nbins;
     it->bins = bins;
+    if (nbins) {
+        skip_to_word(src_ba, bins[0].start_index / bitarray_word_capacity,
+                     &it->index, &it->ncompressed);
+    }
     return it;
 }
 
@@ -823,3 +2736,59 @@ void free_bitarray_bin_iterator(ba_bin_it *it)
 {
     free(it);
 }
+
+/**
+ * Pool of bit arrays used to hold intermediate results. Bit arrays returned to
+ * the pool keep their storage, so that later results can reuse it.
+ */
+struct bitarray_pool {
+    size_t nfree;
+    size_t capacity;
+    struct bitarray **free;
+    pthread_mutex_t lock; // The pool can be shared between threads
+};
+
+struct bitarray_pool *init_bitarray_pool(void)
+{
+    struct bitarray_pool *pool = malloc(sizeof *pool);
+    *pool = (struct bitarray_pool) { 0 };
+    pthread_mutex_init(&pool->lock, NULL);
+    return pool;
+}
+
+/**
+ * Takes a bit array from the pool, allocating a new one (without storage) if
+ * the pool is empty. It should either be returned to the pool or freed with
+ * free_bitarray.
+ */
+struct bitarray *bitarray_pool_get(struct bitarray_pool *pool)
+{
+    struct bitarray *ba = NULL;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->nfree) {
+        ba = pool->free[--pool->nfree];
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return ba != NULL ? ba : init_output();
+}
+
+void bitarray_pool_put(struct bitarray_pool *pool, struct bitarray *ba)
+{
+    pthread_mutex_lock(&pool->lock);
+    if (pool->nfree == pool->capacity) {
+        pool->capacity = pool->capacity ? 2 * pool->capacity : 4;
+        pool->free = realloc(pool->free, pool->capacity * sizeof *pool->free);
+    }
+    pool->free[pool->nfree++] = ba;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void free_bitarray_pool(struct bitarray_pool *pool)
+{
+    for (size_t i = 0; i < pool->nfree; ++i) {
+        free_bitarray(pool->free[i]);
+    }
+    free(pool->free);
+    pthread_mutex_destroy(&pool->lock);
+    free(pool);
+}
@@ -0,0 +1,559 @@
+/*  bitarray_simd.c
+
+    Copyright (C) 2019 Cranfield University
+
+    Author: Tomasz Kurowski <t.j.kurowski@cranfield.ac.uk>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#include "bitarray_simd.h"
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define X86_SIMD
+#include <immintrin.h>
+#endif
+
+static const bitarray_word WORD_MAX = (bitarray_word)~0;
+static const bitarray_word MSB = (bitarray_word)1
+                                 << (CHAR_BIT * sizeof(bitarray_word) - 1);
+
+/*
+ * Generic (scalar) kernels. These are also used to finish off the words left
+ * over by the vector kernels.
+ */
+
+static size_t and_words_generic(const bitarray_word *a, const bitarray_word *b,
+                                bitarray_word *out, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        bitarray_word res = a[i] & b[i];
+        // Fill word in either input (no MSB), empty or full result
+        if (!(res & MSB) || res == MSB || res == WORD_MAX) break;
+        out[i] = res;
+    }
+    return i;
+}
+
+static size_t or_words_generic(const bitarray_word *a, const bitarray_word *b,
+                               bitarray_word *out, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        if (!(a[i] & b[i] & MSB)) break;
+        bitarray_word res = a[i] | b[i];
+        if (res == WORD_MAX) break;
+        out[i] = res;
+    }
+    return i;
+}
+
+static size_t andnot_words_generic(const bitarray_word *a,
+                                   const bitarray_word *b,
+                                   bitarray_word *out, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        if (!(a[i] & b[i] & MSB)) break;
+        bitarray_word res = a[i] & ~b[i];
+        if (!res || res == ~MSB) break;
+        out[i] = res | MSB;
+    }
+    return i;
+}
+
+static size_t xor_words_generic(const bitarray_word *a, const bitarray_word *b,
+                                bitarray_word *out, size_t n)
+{
+    size_t i;
+    for (i = 0; i < n; ++i) {
+        if (!(a[i] & b[i] & MSB)) break;
+        bitarray_word res = a[i] ^ b[i];
+        if (!res || res == ~MSB) break;
+        out[i] = res | MSB;
+    }
+    return i;
+}
+
+/* Operations supported by the population count kernels */
+#define OP_AND      0
+#define OP_OR       1
+#define OP_ANDNOT   2
+#define OP_XOR      3
+
+static inline bitarray_word combine_generic(int op, bitarray_word a,
+                                            bitarray_word b)
+{
+    switch (op) {
+    case OP_AND:
+        return a & b;
+    case OP_OR:
+        return a | b;
+    case OP_ANDNOT:
+        return a & ~b;
+    default:
+        return a ^ b;
+    }
+}
+
+static inline size_t popcount_generic(int op, const bitarray_word *a,
+                                      const bitarray_word *b,
+                                      size_t n, uint64_t *count)
+{
+    size_t i;
+    uint64_t total = 0;
+    for (i = 0; i < n; ++i) {
+        if (!(a[i] & b[i] & MSB)) break;
+        total += __builtin_popcountll(combine_generic(op, a[i], b[i]) & ~MSB);
+    }
+    *count += total;
+    return i;
+}
+
+static size_t and_popcount_generic(const bitarray_word *a,
+                                   const bitarray_word *b,
+                                   size_t n, uint64_t *count)
+{
+    return popcount_generic(OP_AND, a, b, n, count);
+}
+
+static size_t or_popcount_generic(const bitarray_word *a,
+                                  const bitarray_word *b,
+                                  size_t n, uint64_t *count)
+{
+    return popcount_generic(OP_OR, a, b, n, count);
+}
+
+static size_t andnot_popcount_generic(const bitarray_word *a,
+                                      const bitarray_word *b,
+                                      size_t n, uint64_t *count)
+{
+    return popcount_generic(OP_ANDNOT, a, b, n, count);
+}
+
+static size_t xor_popcount_generic(const bitarray_word *a,
+                                   const bitarray_word *b,
+                                   size_t n, uint64_t *count)
+{
+    return popcount_generic(OP_XOR, a, b, n, count);
+}
+
+#ifdef X86_SIMD
+
+/*
+ * AVX2 kernels, processing four words per iteration.
+ */
+
+/* True if all four words in both inputs are literal (MSB set) */
+__attribute__((target("avx2")))
+static inline int all_literal_avx2(__m256i va, __m256i vb)
+{
+    return _mm256_movemask_pd(_mm256_castsi256_pd(_mm256_and_si256(va, vb)))
+           == 0xF;
+}
+
+__attribute__((target("avx2")))
+static size_t and_words_avx2(const bitarray_word *a, const bitarray_word *b,
+                             bitarray_word *out, size_t n)
+{
+    const __m256i msb = _mm256_set1_epi64x((long long)MSB);
+    const __m256i ones = _mm256_set1_epi64x(-1);
+    size_t i;
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)&a[i]);
+        __m256i vb = _mm256_loadu_si256((const __m256i *)&b[i]);
+        __m256i res = _mm256_and_si256(va, vb);
+        __m256i stop = _mm256_or_si256(_mm256_cmpeq_epi64(res, msb),
+                                       _mm256_cmpeq_epi64(res, ones));
+        if (!all_literal_avx2(va, vb) || !_mm256_testz_si256(stop, stop)) {
+            break;
+        }
+        _mm256_storeu_si256((__m256i *)&out[i], res);
+    }
+    return i + and_words_generic(&a[i], &b[i], &out[i], n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t or_words_avx2(const bitarray_word *a, const bitarray_word *b,
+                            bitarray_word *out, size_t n)
+{
+    const __m256i ones = _mm256_set1_epi64x(-1);
+    size_t i;
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)&a[i]);
+        __m256i vb = _mm256_loadu_si256((const __m256i *)&b[i]);
+        __m256i res = _mm256_or_si256(va, vb);
+        __m256i full = _mm256_cmpeq_epi64(res, ones);
+        if (!all_literal_avx2(va, vb) || !_mm256_testz_si256(full, full)) {
+            break;
+        }
+        _mm256_storeu_si256((__m256i *)&out[i], res);
+    }
+    return i + or_words_generic(&a[i], &b[i], &out[i], n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t andnot_words_avx2(const bitarray_word *a, const bitarray_word *b,
+                                bitarray_word *out, size_t n)
+{
+    const __m256i msb = _mm256_set1_epi64x((long long)MSB);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i full_res = _mm256_set1_epi64x((long long)~MSB);
+    size_t i;
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)&a[i]);
+        __m256i vb = _mm256_loadu_si256((const __m256i *)&b[i]);
+        // MSB is cleared in the result since it is set in b
+        __m256i res = _mm256_andnot_si256(vb, va);
+        __m256i stop = _mm256_or_si256(_mm256_cmpeq_epi64(res, zero),
+                                       _mm256_cmpeq_epi64(res, full_res));
+        if (!all_literal_avx2(va, vb) || !_mm256_testz_si256(stop, stop)) {
+            break;
+        }
+        _mm256_storeu_si256((__m256i *)&out[i], _mm256_or_si256(res, msb));
+    }
+    return i + andnot_words_generic(&a[i], &b[i], &out[i], n - i);
+}
+
+__attribute__((target("avx2")))
+static size_t xor_words_avx2(const bitarray_word *a, const bitarray_word *b,
+                             bitarray_word *out, size_t n)
+{
+    const __m256i msb = _mm256_set1_epi64x((long long)MSB);
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i full_res = _mm256_set1_epi64x((long long)~MSB);
+    size_t i;
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)&a[i]);
+        __m256i vb = _mm256_loadu_si256((const __m256i *)&b[i]);
+        __m256i res = _mm256_xor_si256(va, vb);
+        __m256i stop = _mm256_or_si256(_mm256_cmpeq_epi64(res, zero),
+                                       _mm256_cmpeq_epi64(res, full_res));
+        if (!all_literal_avx2(va, vb) || !_mm256_testz_si256(stop, stop)) {
+            break;
+        }
+        _mm256_storeu_si256((__m256i *)&out[i], _mm256_or_si256(res, msb));
+    }
+    return i + xor_words_generic(&a[i], &b[i], &out[i], n - i);
+}
+
+/**
+ * Per-word population count using a nibble lookup table (AVX2 has no native
+ * 64-bit popcount). Returns the four word counts.
+ */
+__attribute__((target("avx2")))
+static inline __m256i word_popcount_avx2(__m256i v)
+{
+    const __m256i lookup = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3,
+                                            1, 2, 2, 3, 2, 3, 3, 4,
+                                            0, 1, 1, 2, 1, 2, 2, 3,
+                                            1, 2, 2, 3, 2, 3, 3, 4);
+    const __m256i low_mask = _mm256_set1_epi8(0x0f);
+    __m256i lo = _mm256_and_si256(v, low_mask);
+    __m256i hi = _mm256_and_si256(_mm256_srli_epi32(v, 4), low_mask);
+    __m256i counts = _mm256_add_epi8(_mm256_shuffle_epi8(lookup, lo),
+                                     _mm256_shuffle_epi8(lookup, hi));
+    return _mm256_sad_epu8(counts, _mm256_setzero_si256());
+}
+
+__attribute__((target("avx2")))
+static inline __m256i combine_avx2(int op, __m256i va, __m256i vb)
+{
+    switch (op) {
+    case OP_AND:
+        return _mm256_and_si256(va, vb);
+    case OP_OR:
+        return _mm256_or_si256(va, vb);
+    case OP_ANDNOT:
+        return _mm256_andnot_si256(vb, va);
+    default:
+        return _mm256_xor_si256(va, vb);
+    }
+}
+
+__attribute__((target("avx2")))
+static inline size_t popcount_avx2(int op, const bitarray_word *a,
+                                   const bitarray_word *b,
+                                   size_t n, uint64_t *count)
+{
+    const __m256i msb = _mm256_set1_epi64x((long long)MSB);
+    __m256i acc = _mm256_setzero_si256();
+    size_t i;
+    for (i = 0; i + 4 <= n; i += 4) {
+        __m256i va = _mm256_loadu_si256((const __m256i *)&a[i]);
+        __m256i vb = _mm256_loadu_si256((const __m256i *)&b[i]);
+        if (!all_literal_avx2(va, vb)) break;
+        __m256i res = _mm256_andnot_si256(msb, combine_avx2(op, va, vb));
+        acc = _mm256_add_epi64(acc, word_popcount_avx2(res));
+    }
+    uint64_t lanes[4];
+    _mm256_storeu_si256((__m256i *)lanes, acc);
+    *count += lanes[0] + lanes[1] + lanes[2] + lanes[3];
+    return i + popcount_generic(op, &a[i], &b[i], n - i, count);
+}
+
+__attribute__((target("avx2")))
+static size_t and_popcount_avx2(const bitarray_word *a, const bitarray_word *b,
+                                size_t n, uint64_t *count)
+{
+    return popcount_avx2(OP_AND, a, b, n, count);
+}
+
+__attribute__((target("avx2")))
+static size_t or_popcount_avx2(const bitarray_word *a, const bitarray_word *b,
+                               size_t n, uint64_t *count)
+{
+    return popcount_avx2(OP_OR, a, b, n, count);
+}
+
+__attribute__((target("avx2")))
+static size_t andnot_popcount_avx2(const bitarray_word *a,
+                                   const bitarray_word *b,
+                                   size_t n, uint64_t *count)
+{
+    return popcount_avx2(OP_ANDNOT, a, b, n, count);
+}
+
+__attribute__((target("avx2")))
+static size_t xor_popcount_avx2(const bitarray_word *a, const bitarray_word *b,
+                                size_t n, uint64_t *count)
+{
+    return popcount_avx2(OP_XOR, a, b, n, count);
+}
+
+/*
+ * AVX-512 kernels, processing eight words per iteration.
+ */
+
+__attribute__((target("avx512f")))
+static inline int all_literal_avx512(__m512i va, __m512i vb, __m512i msb)
+{
+    return _mm512_test_epi64_mask(_mm512_and_si512(va, vb), msb) == 0xFF;
+}
+
+__attribute__((target("avx512f")))
+static size_t and_words_avx512(const bitarray_word *a, const bitarray_word *b,
+                               bitarray_word *out, size_t n)
+{
+    const __m512i msb = _mm512_set1_epi64((long long)MSB);
+    const __m512i ones = _mm512_set1_epi64(-1);
+    size_t i;
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m512i va = _mm512_loadu_si512(&a[i]);
+        __m512i vb = _mm512_loadu_si512(&b[i]);
+        __m512i res = _mm512_and_si512(va, vb);
+        if (!all_literal_avx512(va, vb, msb)
+            || _mm512_cmpeq_epi64_mask(res, msb)
+            || _mm512_cmpeq_epi64_mask(res, ones)) {
+            break;
+        }
+        _mm512_storeu_si512(&out[i], res);
+    }
+    return i + and_words_generic(&a[i], &b[i], &out[i], n - i);
+}
+
+__attribute__((target("avx512f")))
+static size_t or_words_avx512(const bitarray_word *a, const bitarray_word *b,
+                              bitarray_word *out, size_t n)
+{
+    const __m512i msb = _mm512_set1_epi64((long long)MSB);
+    const __m512i ones = _mm512_set1_epi64(-1);
+    size_t i;
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m512i va = _mm512_loadu_si512(&a[i]);
+        __m512i vb = _mm512_loadu_si512(&b[i]);
+        __m512i res = _mm512_or_si512(va, vb);
+        if (!all_literal_avx512(va, vb, msb)
+            || _mm512_cmpeq_epi64_mask(res, ones)) {
+            break;
+        }
+        _mm512_storeu_si512(&out[i], res);
+    }
+    return i + or_words_generic(&a[i], &b[i], &out[i], n - i);
+}
+
+__attribute__((target("avx512f")))
+static size_t andnot_words_avx512(const bitarray_word *a,
+                                  const bitarray_word *b,
+                                  bitarray_word *out, size_t n)
+{
+    const __m512i msb = _mm512_set1_epi64((long long)MSB);
+    const __m512i full_res = _mm512_set1_epi64((long long)~MSB);
+    size_t i;
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m512i va = _mm512_loadu_si512(&a[i]);
+        __m512i vb = _mm512_loadu_si512(&b[i]);
+        __m512i res = _mm512_andnot_si512(vb, va);
+        if (!all_literal_avx512(va, vb, msb)
+            || _mm512_cmpeq_epi64_mask(res, _mm512_setzero_si512())
+            || _mm512_cmpeq_epi64_mask(res, full_res)) {
+            break;
+        }
+        _mm512_storeu_si512(&out[i], _mm512_or_si512(res, msb));
+    }
+    return i + andnot_words_generic(&a[i], &b[i], &out[i], n - i);
+}
+
+__attribute__((target("avx512f")))
+static size_t xor_words_avx512(const bitarray_word *a, const bitarray_word *b,
+                               bitarray_word *out, size_t n)
+{
+    const __m512i msb = _mm512_set1_epi64((long long)MSB);
+    const __m512i full_res = _mm512_set1_epi64((long long)~MSB);
+    size_t i;
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m512i va = _mm512_loadu_si512(&a[i]);
+        __m512i vb = _mm512_loadu_si512(&b[i]);
+        __m512i res = _mm512_xor_si512(va, vb);
+        if (!all_literal_avx512(va, vb, msb)
+            || _mm512_cmpeq_epi64_mask(res, _mm512_setzero_si512())
+            || _mm512_cmpeq_epi64_mask(res, full_res)) {
+            break;
+        }
+        _mm512_storeu_si512(&out[i], _mm512_or_si512(res, msb));
+    }
+    return i + xor_words_generic(&a[i], &b[i], &out[i], n - i);
+}
+
+__attribute__((target("avx512f")))
+static inline __m512i combine_avx512(int op, __m512i va, __m512i vb)
+{
+    switch (op) {
+    case OP_AND:
+        return _mm512_and_si512(va, vb);
+    case OP_OR:
+        return _mm512_or_si512(va, vb);
+    case OP_ANDNOT:
+        return _mm512_andnot_si512(vb, va);
+    default:
+        return _mm512_xor_si512(va, vb);
+    }
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static inline size_t popcount_avx512(int op, const bitarray_word *a,
+                                     const bitarray_word *b,
+                                     size_t n, uint64_t *count)
+{
+    const __m512i msb = _mm512_set1_epi64((long long)MSB);
+    __m512i acc = _mm512_setzero_si512();
+    size_t i;
+    for (i = 0; i + 8 <= n; i += 8) {
+        __m512i va = _mm512_loadu_si512(&a[i]);
+        __m512i vb = _mm512_loadu_si512(&b[i]);
+        if (!all_literal_avx512(va, vb, msb)) break;
+        __m512i res = _mm512_andnot_si512(msb, combine_avx512(op, va, vb));
+        acc = _mm512_add_epi64(acc, _mm512_popcnt_epi64(res));
+    }
+    *count += _mm512_reduce_add_epi64(acc);
+    return i + popcount_generic(op, &a[i], &b[i], n - i, count);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static size_t and_popcount_avx512(const bitarray_word *a,
+                                  const bitarray_word *b,
+                                  size_t n, uint64_t *count)
+{
+    return popcount_avx512(OP_AND, a, b, n, count);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static size_t or_popcount_avx512(const bitarray_word *a,
+                                 const bitarray_word *b,
+                                 size_t n, uint64_t *count)
+{
+    return popcount_avx512(OP_OR, a, b, n, count);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static size_t andnot_popcount_avx512(const bitarray_word *a,
+                                     const bitarray_word *b,
+                                     size_t n, uint64_t *count)
+{
+    return popcount_avx512(OP_ANDNOT, a, b, n, count);
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq")))
+static size_t xor_popcount_avx512(const bitarray_word *a,
+                                  const bitarray_word *b,
+                                  size_t n, uint64_t *count)
+{
+    return popcount_avx512(OP_XOR, a, b, n, count);
+}
+
+#endif
+
+struct literal_kernels literal_kernels = {
+    .name = "generic",
+    .and_words = and_words_generic,
+    .or_words = or_words_generic,
+    .andnot_words = andnot_words_generic,
+    .xor_words = xor_words_generic,
+    .and_popcount = and_popcount_generic,
+    .or_popcount = or_popcount_generic,
+    .andnot_popcount = andnot_popcount_generic,
+    .xor_popcount = xor_popcount_generic
+};
+
+/**
+ * Selects the widest kernels supported by the CPU. The TERSECT_SIMD environment
+ * variable ("generic", "avx2" or "avx512") can be used to cap the selection,
+ * e.g. for benchmarking or testing the fallback paths.
+ */
+__attribute__((constructor))
+static void select_literal_kernels(void)
+{
+#ifdef X86_SIMD
+    const char *limit = getenv("TERSECT_SIMD");
+    bool allow_avx2 = limit == NULL || strcmp(limit, "generic");
+    bool allow_avx512 = allow_avx2 && (limit == NULL || strcmp(limit, "avx2"));
+    __builtin_cpu_init();
+    if (allow_avx2 && __builtin_cpu_supports("avx2")) {
+        literal_kernels = (struct literal_kernels) {
+            .name = "avx2",
+            .and_words = and_words_avx2,
+            .or_words = or_words_avx2,
+            .andnot_words = andnot_words_avx2,
+            .xor_words = xor_words_avx2,
+            .and_popcount = and_popcount_avx2,
+            .or_popcount = or_popcount_avx2,
+            .andnot_popcount = andnot_popcount_avx2,
+            .xor_popcount = xor_popcount_avx2
+        };
+    }
+    if (allow_avx512 && __builtin_cpu_supports("avx512f")) {
+        literal_kernels.name = "avx512";
+        literal_kernels.and_words = and_words_avx512;
+        literal_kernels.or_words = or_words_avx512;
+        literal_kernels.andnot_words = andnot_words_avx512;
+        literal_kernels.xor_words = xor_words_avx512;
+        if (__builtin_cpu_supports("avx512vpopcntdq")) {
+            literal_kernels.and_popcount = and_popcount_avx512;
+            literal_kernels.or_popcount = or_popcount_avx512;
+            literal_kernels.andnot_popcount = andnot_popcount_avx512;
+            literal_kernels.xor_popcount = xor_popcount_avx512;
+        }
+    }
+#endif
+}
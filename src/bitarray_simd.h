@@ -0,0 +1,67 @@
+/*  bitarray_simd.h
+
+    Copyright (C) 2019 Cranfield University
+
+    Author: Tomasz Kurowski <t.j.kurowski@cranfield.ac.uk>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#ifndef BITARRAY_SIMD_H
+#define BITARRAY_SIMD_H
+
+#include "bitarray.h"
+
+#include <stddef.h>
+
+/**
+ * Kernels for runs of literal words shared by two bit arrays.
+ *
+ * Each kernel starts at the beginning of a run and processes words for as long
+ * as both inputs hold literal words (and, for the kernels building a result,
+ * for as long as the result is neither empty nor full, since such words are
+ * stored as fills). It returns the number of words processed, leaving the
+ * first word it could not handle to the general code in bitarray.c.
+ *
+ * The implementation is selected at start-up based on the instruction sets
+ * supported by the CPU, so that generic builds also make use of AVX2/AVX-512.
+ */
+struct literal_kernels {
+    const char *name;
+    size_t (*and_words)(const bitarray_word *a, const bitarray_word *b,
+                        bitarray_word *out, size_t n);
+    size_t (*or_words)(const bitarray_word *a, const bitarray_word *b,
+                       bitarray_word *out, size_t n);
+    size_t (*andnot_words)(const bitarray_word *a, const bitarray_word *b,
+                           bitarray_word *out, size_t n);
+    size_t (*xor_words)(const bitarray_word *a, const bitarray_word *b,
+                        bitarray_word *out, size_t n);
+    /* Add the number of bits set in the result (excluding MSB) to *count */
+    size_t (*and_popcount)(const bitarray_word *a, const bitarray_word *b,
+                           size_t n, uint64_t *count);
+    size_t (*or_popcount)(const bitarray_word *a, const bitarray_word *b,
+                          size_t n, uint64_t *count);
+    size_t (*andnot_popcount)(const bitarray_word *a, const bitarray_word *b,
+                              size_t n, uint64_t *count);
+    size_t (*xor_popcount)(const bitarray_word *a, const bitarray_word *b,
+                           size_t n, uint64_t *count);
+};
+
+extern struct literal_kernels literal_kernels;
+
+#endif
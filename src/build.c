@@ -51,19 +51,23 @@ SOFTWARE. */
 #define SAMPLES_PER_FILE 10000
 
 /**
- * Initial size of allele bitarray.
+ * Expected number of alleles per chromosome, used to size the storage of new
+ * allele bit arrays.
  */
 #define INITIAL_ALLELE_NUM 10000
 
 static int tdb_flags = 0;
 static int parser_flags = 0;
+static int bitarray_encoding = TDB_ENCODING_WAH;
 
 /**
- * Wrapper for a parser and an associated bit array to record variants present
- * in a specific genome file.
+ * Wrapper for a parser and the associated bit array builders to record variants
+ * present in a specific genome file, one per sample. The finished bit arrays of
+ * the current chromosome are held until they are added to the database.
  */
 struct parser_wrapper {
     VCF_PARSER parser;
+    struct bitarray_builder *builders;
     struct bitarray **ba;
 };
 
@@ -73,6 +77,8 @@ static void usage(FILE *stream)
             "\n"
             "Usage:    tersect build [options] <out.tsi> <in1.vcf>...\n\n"
             "Options:\n"
+            "    -e, --encoding          use wah (default), roaring, or auto\n"
+            "                            (smaller per bit array) encoding\n"
             "    -f, --force             overwrite database file if necessary\n"
             "    -H, --homozygous        include only homozygous variants\n"
             "    -h, --help              print this help message\n"
@@ -110,6 +116,7 @@ error_t tersect_build_database(int argc, char **argv)
     char *db_filename = NULL;
     char *name_filename = NULL;
     static struct option loptions[] = {
+        {"encoding", required_argument, NULL, 'e'},
         {"force", no_argument, NULL, 'f'},
         {"help", no_argument, NULL, 'h'},
         {"homozygous", no_argument, NULL, 'H'},
@@ -119,8 +126,20 @@ error_t tersect_build_database(int argc, char **argv)
         {NULL, 0, NULL, 0}
     };
     int c;
-    while ((c = getopt_long(argc, argv, ":fHhn:t:v", loptions, NULL)) != -1) {
+    while ((c = getopt_long(argc, argv, ":e:fHhn:t:v", loptions, NULL)) != -1) {
         switch(c) {
+        case 'e':
+            if (!strcmp(optarg, "wah")) {
+                bitarray_encoding = TDB_ENCODING_WAH;
+            } else if (!strcmp(optarg, "roaring")) {
+                bitarray_encoding = TDB_ENCODING_ROARING;
+            } else if (!strcmp(optarg, "auto")) {
+                bitarray_encoding = TDB_ENCODING_AUTO;
+            } else {
+                usage(stderr);
+                return SUCCESS;
+            }
+            break;
         case 'f':
             tdb_flags |= TDB_FORCE;
             break;
@@ -233,6 +252,8 @@ static error_t import_files(tersect_db *tdb,
             goto cleanup_3;
 
         }
+        parsers[i].builders = malloc(parsers[i].parser.sample_num
+                                     * sizeof *parsers[i].builders);
         parsers[i].ba = malloc(parsers[i].parser.sample_num
                                * sizeof *parsers[i].ba);
         for (size_t j = 0; j < parsers[i].parser.sample_num; ++j) {
@@ -244,7 +265,8 @@ static error_t import_files(tersect_db *tdb,
                 hashmap_insert(sample_names, parsers[i].parser.samples[j],
                                parsers[i].parser.samples[j]);
             }
-            parsers[i].ba[j] = init_bitarray(INITIAL_ALLELE_NUM);
+            init_bitarray_builder(&parsers[i].builders[j],
+                                  INITIAL_ALLELE_NUM);
             tersect_db_add_genome(tdb, parsers[i].parser.samples[j]);
         }
         goto_next_chromosome(&parsers[i].parser);
@@ -264,29 +286,30 @@ static error_t import_files(tersect_db *tdb,
         tersect_db_add_chromosome(tdb, current_chromosome,
                                   var_container, var_count,
                                   var_container[var_count - 1].position);
-        // The bit arrays stored in parsers are larger and get re-used for each
-        // chromosome. The interval is used to extract chromosome-specific
-        // bit arrays.
-        struct bitarray_interval chr_interval = {
-            .start_index = 0,
-            .end_index = var_count - 1
-        };
+        // Genomes with few variants may not cover the whole chromosome, the
+        // builders complete their bit arrays up to the variant count.
+        for (int i = 0; i < file_num; ++i) {
+            for (size_t j = 0; j < parsers[i].parser.sample_num; ++j) {
+                parsers[i].ba[j] = bitarray_builder_finish(
+                    &parsers[i].builders[j], var_count);
+            }
+        }
         for (int i = 0; i < file_num; ++i) {
             for (size_t j = 0; j < parsers[i].parser.sample_num; ++j) {
-                struct bitarray ba;
-                bitarray_extract_region(&ba, parsers[i].ba[j], &chr_interval);
                 tersect_db_add_bitarray(tdb, parsers[i].parser.samples[j],
-                                        current_chromosome, &ba);
-                clear_bitarray(parsers[i].ba[j]);
+                                        current_chromosome, parsers[i].ba[j],
+                                        bitarray_encoding);
+                free_bitarray(parsers[i].ba[j]);
             }
         }
     }
     // Close parsers
     for (int i = 0; i < file_num; ++i) {
         for (size_t j = 0; j < parsers[i].parser.sample_num; ++j) {
-            free_bitarray(parsers[i].ba[j]);
+            free_bitarray_builder(&parsers[i].builders[j]);
         }
         close_parser(&parsers[i].parser);
+        free(parsers[i].builders);
         free(parsers[i].ba);
     }
     free_heap(queue);
@@ -313,6 +336,22 @@ static inline int load_chromosome_queue(const char *chromosome,
     return queue->size;
 }
 
+/**
+ * Sets the bit of the variant at the specified index in the bit arrays of the
+ * samples carrying it according to the current genotypes of a parser.
+ */
+static inline void record_genotypes(struct parser_wrapper *pwr, uint64_t index)
+{
+    for (size_t i = 0; i < pwr->parser.sample_num; ++i) {
+        if (parser_flags & VCF_ONLY_HOMOZYGOUS) {
+            if (pwr->parser.genotypes[i] != GENOTYPE_HOM_ALT) continue;
+        }
+        if (pwr->parser.genotypes[i] != GENOTYPE_HOM_REF) {
+            bitarray_builder_add(&pwr->builders[i], 1, &index);
+        }
+    }
+}
+
 static inline uint32_t process_chromosome_queue(tersect_db *tdb, Heap *queue,
                                                 struct variant *var_container)
 {
@@ -336,28 +375,12 @@ static inline uint32_t process_chromosome_queue(tersect_db *tdb, Heap *queue,
                 previous_allele.position = pwr->parser.current_allele.position;
                 strcpy(previous_allele.ref, pwr->parser.current_allele.ref);
                 strcpy(previous_allele.alt, pwr->parser.current_allele.alt);
-                for (size_t i = 0; i < pwr->parser.sample_num; ++i) {
-                    if (parser_flags & VCF_ONLY_HOMOZYGOUS) {
-                        if (pwr->parser.genotypes[i] != GENOTYPE_HOM_ALT) {
-                            continue;
-                        }
-                    }
-                    if (pwr->parser.genotypes[i] != GENOTYPE_HOM_REF) {
-                        bitarray_set_bit(pwr->ba[i], var_count);
-                    }
-                }
+                record_genotypes(pwr, var_count);
                 var_count++;
             }
         } else {
             // The same allele as previously
-            for (size_t i = 0; i < pwr->parser.sample_num; ++i) {
-                if (parser_flags & VCF_ONLY_HOMOZYGOUS) {
-                    if (pwr->parser.genotypes[i] != GENOTYPE_HOM_ALT) continue;
-                }
-                if (pwr->parser.genotypes[i] != GENOTYPE_HOM_REF) {
-                    bitarray_set_bit(pwr->ba[i], var_count - 1);
-                }
-            }
+            record_genotypes(pwr, var_count - 1);
         }
         if ((fetch_next_allele(&pwr->parser) == ALLELE_NOT_FETCHED)
             || strcmp(chromosome, pwr->parser.current_chromosome)) {
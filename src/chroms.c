@@ -34,6 +34,9 @@ SOFTWARE. */
 #define NO_HEADERS      2
 static int local_flags = 0;
 
+/* Argument options without a short equivalent */
+#define MMAP_HINTS      1000
+
 static void usage(FILE *stream)
 {
     fprintf(stream,
@@ -41,6 +44,8 @@ static void usage(FILE *stream)
             "Usage:    tersect chroms [options] <db.tsi>\n\n"
             "Options:\n"
             "    -h, --help              print this help message\n"
+            "    --mmap-hints STR        comma-separated database access hints (sequential,\n"
+            "                            random, willneed, populate, hugepages)\n"
             "    -n, --no-headers        skip column headers\n"
             "\n");
 }
@@ -48,8 +53,10 @@ static void usage(FILE *stream)
 error_t tersect_print_chromosomes(int argc, char **argv)
 {
     char *db_filename = NULL;
+    int access_hints = TDB_ACCESS_DEFAULT;
     static struct option loptions[] = {
         {"help", no_argument, NULL, 'h'},
+        {"mmap-hints", required_argument, NULL, MMAP_HINTS},
         {"no-headers", no_argument, NULL, 'n'},
         {NULL, 0, NULL, 0}
     };
@@ -59,6 +66,13 @@ error_t tersect_print_chromosomes(int argc, char **argv)
         case 'h':
             usage(stdout);
             return SUCCESS;
+        case MMAP_HINTS:
+            if (tersect_db_parse_access(optarg, &access_hints)
+                != SUCCESS) {
+                usage(stderr);
+                return E_TSI_ACCESS_HINT;
+            }
+            break;
         case 'n':
             local_flags |= NO_HEADERS;
             break;
@@ -79,7 +93,7 @@ error_t tersect_print_chromosomes(int argc, char **argv)
         return SUCCESS;
     }
     db_filename = argv[0];
-    tersect_db *tdb = tersect_db_open(db_filename);
+    tersect_db *tdb = tersect_db_open_readonly(db_filename, access_hints);
     if (tdb == NULL) return E_TSI_NOPEN;
     size_t count;
     struct chromosome *chroms;
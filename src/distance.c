@@ -45,6 +45,7 @@ static int local_flags = 0;
 #define A_MATCHLIST_FILE     1002
 #define B_MATCHLIST_FILE     1003
 #define MATCHLIST_FILE       1004
+#define MMAP_HINTS           1005
 
 struct distance_matrix {
     char **row_samples;
@@ -78,6 +79,8 @@ static void usage(FILE *stream)
             "    -h, --help              print this help message\n"
             "    -j, --json              output JSON; implied if match/contains settings for\n"
             "                            set A and set B differ\n"
+            "    --mmap-hints STR        comma-separated database access hints (sequential,\n"
+            "                            random, willneed, populate, hugepages)\n"
             "\n");
 }
 
@@ -236,6 +239,7 @@ static inline void build_distance_matrix(const tersect_db *tdb,
     struct bitarray *col_bas = malloc(ncols * sizeof *col_bas);
 
     for (size_t i = 0; i < nregions; ++i) {
+        if (!intervals[i].nvariants) continue;
         // Extracting region bitarrays for rows and cols
         for (size_t j = 0; j < nrows; ++j) {
             struct bitarray tmp;
@@ -439,6 +443,7 @@ error_t tersect_distance(int argc, char **argv)
     bool binning = false;
     uint32_t bin_size = 0;
     bool symmetric = true;
+    int access_hints = TDB_ACCESS_DEFAULT;
     static struct option loptions[] = {
         {"a-match", required_argument, NULL, 'a'},
         {"b-match", required_argument, NULL, 'b'},
@@ -449,6 +454,7 @@ error_t tersect_distance(int argc, char **argv)
         {"list-file", required_argument, NULL, MATCHLIST_FILE},
         {"contains", required_argument, NULL, 'c'},
         {"match", required_argument, NULL, 'm'},
+        {"mmap-hints", required_argument, NULL, MMAP_HINTS},
         {"help", no_argument, NULL, 'h'},
         {"json", no_argument, NULL, 'j'},
         {"bin-size", required_argument, NULL, 'B'},
@@ -465,7 +471,10 @@ error_t tersect_distance(int argc, char **argv)
             break;
         case 'B':
             binning = true;
-            bin_size = strtol(optarg, NULL, 10);
+            if (tersect_db_parse_bin_size(optarg, &bin_size) != SUCCESS) {
+                usage(stderr);
+                return E_PARSE_BIN_SIZE;
+            }
             local_flags |= JSON_OUTPUT;
             break;
         case A_CONTAINS:
@@ -489,6 +498,13 @@ error_t tersect_distance(int argc, char **argv)
         case 'm':
             match = optarg;
             break;
+        case MMAP_HINTS:
+            if (tersect_db_parse_access(optarg, &access_hints)
+                != SUCCESS) {
+                usage(stderr);
+                return E_TSI_ACCESS_HINT;
+            }
+            break;
         case 'h':
             usage(stdout);
             return SUCCESS;
@@ -522,7 +538,7 @@ error_t tersect_distance(int argc, char **argv)
     }
     // End parsing options
 
-    tersect_db *tdb = tersect_db_open(db_filename);
+    tersect_db *tdb = tersect_db_open_readonly(db_filename, access_hints);
     if (tdb == NULL) return E_TSI_NOPEN;
 
     struct genomic_interval *regions;
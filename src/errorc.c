@@ -33,6 +33,7 @@ struct error_desc error_desc[] = {
     { E_NO_GENOME, "Sample not found"},
     { E_NO_TSI_FILE, "No Tersect index (.tsi) file specified"},
     { E_TSI_NOPEN, "Could not open specified Tersect index (.tsi) file"},
+    { E_TSI_ACCESS_HINT, "Invalid memory access hint list"},
     { E_BUILD_NO_OUTNAME, "Output filename missing"},
     { E_BUILD_NO_FILES, "No input files specified"},
     { E_BUILD_CREATE, "Tersect database file could not be created"},
@@ -42,16 +43,21 @@ struct error_desc error_desc[] = {
     { E_PARSE_REGION, "Region could not be parsed"},
     { E_PARSE_REGION_NO_CHROMOSOME, "Requested chromosome is not in the database"},
     { E_PARSE_REGION_BAD_BOUNDS, "Incorrect region bounds specified"},
+    { E_PARSE_BIN_SIZE, "Bin size must be a positive integer"},
     { E_PARSE_ALLELE, "Allele could not be parsed"},
     { E_PARSE_ALLELE_NO_CHROMOSOME, "Requested chromosome is not in the database"},
     { E_PARSE_ALLELE_BAD_POSITION, "Incorrect position specified"},
     { E_VCF_PARSE_FILE, "Failed to parse VCF/VCF.GZ file"},
     { E_PARSE_ALLELE_UNKNOWN, "Allele not in database"},
+    { E_PARSE_QUERY, "Query could not be parsed"},
     { E_VIEW_NO_QUERY, "No set query specified"},
+    { E_VIEW_BIN_NO_COUNT, "Binning requires --count and a positive bin size"},
+    { E_VIEW_THREADS, "Invalid number of threads or threads could not be started"},
     { E_RENAME_NOPEN, "Coult not open specified name file"},
     { E_RENAME_PARSE, "Name file could not be parsed"},
     { E_DIST_BIN_REGIONS, "Only one region allowed if binning is enabled"},
-    { E_DIST_LIST_NOPEN, "Match string list file could not be opened"}
+    { E_DIST_LIST_NOPEN, "Match string list file could not be opened"},
+    { E_FREQ_NO_GENLIST, "No genome list specified"}
 };
 
 void report_error(error_t code) {
@@ -0,0 +1,344 @@
+/*  explain.c
+
+    Copyright (C) 2019 Cranfield University
+
+    Author: Tomasz Kurowski <t.j.kurowski@cranfield.ac.uk>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#include "explain.h"
+
+#include "bitarray.h"
+
+#include <inttypes.h>
+#include <stdlib.h>
+#include <time.h>
+
+/**
+ * Statistics of the result of a node over a region. Input words are those of
+ * the results of its children (or the genome itself for genome nodes), while
+ * the time is that of evaluating the whole subtree on its own.
+ */
+struct node_stats {
+    uint64_t words_in;
+    uint64_t words_out;
+    uint64_t nfills;
+    uint64_t weight;
+    uint64_t bytes; // Storage allocated for the result
+    double time_ms;
+};
+
+struct node_analysis {
+    const struct ast_node *node;
+    struct node_stats stats;
+    size_t nchildren;
+    struct node_analysis *children;
+};
+
+static double elapsed_ms(const struct timespec *start)
+{
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e3
+           + (end.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+static size_t child_count(const struct ast_node *node)
+{
+    switch (node->type) {
+    case AST_GENOME:
+    case AST_ALL:
+        return 0;
+    case AST_COMPLEMENT:
+        return 1;
+    case AST_NARY:
+        return node->nchildren;
+    default:
+        return 2;
+    }
+}
+
+static struct ast_node *child_at(const struct ast_node *node, size_t i)
+{
+    if (node->type == AST_NARY) {
+        return node->children[i];
+    }
+    return i ? node->r : node->l;
+}
+
+static const char *node_name(const struct ast_node *node)
+{
+    switch (node->type == AST_NARY ? node->operation : node->type) {
+    case AST_INTERSECTION:
+        return "intersection";
+    case AST_UNION:
+        return "union";
+    case AST_DIFFERENCE:
+        return "difference";
+    case AST_SYMMETRIC_DIFFERENCE:
+        return "symmetric_difference";
+    case AST_COMPLEMENT:
+        return "complement";
+    case AST_ATLEAST:
+        return "atleast";
+    case AST_ATMOST:
+        return "atmost";
+    case AST_EXACTLY:
+        return "exactly";
+    case AST_GENOME:
+        return "genome";
+    default:
+        return "all";
+    }
+}
+
+static inline bool is_threshold(const struct ast_node *node)
+{
+    return node->type == AST_NARY && (node->operation == AST_ATLEAST
+                                      || node->operation == AST_ATMOST
+                                      || node->operation == AST_EXACTLY);
+}
+
+static void print_json_string(FILE *stream, const char *str)
+{
+    fputc('"', stream);
+    for (; *str; ++str) {
+        unsigned char c = *str;
+        if (c == '"' || c == '\\') {
+            fprintf(stream, "\\%c", c);
+        } else if (c < 0x20) {
+            fprintf(stream, "\\u%04x", c);
+        } else {
+            fputc(c, stream);
+        }
+    }
+    fputc('"', stream);
+}
+
+/**
+ * Evaluates each node of a query over a region separately, gathering the
+ * statistics of its result.
+ */
+static void analyze_node(struct node_analysis *analysis,
+                         struct ast_node *node, const tersect_db *tdb,
+                         const struct tersect_db_interval *ti)
+{
+    *analysis = (struct node_analysis) {
+        .node = node,
+        .nchildren = child_count(node)
+    };
+    analysis->children = malloc(analysis->nchildren
+                                * sizeof *analysis->children);
+    for (size_t i = 0; i < analysis->nchildren; ++i) {
+        analyze_node(&analysis->children[i], child_at(node, i), tdb, ti);
+        analysis->stats.words_in += analysis->children[i].stats.words_out;
+    }
+    if (!ti->nvariants) return; // Nothing to evaluate in an empty region
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    struct bitarray *result = eval_ast(node, tdb, ti);
+    analysis->stats.time_ms = elapsed_ms(&start);
+    analysis->stats.words_out = result->size;
+    analysis->stats.nfills = bitarray_fill_count(result);
+    analysis->stats.weight = bitarray_weight(result);
+    if (node->type == AST_GENOME) {
+        // Genomes are used in place, the result being a copy
+        analysis->stats.words_in = result->size;
+    } else {
+        analysis->stats.bytes = result->capacity * sizeof *result->array;
+    }
+    release_ast_result(node, result);
+}
+
+static void free_node_analysis(struct node_analysis *analysis)
+{
+    for (size_t i = 0; i < analysis->nchildren; ++i) {
+        free_node_analysis(&analysis->children[i]);
+    }
+    free(analysis->children);
+}
+
+static void print_stats_text(FILE *stream, const struct node_stats *stats)
+{
+    double fills = stats->words_out ? 100.0 * stats->nfills / stats->words_out
+                                    : 0.0;
+    fprintf(stream, " in=%"PRIu64" out=%"PRIu64" fills=%.1f%% literals=%.1f%%"
+            " weight=%"PRIu64" bytes=%"PRIu64" time=%.3fms",
+            stats->words_in, stats->words_out, fills,
+            stats->words_out ? 100.0 - fills : 0.0, stats->weight,
+            stats->bytes, stats->time_ms);
+}
+
+static void print_stats_json(FILE *stream, const struct node_stats *stats)
+{
+    double fills = stats->words_out ? (double)stats->nfills / stats->words_out
+                                    : 0.0;
+    fprintf(stream, ",\"words_in\":%"PRIu64",\"words_out\":%"PRIu64
+            ",\"fill_ratio\":%.4f,\"literal_ratio\":%.4f,\"weight\":%"PRIu64
+            ",\"bytes\":%"PRIu64",\"time_ms\":%.3f",
+            stats->words_in, stats->words_out, fills,
+            stats->words_out ? 1.0 - fills : 0.0, stats->weight,
+            stats->bytes, stats->time_ms);
+}
+
+/**
+ * Prints a node and its children, along with their statistics if analysed or
+ * the statistics of the genomes recorded in the database otherwise.
+ */
+static void print_node(FILE *stream, const struct ast_node *node,
+                       const struct node_analysis *analysis,
+                       const tersect_db *tdb, size_t depth, bool json)
+{
+    if (json) {
+        fprintf(stream, "{\"type\":\"%s\"", node_name(node));
+    } else {
+        fprintf(stream, "%*s%s", (int)(2 * depth), "", node_name(node));
+    }
+    if (is_threshold(node)) {
+        fprintf(stream, json ? ",\"threshold\":%"PRIu64 : "(%"PRIu64")",
+                node->threshold);
+    }
+    if (node->type == AST_GENOME) {
+        if (json) {
+            fprintf(stream, ",\"name\":");
+            print_json_string(stream, node->genome->name);
+        } else {
+            fprintf(stream, " '%s'", node->genome->name);
+        }
+    }
+    bool merged = ast_is_merged(node);
+    bool shared = node->refs > 1;
+    if (json) {
+        fprintf(stream, ",\"merged\":%s,\"shared\":%s",
+                merged ? "true" : "false", shared ? "true" : "false");
+    } else {
+        if (merged) fprintf(stream, " [merged]");
+        if (shared) fprintf(stream, " [shared]");
+    }
+    if (analysis != NULL) {
+        if (json) {
+            print_stats_json(stream, &analysis->stats);
+        } else {
+            print_stats_text(stream, &analysis->stats);
+        }
+    } else if (node->type == AST_GENOME) {
+        struct genome_stats stats;
+        tersect_db_get_genome_stats(tdb, 1, node->genome, &stats);
+        if (tersect_db_has_weights(tdb)) {
+            fprintf(stream, json ? ",\"db_weight\":%"PRIu64
+                                 : " db_weight=%"PRIu64, stats.weight);
+        }
+        fprintf(stream, json ? ",\"db_bytes\":%"PRIu64 : " db_bytes=%"PRIu64,
+                stats.size);
+    }
+    size_t nchildren = child_count(node);
+    if (json && nchildren) {
+        fprintf(stream, ",\"children\":[");
+    } else if (!json) {
+        fprintf(stream, "\n");
+    }
+    for (size_t i = 0; i < nchildren; ++i) {
+        if (json && i) fprintf(stream, ",");
+        print_node(stream, child_at(node, i),
+                   analysis != NULL ? &analysis->children[i] : NULL,
+                   tdb, depth + 1, json);
+    }
+    if (json) {
+        fprintf(stream, nchildren ? "]}" : "}");
+    }
+}
+
+static void print_query(FILE *stream, const char *query, bool optimized,
+                        bool json)
+{
+    if (json) {
+        fprintf(stream, "{\"query\":");
+        print_json_string(stream, query);
+        fprintf(stream, ",\"optimized\":%s", optimized ? "true" : "false");
+    } else {
+        fprintf(stream, "Query: %s%s\n", query,
+                optimized ? " (optimized)" : "");
+    }
+}
+
+/**
+ * Prints the plan of a query, i.e. the tree of operations it is evaluated as
+ * (after optimization and the sharing of identical subtrees), without
+ * evaluating it. Nodes evaluated on their own by the multi-way merge rather
+ * than as part of the compiled program are marked as merged.
+ */
+void explain_query(FILE *stream, const char *query, bool optimized,
+                   struct ast_node *root, const tersect_db *tdb, bool json)
+{
+    prepare_ast(root, NULL);
+    print_query(stream, query, optimized, json);
+    if (json) {
+        fprintf(stream, ",\"plan\":");
+    }
+    print_node(stream, root, NULL, tdb, 0, json);
+    if (json) {
+        fprintf(stream, "}\n");
+    }
+}
+
+/**
+ * Evaluates a query over each region, printing its plan with the statistics of
+ * the result of each node. The time of the root node is that of evaluating the
+ * whole query over the region.
+ */
+void analyze_query(FILE *stream, const char *query, bool optimized,
+                   struct ast_node *root, const tersect_db *tdb,
+                   size_t nregions, const struct genomic_interval *regions,
+                   bool json)
+{
+    // Subtrees are shared before any of them is evaluated on its own
+    prepare_ast(root, NULL);
+    print_query(stream, query, optimized, json);
+    if (json) {
+        fprintf(stream, ",\"regions\":[");
+    }
+    for (size_t i = 0; i < nregions; ++i) {
+        struct tersect_db_interval ti;
+        tersect_db_get_interval(tdb, &regions[i], &ti);
+        struct node_analysis analysis;
+        analyze_node(&analysis, root, tdb, &ti);
+        if (json) {
+            if (i) fprintf(stream, ",");
+            fprintf(stream, "{\"chromosome\":");
+            print_json_string(stream, regions[i].chromosome);
+            fprintf(stream, ",\"start\":%"PRIu32",\"end\":%"PRIu32
+                    ",\"variants\":%"PRIu64",\"plan\":",
+                    regions[i].start_base, regions[i].end_base,
+                    (uint64_t)ti.nvariants);
+        } else {
+            fprintf(stream, "Region %s:%"PRIu32"-%"PRIu32" (%"PRIu64
+                    " variants)\n", regions[i].chromosome,
+                    regions[i].start_base, regions[i].end_base,
+                    (uint64_t)ti.nvariants);
+        }
+        print_node(stream, root, &analysis, tdb, 0, json);
+        if (json) {
+            fprintf(stream, "}");
+        }
+        free_node_analysis(&analysis);
+    }
+    if (json) {
+        fprintf(stream, "]}\n");
+    }
+}
@@ -0,0 +1,170 @@
+/*  freq.c
+
+    Copyright (C) 2019 Cranfield University
+
+    Author: Tomasz Kurowski <t.j.kurowski@cranfield.ac.uk>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#include "freq.h"
+
+#include "bitarray.h"
+#include "query.h"
+#include "tersect_db.h"
+#include "vcf_writer.h"
+
+#include <getopt.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Local flags for freq */
+#define NO_HEADERS      2
+static int local_flags = 0;
+
+/* Argument options without a short equivalent */
+#define MIN_COUNT       1000
+#define MAX_COUNT       1001
+#define MMAP_HINTS      1002
+
+static void usage(FILE *stream)
+{
+    fprintf(stream,
+            "\n"
+            "Usage:    tersect freq [options] <db.tsi> <genlist> [region]...\n\n"
+            "Options:\n"
+            "    -h, --help              print this help message\n"
+            "    --max-count INT         print only variants carried by at most INT of\n"
+            "                            the selected samples\n"
+            "    --min-count INT         print only variants carried by at least INT of\n"
+            "                            the selected samples (default: 1)\n"
+            "    --mmap-hints STR        comma-separated database access hints (sequential,\n"
+            "                            random, willneed, populate, hugepages)\n"
+            "    -n, --no-headers        skip VCF header\n"
+            "\n");
+}
+
+error_t tersect_allele_frequency(int argc, char **argv)
+{
+    error_t rc = SUCCESS;
+    char *db_filename = NULL;
+    char *genlist = NULL;
+    char **region_strings = NULL;
+    size_t nregions = 0;
+    uint64_t min_count = 1;
+    uint64_t max_count = UINT64_MAX;
+    int access_hints = TDB_ACCESS_DEFAULT;
+    static struct option loptions[] = {
+        {"help", no_argument, NULL, 'h'},
+        {"max-count", required_argument, NULL, MAX_COUNT},
+        {"min-count", required_argument, NULL, MIN_COUNT},
+        {"mmap-hints", required_argument, NULL, MMAP_HINTS},
+        {"no-headers", no_argument, NULL, 'n'},
+        {NULL, 0, NULL, 0}
+    };
+    int c;
+    while ((c = getopt_long(argc, argv, ":hn", loptions, NULL)) != -1) {
+        switch(c) {
+        case 'h':
+            usage(stdout);
+            return SUCCESS;
+        case MAX_COUNT:
+            max_count = strtoull(optarg, NULL, 10);
+            break;
+        case MIN_COUNT:
+            min_count = strtoull(optarg, NULL, 10);
+            break;
+        case MMAP_HINTS:
+            if (tersect_db_parse_access(optarg, &access_hints)
+                != SUCCESS) {
+                usage(stderr);
+                return E_TSI_ACCESS_HINT;
+            }
+            break;
+        case 'n':
+            local_flags |= NO_HEADERS;
+            break;
+        default:
+            usage(stderr);
+            return SUCCESS;
+        }
+    }
+    argc -= optind;
+    argv += optind;
+    if (!argc) {
+        // Missing Tersect index file
+        usage(stderr);
+        return E_NO_TSI_FILE;
+    }
+    db_filename = argv[0];
+    if (argc == 1) {
+        // Missing genome list
+        usage(stderr);
+        return E_FREQ_NO_GENLIST;
+    }
+    genlist = argv[1];
+    argc -= 2;
+    argv += 2;
+    if (argc) {
+        region_strings = argv;
+        nregions = argc;
+    }
+    tersect_db *tdb = tersect_db_open_readonly(db_filename, access_hints);
+    if (tdb == NULL) return E_TSI_NOPEN;
+    struct genomic_interval *regions;
+    if (nregions) {
+        rc = tersect_db_parse_regions(tdb, nregions, region_strings, &regions);
+    } else {
+        rc = tersect_db_get_regions(tdb, &nregions, &regions);
+    }
+    if (rc != SUCCESS) goto cleanup_1;
+    size_t ngenomes;
+    struct genome *genomes;
+    struct query_error error;
+    rc = run_genlist_parser(genlist, tdb, &ngenomes, &genomes, &error);
+    if (rc != SUCCESS) {
+        print_query_error(stderr, genlist, &error);
+        goto cleanup_2;
+    }
+    struct bitarray *bas = malloc(ngenomes * sizeof *bas);
+    if (!(local_flags & NO_HEADERS)) {
+        vcf_print_count_header(genlist, nregions, region_strings);
+    }
+    for (size_t i = 0; i < nregions; ++i) {
+        struct tersect_db_interval ti;
+        tersect_db_get_interval(tdb, &regions[i], &ti);
+        if (!ti.nvariants) continue;
+        for (size_t j = 0; j < ngenomes; ++j) {
+            struct bitarray ba;
+            tersect_db_get_bitarray(tdb, &genomes[j], &ti.chromosome, &ba);
+            bitarray_extract_region(&bas[j], &ba, &ti.interval);
+        }
+        ba_count_it *it = init_bitarray_count_iterator(ngenomes, bas,
+                                                       min_count, max_count);
+        vcf_print_counts(tdb, it, ngenomes, &ti);
+        free_bitarray_count_iterator(it);
+    }
+    free(bas);
+    free(genomes);
+cleanup_2:
+    free(regions);
+cleanup_1:
+    tersect_db_close(tdb);
+    return rc;
+}
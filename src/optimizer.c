@@ -0,0 +1,615 @@
+/*  optimizer.c
+
+    Copyright (C) 2019 Cranfield University
+
+    Author: Tomasz Kurowski <t.j.kurowski@cranfield.ac.uk>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#include "optimizer.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/**
+ * Statistics used to estimate the size of the results of query operands. The
+ * genomes of a query are kept sorted by header along with their statistics so
+ * that they can be looked up for any genome node.
+ *
+ * Estimates are in terms of numbers of variants if the database records the
+ * weights of its bit arrays, and otherwise in terms of compressed sizes.
+ */
+struct optimizer {
+    bool weighted;
+    uint64_t universe; // Estimate for all the variants
+    size_t ngenomes;
+    struct genome *genomes;
+    struct genome_stats *stats;
+};
+
+static int genome_cmp(const void *a, const void *b)
+{
+    uintptr_t x = (uintptr_t)((const struct genome *)a)->hdr;
+    uintptr_t y = (uintptr_t)((const struct genome *)b)->hdr;
+    return (x > y) - (x < y);
+}
+
+static void collect_genomes(const struct ast_node *node, size_t *ngenomes,
+                            size_t *capacity, struct genome **genomes)
+{
+    switch (node->type) {
+    case AST_GENOME:
+        if (*ngenomes == *capacity) {
+            *capacity = *capacity ? 2 * *capacity : 16;
+            *genomes = realloc(*genomes, *capacity * sizeof **genomes);
+        }
+        (*genomes)[(*ngenomes)++] = *node->genome;
+        break;
+    case AST_ALL:
+        break;
+    case AST_COMPLEMENT:
+        collect_genomes(node->l, ngenomes, capacity, genomes);
+        break;
+    case AST_NARY:
+        for (size_t i = 0; i < node->nchildren; ++i) {
+            collect_genomes(node->children[i], ngenomes, capacity, genomes);
+        }
+        break;
+    default:
+        collect_genomes(node->l, ngenomes, capacity, genomes);
+        collect_genomes(node->r, ngenomes, capacity, genomes);
+    }
+}
+
+static void init_optimizer(struct optimizer *opt, const struct ast_node *root,
+                           const tersect_db *tdb)
+{
+    size_t capacity = 0;
+    *opt = (struct optimizer) {
+        .weighted = tersect_db_has_weights(tdb)
+    };
+    collect_genomes(root, &opt->ngenomes, &capacity, &opt->genomes);
+    size_t n = 0;
+    if (opt->ngenomes) {
+        // Queries such as "all" reference no genomes
+        qsort(opt->genomes, opt->ngenomes, sizeof *opt->genomes, genome_cmp);
+        for (size_t i = 0; i < opt->ngenomes; ++i) {
+            if (!n || opt->genomes[i].hdr != opt->genomes[n - 1].hdr) {
+                opt->genomes[n++] = opt->genomes[i];
+            }
+        }
+        opt->ngenomes = n;
+        opt->stats = malloc(n * sizeof *opt->stats);
+        tersect_db_get_genome_stats(tdb, n, opt->genomes, opt->stats);
+    }
+    if (opt->weighted) {
+        size_t nchroms;
+        struct chromosome *chroms;
+        tersect_db_get_chromosomes(tdb, &nchroms, &chroms);
+        for (size_t i = 0; i < nchroms; ++i) {
+            opt->universe += chroms[i].variant_count;
+        }
+        free(chroms);
+    } else {
+        for (size_t i = 0; i < n; ++i) {
+            if (opt->stats[i].size > opt->universe) {
+                opt->universe = opt->stats[i].size;
+            }
+        }
+    }
+}
+
+static void free_optimizer(struct optimizer *opt)
+{
+    free(opt->genomes);
+    free(opt->stats);
+}
+
+static const struct genome_stats *genome_stats(const struct optimizer *opt,
+                                               const struct genome *genome)
+{
+    const struct genome *found = bsearch(genome, opt->genomes, opt->ngenomes,
+                                         sizeof *opt->genomes, genome_cmp);
+    return &opt->stats[found - opt->genomes];
+}
+
+/**
+ * Empty results are represented by the complement of all variants.
+ */
+static struct ast_node *create_empty_node(void)
+{
+    return create_ast_node(AST_COMPLEMENT, create_all_node(), NULL);
+}
+
+static bool is_empty(const struct ast_node *node)
+{
+    return node->type == AST_COMPLEMENT && node->l->type == AST_ALL;
+}
+
+static bool is_threshold(const struct ast_node *node)
+{
+    return node->type == AST_NARY && (node->operation == AST_ATLEAST
+                                      || node->operation == AST_ATMOST
+                                      || node->operation == AST_EXACTLY);
+}
+
+/**
+ * Returns true if two subtrees describe the same expression.
+ */
+static bool ast_equal(const struct ast_node *a, const struct ast_node *b)
+{
+    if (a->type != b->type) return false;
+    switch (a->type) {
+    case AST_GENOME:
+        return a->genome->hdr == b->genome->hdr;
+    case AST_ALL:
+        return true;
+    case AST_COMPLEMENT:
+        return ast_equal(a->l, b->l);
+    case AST_NARY:
+        if (a->operation != b->operation || a->nchildren != b->nchildren
+            || (is_threshold(a) && a->threshold != b->threshold)) {
+            return false;
+        }
+        for (size_t i = 0; i < a->nchildren; ++i) {
+            if (!ast_equal(a->children[i], b->children[i])) return false;
+        }
+        return true;
+    default:
+        return ast_equal(a->l, b->l) && ast_equal(a->r, b->r);
+    }
+}
+
+/**
+ * Estimates the size of the result of a subtree (see struct optimizer).
+ */
+static uint64_t estimate(const struct optimizer *opt,
+                         const struct ast_node *node)
+{
+    uint64_t est = 0;
+    switch (node->type) {
+    case AST_GENOME: {
+        const struct genome_stats *stats = genome_stats(opt, node->genome);
+        return opt->weighted ? stats->weight : stats->size;
+    }
+    case AST_COMPLEMENT:
+        return is_empty(node) ? 0 : opt->universe;
+    case AST_DIFFERENCE:
+        return estimate(opt, node->l);
+    case AST_INTERSECTION: {
+        uint64_t l = estimate(opt, node->l);
+        uint64_t r = estimate(opt, node->r);
+        return l < r ? l : r;
+    }
+    case AST_UNION:
+    case AST_SYMMETRIC_DIFFERENCE:
+        est = estimate(opt, node->l) + estimate(opt, node->r);
+        break;
+    case AST_NARY:
+        if (node->operation == AST_INTERSECTION) {
+            est = opt->universe;
+            for (size_t i = 0; i < node->nchildren; ++i) {
+                uint64_t child = estimate(opt, node->children[i]);
+                if (child < est) est = child;
+            }
+            return est;
+        } else if (node->operation == AST_ATMOST
+                   || node->operation == AST_EXACTLY) {
+            return opt->universe;
+        }
+        for (size_t i = 0; i < node->nchildren; ++i) {
+            est += estimate(opt, node->children[i]);
+        }
+        if (node->operation == AST_ATLEAST && node->threshold > 1) {
+            est /= node->threshold;
+        }
+        break;
+    default:
+        return opt->universe;
+    }
+    return est < opt->universe ? est : opt->universe;
+}
+
+/**
+ * Frees a node along with its descendants and returns its replacement.
+ */
+static struct ast_node *replace_node(struct ast_node *node,
+                                     struct ast_node *replacement)
+{
+    free_ast(node);
+    return replacement;
+}
+
+/**
+ * Frees an n-ary node without its children.
+ */
+static void free_nary_shell(struct ast_node *node)
+{
+    node->nchildren = 0;
+    free_ast(node);
+}
+
+/**
+ * Genome child of a n-ary node, paired with its position.
+ */
+struct genome_child {
+    uintptr_t hdr;
+    size_t index;
+};
+
+static int genome_child_cmp(const void *a, const void *b)
+{
+    const struct genome_child *x = a;
+    const struct genome_child *y = b;
+    if (x->hdr != y->hdr) return (x->hdr > y->hdr) - (x->hdr < y->hdr);
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+/**
+ * Removes repeated children of a union or intersection (A | A = A), or pairs
+ * of equal children of a symmetric difference (A ^ A = {}). Genome children
+ * are matched by sorting, other children by comparing their subtrees.
+ */
+static void remove_duplicates(struct ast_node *node)
+{
+    bool pairs = node->operation == AST_SYMMETRIC_DIFFERENCE;
+    size_t n = node->nchildren;
+    bool *removed = calloc(n, sizeof *removed);
+    struct genome_child *genomes = malloc(n * sizeof *genomes);
+    size_t ngenomes = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (node->children[i]->type == AST_GENOME) {
+            genomes[ngenomes++] = (struct genome_child) {
+                .hdr = (uintptr_t)node->children[i]->genome->hdr,
+                .index = i
+            };
+        }
+    }
+    qsort(genomes, ngenomes, sizeof *genomes, genome_child_cmp);
+    for (size_t i = 0; i < ngenomes;) {
+        size_t j = i + 1;
+        while (j < ngenomes && genomes[j].hdr == genomes[i].hdr) {
+            removed[genomes[j++].index] = true;
+        }
+        if (pairs && (j - i) % 2 == 0) {
+            removed[genomes[i].index] = true;
+        }
+        i = j;
+    }
+    free(genomes);
+    for (size_t i = 0; i < n; ++i) {
+        if (removed[i] || node->children[i]->type == AST_GENOME) continue;
+        for (size_t j = i + 1; j < n; ++j) {
+            if (removed[j] || !ast_equal(node->children[i],
+                                         node->children[j])) {
+                continue;
+            }
+            removed[j] = true;
+            if (pairs) {
+                removed[i] = true;
+                break;
+            }
+        }
+    }
+    size_t m = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (removed[i]) {
+            free_ast(node->children[i]);
+        } else {
+            node->children[m++] = node->children[i];
+        }
+    }
+    node->nchildren = m;
+    free(removed);
+}
+
+/**
+ * Child of an intersection paired with its estimated size and position.
+ */
+struct estimated_child {
+    uint64_t estimate;
+    size_t index;
+    struct ast_node *node;
+};
+
+static int estimated_child_cmp(const void *a, const void *b)
+{
+    const struct estimated_child *x = a;
+    const struct estimated_child *y = b;
+    if (x->estimate != y->estimate) {
+        return (x->estimate > y->estimate) - (x->estimate < y->estimate);
+    }
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+/**
+ * Orders the children of an intersection by ascending estimated size (keeping
+ * the written order of children with equal estimates).
+ */
+static void sort_by_estimate(const struct optimizer *opt,
+                             struct ast_node *node)
+{
+    struct estimated_child *sorted = malloc(node->nchildren * sizeof *sorted);
+    for (size_t i = 0; i < node->nchildren; ++i) {
+        sorted[i] = (struct estimated_child) {
+            .estimate = estimate(opt, node->children[i]),
+            .index = i,
+            .node = node->children[i]
+        };
+    }
+    qsort(sorted, node->nchildren, sizeof *sorted, estimated_child_cmp);
+    for (size_t i = 0; i < node->nchildren; ++i) {
+        node->children[i] = sorted[i].node;
+    }
+    free(sorted);
+}
+
+/**
+ * Moves the genome children of a n-ary node which also has other children
+ * into a nested node of the same operation, so that they can be combined by
+ * the multi-way merge however many there are.
+ */
+static void group_genomes(struct ast_node *node)
+{
+    size_t ngenomes = 0;
+    for (size_t i = 0; i < node->nchildren; ++i) {
+        ngenomes += node->children[i]->type == AST_GENOME;
+    }
+    if (ngenomes < 2 || ngenomes == node->nchildren) return;
+    struct ast_node **genomes = malloc(ngenomes * sizeof *genomes);
+    struct ast_node **children = malloc((node->nchildren - ngenomes + 1)
+                                        * sizeof *children);
+    size_t m = 1;
+    for (size_t i = 0, j = 0; i < node->nchildren; ++i) {
+        if (node->children[i]->type == AST_GENOME) {
+            genomes[j++] = node->children[i];
+        } else {
+            children[m++] = node->children[i];
+        }
+    }
+    children[0] = create_nary_node(node->operation, ngenomes, genomes);
+    free(node->children);
+    node->children = children;
+    node->nchildren = m;
+}
+
+static struct ast_node *optimize_node(const struct optimizer *opt,
+                                      struct ast_node *node);
+
+/**
+ * Optimizes a n-ary intersection, union or symmetric difference whose children
+ * have already been optimized. Nested operations of the same kind are merged
+ * into it, constant and repeated children are removed, and the children of an
+ * intersection are ordered by ascending estimated size.
+ */
+static struct ast_node *optimize_chain(const struct optimizer *opt,
+                                       struct ast_node *node)
+{
+    int operation = node->operation;
+    size_t n = 0;
+    for (size_t i = 0; i < node->nchildren; ++i) {
+        struct ast_node *child = node->children[i];
+        n += (child->type == AST_NARY && child->operation == operation)
+             ? child->nchildren : 1;
+    }
+    struct ast_node **children = malloc(n * sizeof *children);
+    n = 0;
+    for (size_t i = 0; i < node->nchildren; ++i) {
+        struct ast_node *child = node->children[i];
+        if (child->type == AST_NARY && child->operation == operation) {
+            for (size_t j = 0; j < child->nchildren; ++j) {
+                children[n++] = child->children[j];
+            }
+            free_nary_shell(child);
+        } else {
+            children[n++] = child;
+        }
+    }
+    free(node->children);
+    node->children = children;
+    node->nchildren = n;
+
+    size_t m = 0;
+    for (size_t i = 0; i < n; ++i) {
+        struct ast_node *child = children[i];
+        bool empty = is_empty(child);
+        bool all = child->type == AST_ALL;
+        if ((operation == AST_INTERSECTION && empty)
+            || (operation == AST_UNION && all)) {
+            // The result is the same as that of the child
+            for (size_t j = 0; j < n; ++j) {
+                if (j < m || j > i) {
+                    free_ast(children[j]);
+                }
+            }
+            free_nary_shell(node);
+            return child;
+        }
+        if (empty || (operation == AST_INTERSECTION && all)) {
+            free_ast(child);
+        } else {
+            children[m++] = child;
+        }
+    }
+    node->nchildren = m;
+    remove_duplicates(node);
+    if (!node->nchildren) {
+        return replace_node(node, operation == AST_INTERSECTION
+                                  ? create_all_node() : create_empty_node());
+    } else if (node->nchildren == 1) {
+        struct ast_node *child = node->children[0];
+        free_nary_shell(node);
+        return child;
+    }
+    group_genomes(node);
+    if (operation == AST_INTERSECTION) {
+        sort_by_estimate(opt, node);
+    }
+    return node;
+}
+
+static struct ast_node *optimize_complement(struct ast_node *node)
+{
+    if (node->l->type == AST_COMPLEMENT) {
+        // Double complement (including that of an empty result)
+        struct ast_node *child = node->l->l;
+        free(node->l);
+        free(node);
+        return child;
+    }
+    return node;
+}
+
+/**
+ * Optimizes a difference whose operands have already been optimized. Apart
+ * from constant operands, nested differences are merged into one with a union
+ * of subtrahends, and a difference from an intersection is pushed down to its
+ * (estimated) smallest operand.
+ */
+static struct ast_node *optimize_difference(const struct optimizer *opt,
+                                            struct ast_node *node)
+{
+    struct ast_node *l = node->l;
+    struct ast_node *r = node->r;
+    if (is_empty(l) || is_empty(r)) {
+        free_ast(r);
+        free(node);
+        return l;
+    }
+    if (r->type == AST_ALL || ast_equal(l, r)) {
+        return replace_node(node, create_empty_node());
+    }
+    if (l->type == AST_ALL) {
+        // all \ A = !A
+        free_ast(l);
+        node->type = AST_COMPLEMENT;
+        node->l = r;
+        node->r = NULL;
+        return optimize_complement(node);
+    }
+    if (l->type == AST_DIFFERENCE) {
+        // (A \ B) \ C = A \ (B | C)
+        struct ast_node **children = malloc(2 * sizeof *children);
+        children[0] = l->r;
+        children[1] = r;
+        l->r = optimize_chain(opt, create_nary_node(AST_UNION, 2, children));
+        free(node);
+        return optimize_difference(opt, l);
+    }
+    if (l->type == AST_NARY && l->operation == AST_INTERSECTION) {
+        // (A & B) \ C = (A \ C) & B
+        l->children[0] = optimize_difference(opt, create_ast_node(
+            AST_DIFFERENCE, l->children[0], r));
+        free(node);
+        return optimize_chain(opt, l);
+    }
+    return node;
+}
+
+/**
+ * Optimizes a threshold operation whose operands have already been optimized.
+ * Empty operands are removed, and thresholds which are trivial or equivalent
+ * to an intersection or a union are replaced.
+ */
+static struct ast_node *optimize_threshold(const struct optimizer *opt,
+                                           struct ast_node *node)
+{
+    size_t m = 0;
+    for (size_t i = 0; i < node->nchildren; ++i) {
+        if (is_empty(node->children[i])) {
+            free_ast(node->children[i]);
+        } else {
+            node->children[m++] = node->children[i];
+        }
+    }
+    node->nchildren = m;
+    uint64_t k = node->threshold;
+    switch (node->operation) {
+    case AST_ATLEAST:
+        if (!k) return replace_node(node, create_all_node());
+        if (k > m) return replace_node(node, create_empty_node());
+        break;
+    case AST_ATMOST:
+        if (k >= m) return replace_node(node, create_all_node());
+        break;
+    default:
+        if (k > m) return replace_node(node, create_empty_node());
+        if (!m) return replace_node(node, create_all_node());
+    }
+    if (node->operation != AST_ATMOST && k == m) {
+        node->operation = AST_INTERSECTION;
+        return optimize_chain(opt, node);
+    }
+    if (node->operation == AST_ATLEAST && k == 1) {
+        node->operation = AST_UNION;
+        return optimize_chain(opt, node);
+    }
+    return node;
+}
+
+static struct ast_node *optimize_node(const struct optimizer *opt,
+                                      struct ast_node *node)
+{
+    switch (node->type) {
+    case AST_GENOME:
+        if (opt->weighted && !genome_stats(opt, node->genome)->weight) {
+            return replace_node(node, create_empty_node());
+        }
+        return node;
+    case AST_ALL:
+        return node;
+    case AST_COMPLEMENT:
+        node->l = optimize_node(opt, node->l);
+        return optimize_complement(node);
+    case AST_NARY:
+        for (size_t i = 0; i < node->nchildren; ++i) {
+            node->children[i] = optimize_node(opt, node->children[i]);
+        }
+        return is_threshold(node) ? optimize_threshold(opt, node)
+                                  : optimize_chain(opt, node);
+    case AST_DIFFERENCE:
+        node->l = optimize_node(opt, node->l);
+        node->r = optimize_node(opt, node->r);
+        return optimize_difference(opt, node);
+    default: {
+        // Binary intersection, union or symmetric difference
+        struct ast_node **children = malloc(2 * sizeof *children);
+        children[0] = optimize_node(opt, node->l);
+        children[1] = optimize_node(opt, node->r);
+        struct ast_node *nary = create_nary_node(node->type, 2, children);
+        free(node);
+        return optimize_chain(opt, nary);
+    }
+    }
+}
+
+/**
+ * Rewrites a query into an equivalent one which is cheaper to evaluate, using
+ * the statistics of the bit arrays of its genomes recorded in the database.
+ * Takes ownership of the query and returns the root of the rewritten one.
+ */
+struct ast_node *optimize_ast(struct ast_node *root, const tersect_db *tdb)
+{
+    struct optimizer opt;
+    init_optimizer(&opt, root, tdb);
+    root = optimize_node(&opt, root);
+    free_optimizer(&opt);
+    return root;
+}
@@ -1,8 +1,38 @@
+%define api.pure full
+%define parse.error verbose
+%locations
+%param {yyscan_t scanner}
+%parse-param {struct query_parser *parser}
+
+%code requires {
+    #include "query.h"
+
+    #ifndef YY_TYPEDEF_YY_SCANNER_T
+    #define YY_TYPEDEF_YY_SCANNER_T
+    typedef void *yyscan_t;
+    #endif
+
+    /**
+     * State of a single parser run. It is also passed to the scanner as its
+     * extra data, so that separate queries can be parsed concurrently.
+     */
+    struct query_parser {
+        const tersect_db *tdb;
+        int start_token;
+        struct ast_node *output;
+        struct gen_list *genlist_output;
+        struct gen_list *query_genlist;
+        struct query_error error;
+        bool failed;
+    };
+}
+
 %{
     #include "query.h"
 
     #include "ast.h"
 
+    #include <errno.h>
     #include <stdarg.h>
     #include <stdlib.h>
     #include <string.h>
@@ -16,25 +46,40 @@
         struct genome *genomes;
         size_t count;
     };
-
-    int yylex(void);
-    void yy_scan_string(const char *);
-    int yylex_destroy(void);
-    struct id_list *merge_id_lists(struct id_list *list_a,
-                                   struct id_list *list_b);
-    void load_genomes(const struct id_list *gen_id_list,
-                  const struct id_list *var_id_list,
-                  struct gen_list *gen_list);
-    struct gen_list *diff_gen_lists(struct gen_list *list_a,
-                                    struct gen_list *list_b);
-    void free_id_list(struct id_list *id_list);
-    void free_gen_list(struct gen_list *gen_list);
-    const tersect_db *PARSE_TERSECT_DB;
-    struct ast_node *PARSE_OUTPUT;
 %}
 
 %code provides {
-    void yyerror(const char *, ...);
+    void query_error(struct query_parser *parser, const YYLTYPE *loc,
+                     const char *fmt, ...);
+}
+
+%code {
+    int yylex(YYSTYPE *yylval_param, YYLTYPE *yylloc_param,
+              yyscan_t yyscanner);
+    int yylex_init_extra(struct query_parser *extra, yyscan_t *scanner);
+    struct yy_buffer_state *yy_scan_string(const char *str,
+                                           yyscan_t yyscanner);
+    int yylex_destroy(yyscan_t yyscanner);
+    static void yyerror(const YYLTYPE *loc, yyscan_t scanner,
+                        struct query_parser *parser, const char *msg);
+
+    static struct id_list *merge_id_lists(struct id_list *list_a,
+                                          struct id_list *list_b);
+    static bool load_genomes(struct query_parser *parser, const YYLTYPE *loc,
+                             const struct id_list *gen_id_list,
+                             const struct id_list *var_id_list,
+                             struct gen_list *gen_list);
+    static bool check_operands(struct query_parser *parser,
+                               struct ast_node *left, const YYLTYPE *left_loc,
+                               struct ast_node *right,
+                               const YYLTYPE *right_loc);
+    static struct gen_list *diff_gen_lists(struct gen_list *list_a,
+                                           struct gen_list *list_b);
+    static bool parse_threshold(struct query_parser *parser,
+                                const YYLTYPE *loc, char *str,
+                                uint64_t *threshold);
+    static void free_id_list(struct id_list *id_list);
+    static void free_gen_list(struct gen_list *gen_list);
 }
 
 %union {
@@ -44,25 +89,48 @@
     struct gen_list *gen_list;
 }
 
-%token <name> IDENT
-%token UNION
-%token INTER
-%token SYMDIFF
+%token START_QUERY
+%token START_GENLIST
+%token <name> IDENT "sample name"
+%token UNION "union"
+%token INTER "intersect"
+%token SYMDIFF "symdiff"
+%token ALL "all"
+%token ATLEAST "atleast"
+%token ATMOST "atmost"
+%token EXACTLY "exactly"
 %type <ast> expr
 %type <id_list> list
 %type <gen_list> genlist;
 %left '&' '|' '-' '^' '\\'
 %right '>'
 %left ','
+%right '!'
+
+// Free partial results when a query is rejected
+%destructor { free($$); } <name>
+%destructor { if ($$ != NULL) free_ast($$); } <ast>
+%destructor { free_id_list($$); } <id_list>
+%destructor { free_gen_list($$); } <gen_list>
 
 // Needed to handle parantheses for list / genlist / expr
 %expect 2
 
 %%
 
+start:
+        START_QUERY program
+        | START_GENLIST genlist {
+                                    parser->genlist_output = $2;
+                                }
+        ;
+
 program:
         program expr            {
-                                    PARSE_OUTPUT = $2;
+                                    if (parser->output != NULL) {
+                                        free_ast(parser->output);
+                                    }
+                                    parser->output = $2;
                                 }
         | %empty
         ;
@@ -87,19 +155,30 @@ genlist:
         list                    {
                                     struct id_list *gen_id_list = $1;
                                     struct gen_list *gen_list = malloc(sizeof *gen_list);
-                                    load_genomes(gen_id_list, NULL, gen_list);
+                                    bool found = load_genomes(parser, &@$,
+                                                              gen_id_list,
+                                                              NULL, gen_list);
                                     free_id_list(gen_id_list);
+                                    if (!found) {
+                                        free_gen_list(gen_list);
+                                        YYABORT;
+                                    }
                                     $$ = gen_list;
                                 }
         | list '>' list         {
                                     struct id_list *gen_id_list = $1;
                                     struct id_list *var_id_list = $3;
                                     struct gen_list *gen_list = malloc(sizeof *gen_list);
-                                    load_genomes(gen_id_list,
-                                                 var_id_list,
-                                                 gen_list);
+                                    bool found = load_genomes(parser, &@$,
+                                                              gen_id_list,
+                                                              var_id_list,
+                                                              gen_list);
                                     free_id_list(gen_id_list);
                                     free_id_list(var_id_list);
+                                    if (!found) {
+                                        free_gen_list(gen_list);
+                                        YYABORT;
+                                    }
                                     $$ = gen_list;
                                 }
         | genlist '-' genlist   {
@@ -114,45 +193,63 @@ expr:
         genlist                 {
                                     struct gen_list *gen_list = $1;
                                     if (gen_list->count > 1) {
-                                        // yyerror("Genome lists are only allowed within functions");
-                                        for (size_t i = 0; i < gen_list->count; ++i) {
-                                            printf("%s\n", gen_list->genomes[i].name);
+                                        // Only valid as the query result
+                                        if (parser->query_genlist != NULL) {
+                                            free_gen_list(parser->query_genlist);
                                         }
+                                        parser->query_genlist = gen_list;
                                         $$ = NULL;
                                     } else if (gen_list->count == 0) {
-                                        yyerror("Empty genome list");
-                                        $$ = NULL;
+                                        query_error(parser, &@$,
+                                                    "Empty genome list");
+                                        free_gen_list(gen_list);
+                                        YYABORT;
                                     } else {
                                         $$ = create_genome_node(&gen_list->genomes[0]);
+                                        free_gen_list(gen_list);
                                     }
-                                    free_gen_list(gen_list);
                                 }
         | expr '&' expr         {
-                                    if ($1 == NULL || $3 == NULL) {
-                                        yyerror("Invalid operand in intersection");
+                                    if (!check_operands(parser, $1, &@1,
+                                                        $3, &@3)) {
+                                        YYABORT;
                                     }
                                     $$ = create_ast_node(AST_INTERSECTION,
                                                          $1, $3);
                                 }
         | expr '|' expr         {
-                                    if ($1 == NULL || $3 == NULL) {
-                                        yyerror("Invalid operand in union");
+                                    if (!check_operands(parser, $1, &@1,
+                                                        $3, &@3)) {
+                                        YYABORT;
                                     }
                                     $$ = create_ast_node(AST_UNION, $1, $3);
                                 }
         | expr '\\' expr        {
-                                    if ($1 == NULL || $3 == NULL) {
-                                        yyerror("Invalid operand in difference");
+                                    if (!check_operands(parser, $1, &@1,
+                                                        $3, &@3)) {
+                                        YYABORT;
                                     }
                                     $$ = create_ast_node(AST_DIFFERENCE, $1, $3);
                                 }
         | expr '^' expr         {
-                                    if ($1 == NULL || $3 == NULL) {
-                                        yyerror("Invalid operand in symmetric difference");
+                                    if (!check_operands(parser, $1, &@1,
+                                                        $3, &@3)) {
+                                        YYABORT;
                                     }
                                     $$ = create_ast_node(AST_SYMMETRIC_DIFFERENCE,
                                                          $1, $3);
                                 }
+        | '!' expr              {
+                                    if (!check_operands(parser, $2, &@2,
+                                                        NULL, NULL)) {
+                                        YYABORT;
+                                    }
+                                    $$ = create_ast_node(AST_COMPLEMENT,
+                                                         $2, NULL);
+                                }
+        | ALL                   {
+                                    $$ = create_all_node();
+                                }
         | '(' expr ')'          {
                                     $$ = $2;
                                 }
@@ -177,25 +274,105 @@ expr:
                                                         gen_list->genomes);
                                     free_gen_list(gen_list);
                                 }
+        | ATLEAST '(' IDENT ',' genlist ')' {
+                                    struct gen_list *gen_list = $5;
+                                    uint64_t threshold;
+                                    if (!parse_threshold(parser, &@3, $3,
+                                                         &threshold)) {
+                                        free_gen_list(gen_list);
+                                        YYABORT;
+                                    }
+                                    $$ = create_threshold_subtree(AST_ATLEAST,
+                                                                  threshold,
+                                                                  gen_list->count,
+                                                                  gen_list->genomes);
+                                    free_gen_list(gen_list);
+                                }
+        | ATMOST '(' IDENT ',' genlist ')' {
+                                    struct gen_list *gen_list = $5;
+                                    uint64_t threshold;
+                                    if (!parse_threshold(parser, &@3, $3,
+                                                         &threshold)) {
+                                        free_gen_list(gen_list);
+                                        YYABORT;
+                                    }
+                                    $$ = create_threshold_subtree(AST_ATMOST,
+                                                                  threshold,
+                                                                  gen_list->count,
+                                                                  gen_list->genomes);
+                                    free_gen_list(gen_list);
+                                }
+        | EXACTLY '(' IDENT ',' genlist ')' {
+                                    struct gen_list *gen_list = $5;
+                                    uint64_t threshold;
+                                    if (!parse_threshold(parser, &@3, $3,
+                                                         &threshold)) {
+                                        free_gen_list(gen_list);
+                                        YYABORT;
+                                    }
+                                    $$ = create_threshold_subtree(AST_EXACTLY,
+                                                                  threshold,
+                                                                  gen_list->count,
+                                                                  gen_list->genomes);
+                                    free_gen_list(gen_list);
+                                }
         ;
 
 %%
 
-void yyerror(const char *s, ...)
+/**
+ * Records an error at the given location of the query. Only the first error
+ * is kept, as any later ones tend to be a consequence of it.
+ */
+void query_error(struct query_parser *parser, const YYLTYPE *loc,
+                 const char *fmt, ...)
 {
+    if (parser->failed) return;
+    parser->failed = true;
+    // Locations use 1-based columns, with the last column one past the end
+    parser->error.start = loc->first_column - 1;
+    parser->error.end = loc->last_column - 1;
     va_list ap;
-    va_start(ap, s);
-    fprintf(stderr, "Error: ");
-    vfprintf(stderr, s, ap);
-    fprintf(stderr, "\n");
-    exit(1);
+    va_start(ap, fmt);
+    vsnprintf(parser->error.message, sizeof parser->error.message, fmt, ap);
+    va_end(ap);
+}
+
+static void yyerror(const YYLTYPE *loc, yyscan_t scanner,
+                    struct query_parser *parser, const char *msg)
+{
+    (void)scanner;
+    query_error(parser, loc, "%s", msg);
+}
+
+/**
+ * Genome lists (parsed as NULL expressions) can only be the result of a query
+ * rather than an operand. If either operand is a genome list, records an
+ * error and frees both operands. A unary operator has no right operand.
+ */
+static bool check_operands(struct query_parser *parser,
+                           struct ast_node *left, const YYLTYPE *left_loc,
+                           struct ast_node *right, const YYLTYPE *right_loc)
+{
+    const YYLTYPE *loc;
+    if (left == NULL) {
+        loc = left_loc;
+    } else if (right_loc != NULL && right == NULL) {
+        loc = right_loc;
+    } else {
+        return true;
+    }
+    query_error(parser, loc, "Genome lists are only allowed within functions");
+    if (left != NULL) free_ast(left);
+    if (right != NULL) free_ast(right);
+    return false;
 }
 
 /**
  * Naive implementation,
  */
-struct gen_list *diff_gen_lists(struct gen_list *list_a,
-                                struct gen_list *list_b)
+static struct gen_list *diff_gen_lists(struct gen_list *list_a,
+                                       struct gen_list *list_b)
 {
     for (size_t i = 0; i < list_a->count; ++i) {
         for (size_t j = 0; j < list_b->count; ++j) {
@@ -221,7 +398,8 @@ struct gen_list *diff_gen_lists(struct gen_list *list_a,
  * Merges two id lists. Saves the result in list_a and frees list_b.
  * Returns list_a.
  */
-struct id_list *merge_id_lists(struct id_list *list_a, struct id_list *list_b)
+static struct id_list *merge_id_lists(struct id_list *list_a,
+                                      struct id_list *list_b)
 {
     size_t old_count = list_a->count;
     list_a->count += list_b->count;
@@ -233,30 +411,60 @@ struct id_list *merge_id_lists(struct id_list *list_a, struct id_list *list_b)
     return list_a;
 }
 
-void load_genomes(const struct id_list *gen_id_list,
-                  const struct id_list *var_id_list,
-                  struct gen_list *gen_list)
+/**
+ * Loads the genomes matching an id list. Returns false (recording an error)
+ * if none were found.
+ */
+static bool load_genomes(struct query_parser *parser, const YYLTYPE *loc,
+                         const struct id_list *gen_id_list,
+                         const struct id_list *var_id_list,
+                         struct gen_list *gen_list)
 {
     error_t rc;
     if (var_id_list == NULL) {
-        rc = tersect_db_get_genomes(PARSE_TERSECT_DB,
+        rc = tersect_db_get_genomes(parser->tdb,
                                     gen_id_list->count, gen_id_list->ids,
                                     0, NULL,
                                     &gen_list->count, &gen_list->genomes);
     } else {
-        rc = tersect_db_get_genomes(PARSE_TERSECT_DB,
+        rc = tersect_db_get_genomes(parser->tdb,
                                     gen_id_list->count, gen_id_list->ids,
                                     var_id_list->count, var_id_list->ids,
                                     &gen_list->count, &gen_list->genomes);
     }
-    if (rc != SUCCESS || gen_list->count == 0) {
+    if (rc != SUCCESS) {
+        gen_list->genomes = NULL;
+        gen_list->count = 0;
+    }
+    if (gen_list->count == 0) {
         /* TODO: may need to make "tersect_db_get_genomes" verbose here to
         print specific missing name(s) */
-        yyerror("Could not find specified genome(s)");
+        query_error(parser, loc, "Could not find specified genome(s)");
+        return false;
     }
+    return true;
 }
 
-void free_id_list(struct id_list *id_list)
+/**
+ * Parses the threshold argument of atleast/atmost/exactly, which is lexed as
+ * an identifier so that numeric sample names remain valid. Frees the string.
+ */
+static bool parse_threshold(struct query_parser *parser, const YYLTYPE *loc,
+                            char *str, uint64_t *threshold)
+{
+    char *end;
+    bool valid = true;
+    errno = 0;
+    *threshold = strtoull(str, &end, 10);
+    if (*str < '0' || *str > '9' || *end != '\0' || errno == ERANGE) {
+        query_error(parser, loc, "Invalid threshold: %s", str);
+        valid = false;
+    }
+    free(str);
+    return valid;
+}
+
+static void free_id_list(struct id_list *id_list)
 {
     for (size_t i = 0; i < id_list->count; ++i) {
         free(id_list->ids[i]);
@@ -265,17 +473,115 @@ void free_id_list(struct id_list *id_list)
     free(id_list);
 }
 
-void free_gen_list(struct gen_list *gen_list)
+static void free_gen_list(struct gen_list *gen_list)
 {
     free(gen_list->genomes);
     free(gen_list);
 }
 
-struct ast_node *run_set_parser(const char *query, const tersect_db *tdb)
+/**
+ * Runs the parser on a string, starting with the grammar selected by the
+ * parser's start token.
+ */
+static error_t run_parser(struct query_parser *parser, const char *input)
+{
+    yyscan_t scanner;
+    if (yylex_init_extra(parser, &scanner)) return E_ALLOC;
+    yy_scan_string(input, scanner);
+    int status = yyparse(scanner, parser);
+    yylex_destroy(scanner);
+    if (status == 2) return E_ALLOC;
+    if (status || parser->failed) return E_PARSE_QUERY;
+    return SUCCESS;
+}
+
+/**
+ * Parses a set query. On failure, the error (if not NULL) describes what was
+ * wrong with the query and where.
+ */
+error_t run_set_parser(const char *query, const tersect_db *tdb,
+                       struct query_result *result, struct query_error *error)
 {
-    PARSE_TERSECT_DB = tdb;
-    yy_scan_string(query);
-    yyparse();
-    yylex_destroy();
-    return PARSE_OUTPUT;
+    struct query_parser parser = {
+        .tdb = tdb,
+        .start_token = START_QUERY
+    };
+    error_t rc = run_parser(&parser, query);
+    if (rc == SUCCESS && parser.output == NULL
+        && parser.query_genlist == NULL) {
+        YYLTYPE loc = { 1, 1, 1, 1 };
+        query_error(&parser, &loc, "Empty query");
+        rc = E_PARSE_QUERY;
+    }
+    if (rc != SUCCESS) {
+        if (parser.output != NULL) {
+            free_ast(parser.output);
+        }
+        if (parser.query_genlist != NULL) {
+            free_gen_list(parser.query_genlist);
+        }
+        if (error != NULL) {
+            *error = parser.error;
+        }
+        return rc;
+    }
+    *result = (struct query_result) { .ast = parser.output };
+    if (parser.output == NULL) {
+        // The last expression of the query was a genome list
+        result->ngenomes = parser.query_genlist->count;
+        result->genomes = parser.query_genlist->genomes;
+        free(parser.query_genlist);
+    } else if (parser.query_genlist != NULL) {
+        free_gen_list(parser.query_genlist);
+    }
+    return SUCCESS;
+}
+
+/**
+ * Parses a genome list (as used within functional operators) on its own.
+ * The matching genomes need to be freed by the caller.
+ */
+error_t run_genlist_parser(const char *genlist, const tersect_db *tdb,
+                           size_t *ngenomes, struct genome **genomes,
+                           struct query_error *error)
+{
+    struct query_parser parser = {
+        .tdb = tdb,
+        .start_token = START_GENLIST
+    };
+    error_t rc = run_parser(&parser, genlist);
+    if (rc != SUCCESS) {
+        if (parser.genlist_output != NULL) {
+            free_gen_list(parser.genlist_output);
+        }
+        if (error != NULL) {
+            *error = parser.error;
+        }
+        return rc;
+    }
+    *genomes = parser.genlist_output->genomes;
+    *ngenomes = parser.genlist_output->count;
+    free(parser.genlist_output);
+    return SUCCESS;
+}
+
+/**
+ * Prints a parse error along with the query, underlining the part of the
+ * query the error refers to.
+ */
+void print_query_error(FILE *stream, const char *query,
+                       const struct query_error *error)
+{
+    fprintf(stream, "Error: %s\n", error->message);
+    if (!*query) return;
+    fprintf(stream, "    %s\n    ", query);
+    size_t length = strlen(query);
+    size_t end = error->end > error->start ? error->end : error->start + 1;
+    for (size_t i = 0; i < end && i < length; ++i) {
+        // Keep tabs so that the marker lines up with the query
+        char c = query[i] == '\t' ? '\t' : ' ';
+        fputc(i < error->start ? c : '^', stream);
+    }
+    if (error->start >= length) fputc('^', stream);
+    fputc('\n', stream);
 }
@@ -0,0 +1,388 @@
+/*  roaring.c
+
+    Copyright (C) 2019 Cranfield University
+
+    Author: Tomasz Kurowski <t.j.kurowski@cranfield.ac.uk>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#include "roaring.h"
+
+#include <limits.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define CHUNK_SIZE ((uint32_t)1 << ROARING_CHUNK_BITS)
+#define BITMAP_WORDS (CHUNK_SIZE / 64)
+
+/**
+ * Maximum cardinality of an array container. Beyond this point a bitmap
+ * container is smaller.
+ */
+#define ARRAY_MAX_CARDINALITY 4096
+
+/**
+ * Number of set bit indices read from a WAH bit array at a time.
+ */
+#define ITERATOR_BATCH 256
+
+static const bitarray_word WORD_MAX = (bitarray_word)~0;
+static const bitarray_word MSB = (bitarray_word)1
+                                 << (CHAR_BIT * sizeof(bitarray_word) - 1);
+static const bitarray_word ONE_FILL = (bitarray_word)1
+                                      << (CHAR_BIT * sizeof(bitarray_word) - 2);
+
+/**
+ * Rounds size up to a multiple of 8 bytes so that all containers are aligned.
+ */
+static inline size_t align_size(size_t size)
+{
+    return (size + 7) & ~(size_t)7;
+}
+
+static inline const void *container_data(const struct roaring *r,
+                                         const struct roaring_container *c)
+{
+    return (const char *)r + c->offset;
+}
+
+/**
+ * Returns the size (in bytes) of container contents, including padding.
+ */
+static inline size_t container_size(uint16_t type, uint32_t length)
+{
+    switch (type) {
+    case ROARING_ARRAY:
+        return align_size(length * sizeof(uint16_t));
+    case ROARING_BITMAP:
+        return BITMAP_WORDS * sizeof(uint64_t);
+    default:
+        return align_size(length * 2 * sizeof(uint16_t));
+    }
+}
+
+/**
+ * Selects the smallest container type for a chunk with n set bits (given as
+ * sorted offsets within the chunk) and outputs the type and container length.
+ */
+static inline void select_container(const uint16_t *values, uint32_t n,
+                                    uint16_t *type, uint32_t *length)
+{
+    uint32_t nruns = 1;
+    for (uint32_t i = 1; i < n; ++i) {
+        if (values[i] != values[i - 1] + 1) ++nruns;
+    }
+    size_t array_size = n * sizeof(uint16_t);
+    size_t run_size = nruns * 2 * sizeof(uint16_t);
+    if (run_size < array_size
+        && run_size < BITMAP_WORDS * sizeof(uint64_t)) {
+        *type = ROARING_RUN;
+        *length = nruns;
+    } else if (n <= ARRAY_MAX_CARDINALITY) {
+        *type = ROARING_ARRAY;
+        *length = n;
+    } else {
+        *type = ROARING_BITMAP;
+        *length = BITMAP_WORDS;
+    }
+}
+
+static void write_container(void *dest, uint16_t type, uint32_t length,
+                            const uint16_t *values, uint32_t n)
+{
+    memset(dest, 0, container_size(type, length));
+    if (type == ROARING_ARRAY) {
+        memcpy(dest, values, n * sizeof *values);
+    } else if (type == ROARING_BITMAP) {
+        uint64_t *words = dest;
+        for (uint32_t i = 0; i < n; ++i) {
+            words[values[i] / 64] |= (uint64_t)1 << values[i] % 64;
+        }
+    } else {
+        uint16_t *runs = dest;
+        uint32_t run = 0;
+        runs[0] = values[0];
+        for (uint32_t i = 1; i < n; ++i) {
+            if (values[i] != values[i - 1] + 1) {
+                runs[2 * run + 1] = values[i - 1] - runs[2 * run];
+                runs[2 * ++run] = values[i];
+            }
+        }
+        runs[2 * run + 1] = values[n - 1] - runs[2 * run];
+    }
+}
+
+/**
+ * Splits the set bits of a WAH bit array into chunks, outputting the number of
+ * (non-empty) containers and returning the total size of their contents.
+ * If out is not NULL, the containers are also written out. In that case the
+ * number of containers in the output needs to be set beforehand, as the
+ * container contents follow the container table.
+ */
+static size_t encode_chunks(const struct bitarray *ba, struct roaring *out,
+                            uint32_t *ncontainers)
+{
+    uint16_t *values = malloc(CHUNK_SIZE * sizeof *values);
+    uint64_t indices[ITERATOR_BATCH];
+    struct bitarray_set_iterator it;
+    init_bitarray_set_iterator(&it, ba);
+    size_t data_start = out == NULL ? 0
+                        : sizeof *out
+                          + out->ncontainers * sizeof *out->containers;
+    size_t data_size = 0;
+    uint32_t key = 0;
+    uint32_t n = 0;
+    *ncontainers = 0;
+    size_t nindices;
+    do {
+        nindices = bitarray_set_iterator_next_batch(&it, ITERATOR_BATCH,
+                                                    indices);
+        for (size_t i = 0; i <= nindices; ++i) {
+            // Flushing the current chunk on change of key and at the end
+            bool flush = i == nindices ? nindices < ITERATOR_BATCH
+                         : indices[i] >> ROARING_CHUNK_BITS != key;
+            if (flush && n) {
+                uint16_t type;
+                uint32_t length;
+                select_container(values, n, &type, &length);
+                if (out != NULL) {
+                    out->containers[*ncontainers] = (struct roaring_container) {
+                        .key = key,
+                        .type = type,
+                        .cardinality = n,
+                        .length = length,
+                        .offset = data_start + data_size
+                    };
+                    write_container((char *)out + data_start + data_size,
+                                    type, length, values, n);
+                }
+                data_size += container_size(type, length);
+                ++(*ncontainers);
+                n = 0;
+            }
+            if (i < nindices) {
+                key = indices[i] >> ROARING_CHUNK_BITS;
+                values[n++] = (uint16_t)indices[i];
+            }
+        }
+    } while (nindices == ITERATOR_BATCH);
+    free(values);
+    return data_size;
+}
+
+/**
+ * Returns the size (in bytes) of the Roaring bitmap equivalent to a bit array.
+ */
+size_t roaring_size_from_bitarray(const struct bitarray *ba)
+{
+    uint32_t ncontainers;
+    size_t data_size = encode_chunks(ba, NULL, &ncontainers);
+    return sizeof(struct roaring)
+           + ncontainers * sizeof(struct roaring_container) + data_size;
+}
+
+/**
+ * Converts a bit array representing nbits bits into a Roaring bitmap.
+ */
+void roaring_from_bitarray(const struct bitarray *ba, uint64_t nbits,
+                           struct roaring *out)
+{
+    uint32_t ncontainers;
+    encode_chunks(ba, NULL, &ncontainers);
+    out->nbits = nbits;
+    out->ncontainers = ncontainers;
+    out->reserved = 0;
+    encode_chunks(ba, out, &ncontainers);
+}
+
+/**
+ * Sequential writer of WAH bit array words, taking literal words in ascending
+ * order and filling the gaps between them with zero fill words.
+ */
+struct wah_writer {
+    bitarray_word *array;
+    size_t pos; // Position of the next word to write
+    uint64_t next_index; // Uncompressed index of the next word to write
+};
+
+/**
+ * Writes a zero fill word covering the words up to (but excluding) end_index.
+ */
+static inline void writer_fill(struct wah_writer *w, uint64_t end_index)
+{
+    if (end_index > w->next_index) {
+        w->array[w->pos++] = end_index - w->next_index - 1;
+        w->next_index = end_index;
+    }
+}
+
+/**
+ * Writes a literal word, storing it as (or adding it to) a one fill if all its
+ * bits are set.
+ */
+static inline void writer_literal(struct wah_writer *w, uint64_t index,
+                                  bitarray_word word)
+{
+    writer_fill(w, index);
+    if ((word | MSB) != WORD_MAX) {
+        w->array[w->pos++] = word | MSB;
+    } else if (w->pos
+               && (w->array[w->pos - 1] & (MSB | ONE_FILL)) == ONE_FILL) {
+        ++w->array[w->pos - 1];
+    } else {
+        w->array[w->pos++] = ONE_FILL;
+    }
+    w->next_index = index + 1;
+}
+
+/**
+ * Returns the contents of a container as a bitmap. Bitmap containers are
+ * returned directly, other containers are expanded into the buffer.
+ */
+static const uint64_t *container_bitmap(const struct roaring *r,
+                                        const struct roaring_container *c,
+                                        uint64_t *buffer)
+{
+    if (c->type == ROARING_BITMAP) {
+        return container_data(r, c);
+    }
+    const uint16_t *data = container_data(r, c);
+    memset(buffer, 0, BITMAP_WORDS * sizeof *buffer);
+    if (c->type == ROARING_ARRAY) {
+        for (uint32_t i = 0; i < c->length; ++i) {
+            buffer[data[i] / 64] |= (uint64_t)1 << data[i] % 64;
+        }
+        return buffer;
+    }
+    for (uint32_t i = 0; i < c->length; ++i) {
+        uint32_t end = (uint32_t)data[2 * i] + data[2 * i + 1];
+        for (uint32_t j = data[2 * i]; j <= end; ++j) {
+            buffer[j / 64] |= (uint64_t)1 << j % 64;
+        }
+    }
+    return buffer;
+}
+
+/**
+ * Cursor for sequential access to the chunks of a Roaring bitmap in ascending
+ * order, expanding the containers into bitmaps as needed.
+ */
+struct chunk_cursor {
+    const struct roaring *r;
+    uint32_t pos; // Position of the next container to consider
+    bool loaded;
+    uint32_t key; // Key of the loaded chunk
+    const uint64_t *words; // Bitmap of the loaded chunk, NULL if it is empty
+    uint64_t buffer[BITMAP_WORDS];
+};
+
+static const uint64_t *cursor_load_chunk(struct chunk_cursor *cur,
+                                         uint32_t key)
+{
+    if (cur->loaded && cur->key == key) return cur->words;
+    const struct roaring *r = cur->r;
+    while (cur->pos < r->ncontainers && r->containers[cur->pos].key < key) {
+        ++cur->pos;
+    }
+    cur->loaded = true;
+    cur->key = key;
+    if (cur->pos < r->ncontainers && r->containers[cur->pos].key == key) {
+        cur->words = container_bitmap(r, &r->containers[cur->pos],
+                                      cur->buffer);
+    } else {
+        cur->words = NULL;
+    }
+    return cur->words;
+}
+
+/**
+ * Returns the bit array word (without the literal flag) starting at the
+ * specified bit index. The indices need to be given in ascending order.
+ */
+static bitarray_word cursor_load_word(struct chunk_cursor *cur,
+                                      uint64_t index)
+{
+    uint32_t key = index >> ROARING_CHUNK_BITS;
+    uint32_t offset = index & (CHUNK_SIZE - 1);
+    bitarray_word word = 0;
+    const uint64_t *words = cursor_load_chunk(cur, key);
+    if (words != NULL) {
+        uint32_t shift = offset % 64;
+        word = words[offset / 64] >> shift;
+        if (shift && offset / 64 + 1 < BITMAP_WORDS) {
+            word |= words[offset / 64 + 1] << (64 - shift);
+        }
+    }
+    if (offset + bitarray_word_capacity > CHUNK_SIZE) {
+        // Word continues into the next chunk
+        words = cursor_load_chunk(cur, key + 1);
+        if (words != NULL) {
+            word |= words[0] << (CHUNK_SIZE - offset);
+        }
+    }
+    return word & ~MSB;
+}
+
+static uint64_t cardinality(const struct roaring *r)
+{
+    uint64_t count = 0;
+    for (uint32_t i = 0; i < r->ncontainers; ++i) {
+        count += r->containers[i].cardinality;
+    }
+    return count;
+}
+
+/**
+ * Converts a Roaring bitmap into a WAH bit array.
+ */
+void roaring_to_bitarray(const struct roaring *r, struct bitarray **out)
+{
+    uint64_t nwords = (r->nbits + bitarray_word_capacity - 1)
+                      / bitarray_word_capacity;
+    if (!nwords) nwords = 1;
+    // Each literal word is preceded by at most one fill word
+    uint64_t max_words = 2 * cardinality(r) + 1;
+    if (max_words > nwords) max_words = nwords;
+    *out = init_bitarray(max_words * bitarray_word_capacity);
+    struct wah_writer w = {
+        .array = (*out)->array
+    };
+    struct chunk_cursor cur = {
+        .r = r
+    };
+    uint64_t next_index = 0; // Index of the first word not yet processed
+    for (uint32_t i = 0; i < r->ncontainers; ++i) {
+        uint64_t chunk_start = (uint64_t)r->containers[i].key
+                               << ROARING_CHUNK_BITS;
+        uint64_t first = chunk_start / bitarray_word_capacity;
+        uint64_t last = (chunk_start + CHUNK_SIZE - 1)
+                        / bitarray_word_capacity;
+        if (first < next_index) first = next_index;
+        for (uint64_t j = first; j <= last && j < nwords; ++j) {
+            bitarray_word word = cursor_load_word(&cur,
+                                                  j * bitarray_word_capacity);
+            if (word) writer_literal(&w, j, word);
+        }
+        next_index = last + 1;
+    }
+    writer_fill(&w, nwords);
+    (*out)->last_word = w.pos - 1;
+    bitarray_shrinkwrap(*out);
+}
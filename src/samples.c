@@ -34,6 +34,9 @@ SOFTWARE. */
 #define NO_HEADERS      2
 static int local_flags = 0;
 
+/* Argument options without a short equivalent */
+#define MMAP_HINTS      1000
+
 static void usage(FILE *stream)
 {
     fprintf(stream,
@@ -46,6 +49,8 @@ static void usage(FILE *stream)
             "    -m, --match STR         print only samples matching a wildcard pattern\n"
             "                            (e.g. \"S.chi*\" to match all samples beginning\n"
             "                             with \"S.chi\")\n"
+            "    --mmap-hints STR        comma-separated database access hints (sequential,\n"
+            "                            random, willneed, populate, hugepages)\n"
             "    -n, --no-headers        skip column headers\n"
             "\n");
 }
@@ -56,10 +61,12 @@ error_t tersect_print_samples(int argc, char **argv)
     char *db_filename = NULL;
     char *contains = NULL;
     char *pattern = NULL;
+    int access_hints = TDB_ACCESS_DEFAULT;
     static struct option loptions[] = {
         {"contains", required_argument, NULL, 'c'},
         {"help", no_argument, NULL, 'h'},
         {"match", required_argument, NULL, 'm'},
+        {"mmap-hints", required_argument, NULL, MMAP_HINTS},
         {"no-headers", no_argument, NULL, 'n'},
         {NULL, 0, NULL, 0}
     };
@@ -75,6 +82,13 @@ error_t tersect_print_samples(int argc, char **argv)
         case 'm':
             pattern = optarg;
             break;
+        case MMAP_HINTS:
+            if (tersect_db_parse_access(optarg, &access_hints)
+                != SUCCESS) {
+                usage(stderr);
+                return E_TSI_ACCESS_HINT;
+            }
+            break;
         case 'n':
             local_flags |= NO_HEADERS;
             break;
@@ -95,7 +109,7 @@ error_t tersect_print_samples(int argc, char **argv)
         return SUCCESS;
     }
     db_filename = argv[0];
-    tersect_db *tdb = tersect_db_open(db_filename);
+    tersect_db *tdb = tersect_db_open_readonly(db_filename, access_hints);
     if (tdb == NULL) return E_TSI_NOPEN;
     size_t count;
     struct genome *samples = NULL;
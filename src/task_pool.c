@@ -0,0 +1,276 @@
+/*  task_pool.c
+
+    Copyright (C) 2019 Cranfield University
+
+    Author: Tomasz Kurowski <t.j.kurowski@cranfield.ac.uk>
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#include "task_pool.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define DEQUE_INITIAL_CAPACITY 16
+
+struct task {
+    void (*run)(void *arg);
+    void *arg;
+    struct task_group *group;
+};
+
+/**
+ * Circular buffer of tasks. The owner pushes and pops tasks at the tail, while
+ * other threads steal them from the head.
+ */
+struct task_deque {
+    pthread_mutex_t lock;
+    size_t head;
+    size_t count;
+    size_t capacity; // Power of two
+    struct task *tasks;
+};
+
+struct worker {
+    task_pool *pool;
+    size_t index;
+    pthread_t thread;
+};
+
+/**
+ * The deques of the workers are followed by the deque shared by the threads
+ * outside the pool. Sleeping threads are woken up whenever a task is submitted
+ * or finished, which is tracked by the event counter.
+ */
+struct task_pool {
+    size_t nworkers;
+    struct worker *workers;
+    struct task_deque *deques;
+    pthread_key_t self; // Index of the deque of the current thread plus one
+    pthread_mutex_t lock;
+    pthread_cond_t event;
+    uint64_t nevents;
+    bool shutdown;
+};
+
+static void deque_push(struct task_deque *deque, struct task task)
+{
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count == deque->capacity) {
+        size_t capacity = deque->capacity ? 2 * deque->capacity
+                                          : DEQUE_INITIAL_CAPACITY;
+        struct task *tasks = malloc(capacity * sizeof *tasks);
+        for (size_t i = 0; i < deque->count; ++i) {
+            tasks[i] = deque->tasks[(deque->head + i)
+                                    & (deque->capacity - 1)];
+        }
+        free(deque->tasks);
+        deque->tasks = tasks;
+        deque->capacity = capacity;
+        deque->head = 0;
+    }
+    deque->tasks[(deque->head + deque->count++)
+                 & (deque->capacity - 1)] = task;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+/**
+ * Takes a task from the tail (if owned) or the head (if stolen) of a deque.
+ */
+static bool deque_take(struct task_deque *deque, bool owned,
+                       struct task *task)
+{
+    bool found = false;
+    pthread_mutex_lock(&deque->lock);
+    if (deque->count) {
+        if (owned) {
+            *task = deque->tasks[(deque->head + --deque->count)
+                                 & (deque->capacity - 1)];
+        } else {
+            *task = deque->tasks[deque->head];
+            deque->head = (deque->head + 1) & (deque->capacity - 1);
+            --deque->count;
+        }
+        found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+static inline size_t own_deque(task_pool *pool)
+{
+    uintptr_t self = (uintptr_t)pthread_getspecific(pool->self);
+    return self ? self - 1 : pool->nworkers;
+}
+
+/**
+ * Takes a task from the deque of the current thread or, failing that, steals
+ * one from another deque.
+ */
+static bool take_task(task_pool *pool, struct task *task)
+{
+    size_t ndeques = pool->nworkers + 1;
+    size_t own = own_deque(pool);
+    if (deque_take(&pool->deques[own], true, task)) return true;
+    for (size_t i = 1; i < ndeques; ++i) {
+        if (deque_take(&pool->deques[(own + i) % ndeques], false, task)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void run_task(task_pool *pool, const struct task *task)
+{
+    task->run(task->arg);
+    pthread_mutex_lock(&pool->lock);
+    --task->group->pending;
+    ++pool->nevents;
+    pthread_cond_broadcast(&pool->event);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+static void *task_worker(void *arg)
+{
+    struct worker *worker = arg;
+    task_pool *pool = worker->pool;
+    pthread_setspecific(pool->self, (void *)(uintptr_t)(worker->index + 1));
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        uint64_t nevents = pool->nevents;
+        bool shutdown = pool->shutdown;
+        pthread_mutex_unlock(&pool->lock);
+        struct task task;
+        if (take_task(pool, &task)) {
+            run_task(pool, &task);
+            continue;
+        }
+        if (shutdown) break;
+        pthread_mutex_lock(&pool->lock);
+        while (pool->nevents == nevents && !pool->shutdown) {
+            pthread_cond_wait(&pool->event, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+    return NULL;
+}
+
+/**
+ * Starts a pool of nworkers threads. Returns NULL if the threads could not be
+ * started.
+ */
+task_pool *init_task_pool(size_t nworkers)
+{
+    task_pool *pool = malloc(sizeof *pool);
+    *pool = (task_pool) {
+        .nworkers = nworkers,
+        .workers = malloc(nworkers * sizeof *pool->workers),
+        .deques = calloc(nworkers + 1, sizeof *pool->deques)
+    };
+    for (size_t i = 0; i <= nworkers; ++i) {
+        pthread_mutex_init(&pool->deques[i].lock, NULL);
+    }
+    pthread_key_create(&pool->self, NULL);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->event, NULL);
+    for (size_t i = 0; i < nworkers; ++i) {
+        pool->workers[i] = (struct worker) {
+            .pool = pool,
+            .index = i
+        };
+        if (pthread_create(&pool->workers[i].thread, NULL, task_worker,
+                           &pool->workers[i])) {
+            pool->nworkers = i;
+            free_task_pool(pool);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+/**
+ * Queues a task on the deque of the current thread.
+ */
+void task_pool_submit(task_pool *pool, struct task_group *group,
+                      void (*run)(void *arg), void *arg)
+{
+    pthread_mutex_lock(&pool->lock);
+    ++group->pending;
+    pthread_mutex_unlock(&pool->lock);
+    deque_push(&pool->deques[own_deque(pool)], (struct task) {
+        .run = run,
+        .arg = arg,
+        .group = group
+    });
+    pthread_mutex_lock(&pool->lock);
+    ++pool->nevents;
+    pthread_cond_broadcast(&pool->event);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * Waits for all the tasks of a group to finish, running queued tasks (of any
+ * group) in the meantime.
+ */
+void task_pool_wait(task_pool *pool, struct task_group *group)
+{
+    for (;;) {
+        pthread_mutex_lock(&pool->lock);
+        uint64_t nevents = pool->nevents;
+        bool finished = !group->pending;
+        pthread_mutex_unlock(&pool->lock);
+        if (finished) break;
+        struct task task;
+        if (take_task(pool, &task)) {
+            run_task(pool, &task);
+            continue;
+        }
+        pthread_mutex_lock(&pool->lock);
+        while (pool->nevents == nevents) {
+            pthread_cond_wait(&pool->event, &pool->lock);
+        }
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+/**
+ * Stops the workers once all queued tasks have been run and frees the pool.
+ */
+void free_task_pool(task_pool *pool)
+{
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = true;
+    pthread_cond_broadcast(&pool->event);
+    pthread_mutex_unlock(&pool->lock);
+    for (size_t i = 0; i < pool->nworkers; ++i) {
+        pthread_join(pool->workers[i].thread, NULL);
+    }
+    for (size_t i = 0; i <= pool->nworkers; ++i) {
+        pthread_mutex_destroy(&pool->deques[i].lock);
+        free(pool->deques[i].tasks);
+    }
+    pthread_cond_destroy(&pool->event);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_key_delete(pool->self);
+    free(pool->deques);
+    free(pool->workers);
+    free(pool);
+}
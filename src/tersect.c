@@ -30,6 +30,7 @@ SOFTWARE. */
 #include "chroms.h"
 #include "samples.h"
 #include "distance.h"
+#include "freq.h"
 #include "rename.h"
 #include "version.h"
 
@@ -49,6 +50,7 @@ static void usage(FILE *stream)
             "    build       build new VCF database\n"
             "    chroms      list chromosomes in the database\n"
             "    dist        calculate distance matrix for samples\n"
+            "    freq        count samples carrying each variant\n"
             "    help        print this help message\n"
             "    rename      rename sample\n"
             "    samples     list samples in the database\n"
@@ -78,6 +80,8 @@ int main(int argc, char *argv[])
         rc = tersect_print_samples(argc, argv);
     } else if (!strcmp(command, "dist")) {
         rc = tersect_distance(argc, argv);
+    } else if (!strcmp(command, "freq")) {
+        rc = tersect_allele_frequency(argc, argv);
     } else if (!strcmp(command, "help")) {
         usage(stdout);
     } else {
@@ -22,16 +22,23 @@ LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
 OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 SOFTWARE. */
 
+// Exposes Linux mapping extensions (MAP_POPULATE, MADV_HUGEPAGE)
+#define _DEFAULT_SOURCE
+
 #include "tersect_db.h"
 #include "tersect_db_internal.h"
 
+#include "roaring.h"
 #include "snv.h"
 #include "version.h"
 #include "vcf_writer.h"
 
+#include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
@@ -41,6 +48,11 @@ SOFTWARE. */
 #define PAGE_SIZE 4096
 #define INITIAL_DB_SIZE 4096
 
+// Address space initially reserved for the mapping of a writable database
+#define DB_RESERVATION ((size_t)1 << 30)
+// Limit on how much a database file is extended at once
+#define MAX_DB_GROWTH ((size_t)1 << 28)
+
 /* Types used for queries */
 #define QUERY_SINGLE_MATCH    0   // Selecting only a single element (exact match)
 #define QUERY_WILDCARD_MATCH  1   // Selecting multiple elements
@@ -49,6 +61,61 @@ SOFTWARE. */
 // Capacity of sequence hashmap used during database build
 #define SEQUENCE_MAP_CAPACITY 50000000
 
+// Number of bit array words between skip index entries
+#define SKIP_INDEX_INTERVAL 64
+
+// Number of variants between position index entries
+#define POSITION_INDEX_INTERVAL 64
+
+// Initial capacity of the cache of decoded Roaring bit arrays
+#define DECODED_INITIAL_CAPACITY 64
+
+// Minimum capacity of name directories, which are kept at most half full
+#define DIRECTORY_MIN_CAPACITY 64
+
+/* First minor format versions supporting specific features */
+#define FORMAT_SKIP_INDEX     3
+#define FORMAT_ENCODING       4
+#define FORMAT_WEIGHT         6
+#define FORMAT_DIRECTORY      7
+#define FORMAT_BITARRAY_TABLE 8
+#define FORMAT_POSITION_INDEX 9
+
+/**
+ * Bit array decoded from the Roaring encoding, along with its skip index.
+ */
+struct decoded_bitarray {
+    tdb_offset hdr; // Offset of the bit array header, zero for empty slots
+    struct bitarray *ba;
+    struct bitarray_skip_index *skip_index;
+};
+
+/**
+ * Open addressing hash table of decoded bit arrays, keyed by header offset.
+ * Roaring bit arrays are decoded into WAH on first access and kept until the
+ * database is closed. The lock allows queries to be evaluated by several
+ * threads at once.
+ */
+struct decoded_bitarrays {
+    size_t capacity; // Power of two
+    size_t count;
+    struct decoded_bitarray *entries;
+    pthread_mutex_t lock;
+};
+
+/**
+ * Returns the minor version number of a database format string, e.g. 2 for
+ * "TersectDB 0.2", or 0 if it cannot be parsed.
+ */
+static inline unsigned int parse_format_version(const char *format)
+{
+    unsigned int version;
+    if (sscanf(format, "TersectDB 0.%u", &version) != 1) {
+        return 0;
+    }
+    return version;
+}
+
 /**
  * Initialize header in new file. Note that the file size was already set by
  * tersect_db_resize_file.
@@ -58,32 +125,47 @@ SOFTWARE. */
 static error_t tersect_db_init_header(tersect_db *tdb)
 {
     strcpy(tdb->hdr->format, TERSECT_FORMAT_VERSION);
+    tdb->format_version = parse_format_version(TERSECT_FORMAT_VERSION);
     tdb->hdr->free_head = sizeof *tdb->hdr;
     tdb->hdr->chromosome_count = 0;
     tdb->hdr->chromosomes = 0;
     tdb->hdr->genome_count = 0;
     tdb->hdr->genomes = 0;
     tdb->hdr->word_size = CHAR_BIT * sizeof(bitarray_word);
+    for (int i = 0; i < DIRECTORY_COUNT; ++i) {
+        tdb->hdr->directories[i] = 0;
+    }
     return SUCCESS;
 }
 
+/**
+ * Sets the size of a writable database file. The file is mapped with address
+ * space reserved past its end so that extending it only requires remapping
+ * once the reservation is exhausted, with the reservation then doubled.
+ */
 error_t tersect_db_resize_file(tersect_db *tdb, off_t new_size)
 {
-    if ((void *)tdb->mapping != NULL) {
-        // Removing previous mapping
-        munmap((void *)tdb->mapping, tdb->hdr->db_size);
-    }
-    int fd;
-    if ((fd = open(tdb->filename, O_RDWR | O_CREAT, 0664)) == -1) return FAILURE;
-    if (ftruncate(fd, new_size)) return FAILURE;
-    tdb->mapping = (uintptr_t)mmap(NULL, new_size, PROT_READ | PROT_WRITE,
-                                   MAP_SHARED, fd, 0);
-    if ((void *)tdb->mapping == MAP_FAILED) return FAILURE;
-    if (close(fd) == -1) {
-        munmap((void *)tdb->mapping, new_size);
-        return FAILURE;
+    if (ftruncate(tdb->fd, new_size)) return FAILURE;
+    if ((size_t)new_size > tdb->reserved) {
+        size_t reserved = tdb->reserved ? tdb->reserved : DB_RESERVATION;
+        while (reserved < (size_t)new_size) reserved *= 2;
+        void *mapping = mmap(NULL, reserved, PROT_READ | PROT_WRITE,
+                             MAP_SHARED, tdb->fd, 0);
+        if (mapping == MAP_FAILED) {
+            // Address space could not be reserved, mapping only the file
+            reserved = new_size;
+            mapping = mmap(NULL, reserved, PROT_READ | PROT_WRITE,
+                           MAP_SHARED, tdb->fd, 0);
+            if (mapping == MAP_FAILED) return FAILURE;
+        }
+        if ((void *)tdb->mapping != NULL) {
+            // Removing previous mapping
+            munmap((void *)tdb->mapping, tdb->reserved);
+        }
+        tdb->mapping = (uintptr_t)mapping;
+        tdb->reserved = reserved;
+        tdb->hdr = (struct tersect_db_hdr *)tdb->mapping;
     }
-    tdb->hdr = (struct tersect_db_hdr *)tdb->mapping;
     tdb->hdr->db_size = new_size;
     return SUCCESS;
 }
@@ -91,10 +173,15 @@ error_t tersect_db_resize_file(tersect_db *tdb, off_t new_size)
 static tdb_offset tersect_db_malloc(tersect_db *tdb, size_t size)
 {
     if (tdb->hdr->free_head + size >= tdb->hdr->db_size) {
-        // Rounded up
+        // Grown geometrically (up to MAX_DB_GROWTH at once), rounded up to
+        // whole pages. The file is trimmed when the database is closed.
         size_t page_num = (tdb->hdr->free_head + size + PAGE_SIZE - 1)
                           / PAGE_SIZE;
-        if (tersect_db_resize_file(tdb, page_num * PAGE_SIZE)) return 0;
+        size_t new_size = tdb->hdr->db_size
+                          + (tdb->hdr->db_size < MAX_DB_GROWTH
+                             ? tdb->hdr->db_size : MAX_DB_GROWTH);
+        if (new_size < page_num * PAGE_SIZE) new_size = page_num * PAGE_SIZE;
+        if (tersect_db_resize_file(tdb, new_size)) return 0;
     }
     tdb_offset offset = tdb->hdr->free_head;
     tdb->hdr->free_head += size;
@@ -102,8 +189,171 @@ static tdb_offset tersect_db_malloc(tersect_db *tdb, size_t size)
 }
 
 /**
- * Verifies file existence and write permissions. Adds .tsi extension if not
- * present. Allocates memory for the output.
+ * 64-bit FNV-1a hash of a name. Hashes are stored in name directories, so
+ * this must not change without a new format version.
+ */
+static uint64_t name_hash(const char *name)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (; *name; ++name) {
+        hash ^= (unsigned char)*name;
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static inline const char *header_name(const tersect_db *tdb, tdb_offset hdr)
+{
+    return (const char *)(tdb->mapping + *(tdb_offset *)(tdb->mapping + hdr));
+}
+
+static struct name_directory *alloc_directory(uint64_t capacity)
+{
+    struct name_directory *dir = calloc(1, sizeof *dir
+                                           + capacity * sizeof *dir->slots);
+    if (dir != NULL) {
+        dir->capacity = capacity;
+    }
+    return dir;
+}
+
+static void directory_place(struct name_directory *dir,
+                            const struct name_slot *slot)
+{
+    uint64_t mask = dir->capacity - 1;
+    uint64_t i = slot->hash & mask;
+    while (dir->slots[i].hdr) {
+        i = (i + 1) & mask;
+    }
+    dir->slots[i] = *slot;
+    ++dir->count;
+}
+
+/**
+ * Removes a slot from a directory, moving later slots of the same probe
+ * sequence back so that no lookup ends early at the freed slot.
+ */
+static void directory_remove(struct name_directory *dir,
+                             struct name_slot *slot)
+{
+    uint64_t mask = dir->capacity - 1;
+    uint64_t hole = slot - dir->slots;
+    for (uint64_t i = (hole + 1) & mask; dir->slots[i].hdr;
+         i = (i + 1) & mask) {
+        uint64_t home = dir->slots[i].hash & mask;
+        // Slots whose home lies cyclically within (hole, i] stay in place
+        bool stays = hole < i ? home > hole && home <= i
+                              : home > hole || home <= i;
+        if (!stays) {
+            dir->slots[hole] = dir->slots[i];
+            hole = i;
+        }
+    }
+    dir->slots[hole] = (struct name_slot) { 0 };
+    --dir->count;
+}
+
+/**
+ * Adds a name to a directory held in memory, doubling its capacity when it
+ * would become more than half full.
+ */
+static void directory_insert(struct name_directory **dir, const char *name,
+                             tdb_offset hdr, uint64_t ordinal)
+{
+    if (2 * ((*dir)->count + 1) > (*dir)->capacity) {
+        struct name_directory *grown = alloc_directory(2 * (*dir)->capacity);
+        for (uint64_t i = 0; i < (*dir)->capacity; ++i) {
+            if ((*dir)->slots[i].hdr) {
+                directory_place(grown, &(*dir)->slots[i]);
+            }
+        }
+        free(*dir);
+        *dir = grown;
+    }
+    directory_place(*dir, &(struct name_slot) {
+        .hash = name_hash(name),
+        .hdr = hdr,
+        .ordinal = ordinal
+    });
+}
+
+/**
+ * Builds a name directory in memory out of the list of chromosome or genome
+ * headers, which starts with the most recently added one.
+ */
+static struct name_directory *build_directory(const tersect_db *tdb, int kind)
+{
+    uint64_t count = kind == DIRECTORY_GENOMES ? tdb->hdr->genome_count
+                                               : tdb->hdr->chromosome_count;
+    uint64_t capacity = DIRECTORY_MIN_CAPACITY;
+    while (capacity < 2 * count) {
+        capacity *= 2;
+    }
+    struct name_directory *dir = alloc_directory(capacity);
+    if (dir == NULL) return NULL;
+    tdb_offset offset = kind == DIRECTORY_GENOMES ? tdb->hdr->genomes
+                                                  : tdb->hdr->chromosomes;
+    for (uint64_t ordinal = count; offset && ordinal; --ordinal) {
+        directory_place(dir, &(struct name_slot) {
+            .hash = name_hash(header_name(tdb, offset)),
+            .hdr = offset,
+            .ordinal = ordinal - 1
+        });
+        if (kind == DIRECTORY_GENOMES) {
+            offset = ((struct genome_hdr *)(tdb->mapping + offset))->next;
+        } else {
+            offset = ((struct chrom_hdr *)(tdb->mapping + offset))->next;
+        }
+    }
+    return dir;
+}
+
+/**
+ * Stores a name directory held in memory in the database file.
+ */
+static void store_directory(tersect_db *tdb, int kind,
+                            const struct name_directory *dir)
+{
+    size_t size = sizeof *dir + dir->capacity * sizeof *dir->slots;
+    tdb_offset offset = tersect_db_malloc(tdb, size + 7);
+    offset = (offset + 7) & ~(tdb_offset)7; // The mapping is page-aligned
+    memcpy((void *)(tdb->mapping + offset), dir, size);
+    tdb->hdr->directories[kind] = offset;
+}
+
+static inline struct name_directory *get_directory(const tersect_db *tdb,
+                                                   int kind)
+{
+    if (tdb->directories[kind] != NULL) {
+        return tdb->directories[kind];
+    }
+    return (struct name_directory *)(tdb->mapping
+                                     + tdb->hdr->directories[kind]);
+}
+
+/**
+ * Finds the directory slot of a chromosome or genome by name. Returns NULL if
+ * not found.
+ */
+static struct name_slot *find_name(const tersect_db *tdb, int kind,
+                                   const char *name)
+{
+    struct name_directory *dir = get_directory(tdb, kind);
+    uint64_t hash = name_hash(name);
+    uint64_t mask = dir->capacity - 1;
+    for (uint64_t i = hash & mask; dir->slots[i].hdr; i = (i + 1) & mask) {
+        if (dir->slots[i].hash == hash
+            && !strcmp(header_name(tdb, dir->slots[i].hdr), name)) {
+            return &dir->slots[i];
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Verifies file existence and write permissions, unless the file is opened
+ * read-only. Adds .tsi extension if not present. Allocates memory for the
+ * output.
  */
 static inline error_t validate_filename(const char *filename, int flags,
                                         char **output_filename)
@@ -121,6 +371,7 @@ static inline error_t validate_filename(const char *filename, int flags,
         if (*output_filename == NULL) return E_ALLOC;
         sprintf(*output_filename, "%s.tsi", filename);
     }
+    if (flags & TDB_READONLY) return SUCCESS;
     if (access(*output_filename, F_OK) == 0) {
         if (flags & TDB_FORCE) {
             if (access(*output_filename, W_OK) == -1) {
@@ -139,6 +390,15 @@ cleanup:
     return rc;
 }
 
+static struct decoded_bitarrays *init_decoded_bitarrays(void)
+{
+    struct decoded_bitarrays *cache = calloc(1, sizeof *cache);
+    if (cache != NULL) {
+        pthread_mutex_init(&cache->lock, NULL);
+    }
+    return cache;
+}
+
 error_t tersect_db_create(const char *filename, int flags, tersect_db **tdb)
 {
     error_t rc = SUCCESS;
@@ -150,43 +410,110 @@ error_t tersect_db_create(const char *filename, int flags, tersect_db **tdb)
     if (!(*tdb)) return E_BUILD_CREATE;
     **tdb = (tersect_db) {
         .mapping = 0,
-        .sequences = init_hashmap(SEQUENCE_MAP_CAPACITY)
+        .fd = -1,
+        .sequences = init_hashmap(SEQUENCE_MAP_CAPACITY),
+        .decoded = init_decoded_bitarrays()
     };
+    // Name directories are written to the file once the database is built
+    for (int i = 0; i < DIRECTORY_COUNT; ++i) {
+        (*tdb)->directories[i] = alloc_directory(DIRECTORY_MIN_CAPACITY);
+    }
     rc = validate_filename(filename, flags, &(*tdb)->filename);
     if (rc != SUCCESS) {
         goto cleanup_1;
     }
-    if (tersect_db_resize_file(*tdb, size)) goto cleanup_2;
-    if (tersect_db_init_header(*tdb)) goto cleanup_2;
+    (*tdb)->fd = open((*tdb)->filename, O_RDWR | O_CREAT, 0664);
+    if ((*tdb)->fd == -1) {
+        rc = E_BUILD_CREATE;
+        goto cleanup_2;
+    }
+    if (tersect_db_resize_file(*tdb, size)) {
+        rc = E_BUILD_CREATE;
+        goto cleanup_3;
+    }
+    if (tersect_db_init_header(*tdb)) goto cleanup_3;
     return rc;
+cleanup_3:
+    close((*tdb)->fd);
 cleanup_2:
     free((*tdb)->filename);
 cleanup_1:
     free_hashmap((*tdb)->sequences);
+    free((*tdb)->decoded);
+    for (int i = 0; i < DIRECTORY_COUNT; ++i) {
+        free((*tdb)->directories[i]);
+    }
     free(*tdb);
     return rc;
 }
 
-tersect_db *tersect_db_open(const char *filename)
+/**
+ * Applies memory access hints to a newly mapped database. These are advisory
+ * only, so failures and hints unsupported by the platform are ignored.
+ */
+static void advise_mapping(void *mapping, size_t size, int hints)
+{
+    if (hints & TDB_ACCESS_SEQUENTIAL) {
+        posix_madvise(mapping, size, POSIX_MADV_SEQUENTIAL);
+    } else if (hints & TDB_ACCESS_RANDOM) {
+        posix_madvise(mapping, size, POSIX_MADV_RANDOM);
+    }
+    if (hints & TDB_ACCESS_WILLNEED) {
+        posix_madvise(mapping, size, POSIX_MADV_WILLNEED);
+    }
+#ifdef MADV_HUGEPAGE
+    if (hints & TDB_ACCESS_HUGEPAGES) {
+        madvise(mapping, size, MADV_HUGEPAGE);
+    }
+#endif
+}
+
+static tersect_db *open_database(const char *filename, bool writable,
+                                 int hints)
 {
     tersect_db *tdb = malloc(sizeof *tdb);
     if (!tdb) return NULL;
     *tdb = (tersect_db) {
         .mapping = 0,
-        .sequences = NULL
+        .fd = -1,
+        .sequences = NULL,
+        .decoded = init_decoded_bitarrays()
     };
-    if (validate_filename(filename, TDB_FORCE, &tdb->filename) != SUCCESS) {
+    if (!tdb->decoded) goto cleanup_1;
+    if (validate_filename(filename, writable ? TDB_FORCE : TDB_READONLY,
+                          &tdb->filename) != SUCCESS) {
         goto cleanup_1;
     }
     int fd;
-    if ((fd = open(tdb->filename, O_RDWR, 0664)) == -1) goto cleanup_2;
+    if ((fd = open(tdb->filename, writable ? O_RDWR : O_RDONLY)) == -1) {
+        goto cleanup_2;
+    }
     struct stat st;
     if (fstat(fd, &st) == -1) goto cleanup_3;
-    tdb->mapping = (uintptr_t)mmap(NULL, st.st_size, PROT_READ | PROT_WRITE,
-                              MAP_SHARED, fd, 0);
+    int prot = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    int flags = MAP_SHARED;
+#ifdef MAP_POPULATE
+    if (hints & TDB_ACCESS_POPULATE) flags |= MAP_POPULATE;
+#endif
+    tdb->reserved = st.st_size;
+    tdb->mapping = (uintptr_t)mmap(NULL, tdb->reserved, prot, flags, fd, 0);
     if ((void *)tdb->mapping == MAP_FAILED) goto cleanup_3;
-    if (close(fd) == -1) goto cleanup_4;
+    if (writable) {
+        // Kept open for the file to be extended
+        tdb->fd = fd;
+    } else if (close(fd) == -1) {
+        goto cleanup_4;
+    }
+    advise_mapping((void *)tdb->mapping, tdb->reserved, hints);
     tdb->hdr = (struct tersect_db_hdr *)tdb->mapping;
+    tdb->format_version = parse_format_version(tdb->hdr->format);
+    for (int i = 0; i < DIRECTORY_COUNT; ++i) {
+        if (tdb->format_version < FORMAT_DIRECTORY
+            || !tdb->hdr->directories[i]) {
+            // Older files have no name directories, they are rebuilt
+            tdb->directories[i] = build_directory(tdb, i);
+        }
+    }
     return tdb;
 cleanup_4:
     munmap((void *)tdb->mapping, st.st_size);
@@ -195,13 +522,90 @@ cleanup_3:
 cleanup_2:
     free(tdb->filename);
 cleanup_1:
+    free(tdb->decoded);
     free(tdb);
     return NULL;
 }
 
+tersect_db *tersect_db_open(const char *filename)
+{
+    return open_database(filename, true, TDB_ACCESS_DEFAULT);
+}
+
+tersect_db *tersect_db_open_readonly(const char *filename, int hints)
+{
+    return open_database(filename, false, hints);
+}
+
+static const struct {
+    const char *name;
+    int flag;
+} hint_names[] = {
+    { "default", TDB_ACCESS_DEFAULT },
+    { "sequential", TDB_ACCESS_SEQUENTIAL },
+    { "random", TDB_ACCESS_RANDOM },
+    { "willneed", TDB_ACCESS_WILLNEED },
+    { "populate", TDB_ACCESS_POPULATE },
+    { "hugepages", TDB_ACCESS_HUGEPAGES }
+};
+
+error_t tersect_db_parse_access(const char *names, int *hints)
+{
+    *hints = TDB_ACCESS_DEFAULT;
+    const char *hint = names;
+    while (*hint) {
+        size_t length = strcspn(hint, ",");
+        size_t i, nhints = sizeof(hint_names) / sizeof(hint_names[0]);
+        for (i = 0; i < nhints; ++i) {
+            if (strlen(hint_names[i].name) == length
+                && !strncmp(hint, hint_names[i].name, length)) break;
+        }
+        if (i == nhints) return E_TSI_ACCESS_HINT;
+        *hints |= hint_names[i].flag;
+        hint += length;
+        if (*hint == ',') ++hint;
+    }
+    if ((*hints & TDB_ACCESS_SEQUENTIAL) && (*hints & TDB_ACCESS_RANDOM)) {
+        return E_TSI_ACCESS_HINT;
+    }
+    return SUCCESS;
+}
+
+static void free_decoded_bitarrays(struct decoded_bitarrays *cache)
+{
+    if (cache == NULL) return;
+    for (size_t i = 0; i < cache->capacity; ++i) {
+        if (cache->entries[i].hdr) {
+            free_bitarray(cache->entries[i].ba);
+            free(cache->entries[i].skip_index);
+        }
+    }
+    free(cache->entries);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache);
+}
+
 void tersect_db_close(tersect_db *tdb)
 {
-    munmap((void *)tdb->mapping, tdb->hdr->db_size);
+    if (tdb->sequences != NULL) {
+        // Newly built database
+        for (int i = 0; i < DIRECTORY_COUNT; ++i) {
+            store_directory(tdb, i, tdb->directories[i]);
+        }
+    }
+    for (int i = 0; i < DIRECTORY_COUNT; ++i) {
+        free(tdb->directories[i]);
+    }
+    if (tdb->fd != -1) {
+        // Trimming the file to the space actually allocated, a failure only
+        // leaves unused space at its end
+        if (ftruncate(tdb->fd, tdb->hdr->free_head) == 0) {
+            tdb->hdr->db_size = tdb->hdr->free_head;
+        }
+        close(tdb->fd);
+    }
+    munmap((void *)tdb->mapping, tdb->reserved);
+    free_decoded_bitarrays(tdb->decoded);
     if (tdb->sequences != NULL) {
         // Free allelic sequences
         HashIterator it = hashmap_iterator(tdb->sequences);
@@ -247,22 +651,29 @@ static tdb_offset tersect_db_add_raw_bitarray(tersect_db *tdb,
     return offset;
 }
 
+/**
+ * Add a bit array to the database in the Roaring encoding. The array is
+ * padded so that the containers are 8-byte aligned.
+ */
+static tdb_offset tersect_db_add_roaring(tersect_db *tdb,
+                                         const struct bitarray *ba,
+                                         uint64_t nbits, size_t size)
+{
+    tdb_offset offset = tersect_db_malloc(tdb, size + 7);
+    offset = (offset + 7) & ~(tdb_offset)7; // The mapping is page-aligned
+    roaring_from_bitarray(ba, nbits, (struct roaring *)(tdb->mapping + offset));
+    return offset;
+}
+
 /**
  * Finds genome header by name. Returns NULL if not found.
  */
 static struct genome_hdr *tersect_db_find_genome(const tersect_db *tdb,
                                                  const char *genome)
 {
-    tdb_offset offset = tdb->hdr->genomes;
-    while (offset) {
-        struct genome_hdr *gen_hdr = (struct genome_hdr *)(tdb->mapping
-                                                           + offset);
-        if (!strcmp((char *)(tdb->mapping + gen_hdr->name), genome)) {
-            return (struct genome_hdr *)(tdb->mapping + offset);
-        }
-        offset = gen_hdr->next;
-    }
-    return NULL;
+    struct name_slot *slot = find_name(tdb, DIRECTORY_GENOMES, genome);
+    if (slot == NULL) return NULL;
+    return (struct genome_hdr *)(tdb->mapping + slot->hdr);
 }
 
 /**
@@ -271,26 +682,29 @@ static struct genome_hdr *tersect_db_find_genome(const tersect_db *tdb,
 static struct chrom_hdr *tersect_db_find_chromosome(const tersect_db *tdb,
                                                     const char *chromosome)
 {
-    tdb_offset offset = tdb->hdr->chromosomes;
-    while (offset) {
-        struct chrom_hdr *chr_hdr = (struct chrom_hdr *)(tdb->mapping + offset);
-        if (!strcmp((char *)(tdb->mapping + chr_hdr->name), chromosome)) {
-            return (struct chrom_hdr *)(tdb->mapping + offset);
-        }
-        offset = chr_hdr->next;
-    }
-    return NULL;
+    struct name_slot *slot = find_name(tdb, DIRECTORY_CHROMOSOMES, chromosome);
+    if (slot == NULL) return NULL;
+    return (struct chrom_hdr *)(tdb->mapping + slot->hdr);
 }
 
 /**
- * Finds bitarray by genome name and chromosome. Returns NULL if not found.
+ * Finds bitarray by genome and chromosome. Returns NULL if not found.
  */
 static struct bitarray_hdr *tersect_db_find_bitarray(const tersect_db *tdb,
                                                      const struct genome *gen,
                                                      const struct chromosome *chr)
 {
-    tdb_offset genome_offset = (uintptr_t)tersect_db_find_genome(tdb, gen->name)
-                               - tdb->mapping;
+    tdb_offset genome_offset = (uintptr_t)gen->hdr - tdb->mapping;
+    if (tdb->format_version >= FORMAT_BITARRAY_TABLE
+        && gen->ordinal < chr->hdr->table_size) {
+        struct bitarray_hdr *ba_hdr = (struct bitarray_hdr *)(tdb->mapping
+                                          + chr->hdr->bitarray_table)
+                                      + gen->ordinal;
+        if (ba_hdr->genome_offset == genome_offset) {
+            return ba_hdr;
+        }
+    }
+    // Older databases only link the bit arrays of each chromosome in a list
     tdb_offset offset = chr->hdr->bitarrays;
     while (offset) {
         struct bitarray_hdr *ba_hdr = (struct bitarray_hdr *)(tdb->mapping
@@ -338,26 +752,145 @@ error_t tersect_db_insert_allele(tersect_db *tdb, const struct allele *allele,
     return SUCCESS;
 }
 
+/**
+ * Add a skip index for a bit array to the database. Returns zero (no index)
+ * for arrays too short to benefit from one.
+ */
+static tdb_offset tersect_db_add_skip_index(tersect_db *tdb,
+                                            const struct bitarray *ba)
+{
+    if (ba->size <= SKIP_INDEX_INTERVAL) return 0;
+    size_t size = bitarray_skip_index_size(ba, SKIP_INDEX_INTERVAL);
+    tdb_offset offset = tersect_db_malloc(tdb, size);
+    bitarray_build_skip_index(ba, SKIP_INDEX_INTERVAL,
+                              (struct bitarray_skip_index *)(tdb->mapping
+                                                             + offset));
+    return offset;
+}
+
 void tersect_db_add_bitarray(tersect_db *tdb, const char *genome,
                              const char *chromosome,
-                             const struct bitarray *ba)
+                             const struct bitarray *ba,
+                             int encoding)
 {
-    tdb_offset array_offset = tersect_db_add_raw_bitarray(tdb, ba);
-    tdb_offset ba_offset = tersect_db_malloc(tdb, sizeof(struct bitarray_hdr));
-    tdb_offset genome_offset = (uintptr_t)tersect_db_find_genome(tdb, genome)
-                               - tdb->mapping;
+    size_t size;
+    tdb_offset array_offset;
+    tdb_offset skip_offset = 0;
+    struct bitarray *compacted = NULL;
+    if (encoding != TDB_ENCODING_ROARING) {
+        // Runs of full words are stored as one fills
+        compacted = bitarray_compact(ba);
+    }
+    if (encoding == TDB_ENCODING_AUTO) {
+        // Smaller of the two encodings, counting the WAH skip index
+        size_t wah_size = compacted->size * sizeof(bitarray_word);
+        if (compacted->size > SKIP_INDEX_INTERVAL) {
+            wah_size += bitarray_skip_index_size(compacted,
+                                                 SKIP_INDEX_INTERVAL);
+        }
+        encoding = roaring_size_from_bitarray(ba) < wah_size
+                   ? TDB_ENCODING_ROARING : TDB_ENCODING_WAH;
+    }
+    if (encoding == TDB_ENCODING_ROARING) {
+        uint32_t nbits = tersect_db_find_chromosome(tdb,
+                                                    chromosome)->variant_count;
+        size = roaring_size_from_bitarray(ba);
+        array_offset = tersect_db_add_roaring(tdb, ba, nbits, size);
+    } else {
+        ba = compacted;
+        size = ba->size;
+        array_offset = tersect_db_add_raw_bitarray(tdb, ba);
+        skip_offset = tersect_db_add_skip_index(tdb, ba);
+    }
+    const struct name_slot *gen_slot = find_name(tdb, DIRECTORY_GENOMES,
+                                                 genome);
+    tdb_offset genome_offset = gen_slot->hdr;
+    struct chrom_hdr *chr_hdr = tersect_db_find_chromosome(tdb, chromosome);
+    tdb_offset ba_offset;
+    if (gen_slot->ordinal < chr_hdr->table_size) {
+        ba_offset = chr_hdr->bitarray_table
+                    + gen_slot->ordinal * sizeof(struct bitarray_hdr);
+    } else {
+        // Genome added after the chromosome
+        ba_offset = tersect_db_malloc(tdb, sizeof(struct bitarray_hdr));
+        chr_hdr = tersect_db_find_chromosome(tdb, chromosome);
+    }
     struct bitarray_hdr *ba_hdr = (struct bitarray_hdr *)(tdb->mapping
                                                           + ba_offset);
-    struct chrom_hdr *chr_hdr = tersect_db_find_chromosome(tdb, chromosome);
     *ba_hdr = (struct bitarray_hdr) {
         .genome_offset = genome_offset,
-        .size = ba->size,
+        .size = size,
         .array = array_offset,
-        .start_mask = ba->start_mask,
-        .end_mask = ba->end_mask,
-        .next = chr_hdr->bitarrays
+        .start_mask = encoding == TDB_ENCODING_ROARING ? 0 : ba->start_mask,
+        .end_mask = encoding == TDB_ENCODING_ROARING ? 0 : ba->end_mask,
+        .next = chr_hdr->bitarrays,
+        .skip_index = skip_offset,
+        .encoding = encoding,
+        .weight = bitarray_weight(ba)
     };
     chr_hdr->bitarrays = ba_offset;
+    if (compacted != NULL) {
+        free_bitarray(compacted);
+    }
+}
+
+/**
+ * Returns the cache slot for a bit array header offset, which is either the
+ * slot holding the decoded bit array or the empty slot where it belongs.
+ */
+static struct decoded_bitarray *find_decoded_slot(struct decoded_bitarrays
+                                                  *cache, tdb_offset hdr)
+{
+    size_t i = (size_t)((hdr * 0x9e3779b97f4a7c15) >> 32)
+               & (cache->capacity - 1);
+    while (cache->entries[i].hdr && cache->entries[i].hdr != hdr) {
+        i = (i + 1) & (cache->capacity - 1);
+    }
+    return &cache->entries[i];
+}
+
+static void grow_decoded_bitarrays(struct decoded_bitarrays *cache)
+{
+    struct decoded_bitarray *old_entries = cache->entries;
+    size_t old_capacity = cache->capacity;
+    cache->capacity = old_capacity ? 2 * old_capacity
+                                   : DECODED_INITIAL_CAPACITY;
+    cache->entries = calloc(cache->capacity, sizeof *cache->entries);
+    for (size_t i = 0; i < old_capacity; ++i) {
+        if (old_entries[i].hdr) {
+            *find_decoded_slot(cache, old_entries[i].hdr) = old_entries[i];
+        }
+    }
+    free(old_entries);
+}
+
+/**
+ * Returns the WAH version of a Roaring bit array, decoding it if necessary.
+ */
+static const struct decoded_bitarray *decode_bitarray(const tersect_db *tdb,
+                                                      const struct bitarray_hdr
+                                                      *ba_hdr)
+{
+    struct decoded_bitarrays *cache = tdb->decoded;
+    tdb_offset hdr = (uintptr_t)ba_hdr - tdb->mapping;
+    if (2 * (cache->count + 1) > cache->capacity) {
+        grow_decoded_bitarrays(cache);
+    }
+    struct decoded_bitarray *slot = find_decoded_slot(cache, hdr);
+    if (slot->hdr) return slot;
+    *slot = (struct decoded_bitarray) {
+        .hdr = hdr
+    };
+    roaring_to_bitarray((const struct roaring *)(tdb->mapping + ba_hdr->array),
+                        &slot->ba);
+    if (slot->ba->size > SKIP_INDEX_INTERVAL) {
+        size_t size = bitarray_skip_index_size(slot->ba, SKIP_INDEX_INTERVAL);
+        slot->skip_index = malloc(size);
+        bitarray_build_skip_index(slot->ba, SKIP_INDEX_INTERVAL,
+                                  slot->skip_index);
+    }
+    ++cache->count;
+    return slot;
 }
 
 void tersect_db_get_bitarray(const tersect_db *tdb,
@@ -366,12 +899,192 @@ void tersect_db_get_bitarray(const tersect_db *tdb,
                              struct bitarray *output)
 {
     struct bitarray_hdr *ba_hdr = tersect_db_find_bitarray(tdb, gen, chr);
+    if (tdb->format_version >= FORMAT_ENCODING
+        && ba_hdr->encoding == TDB_ENCODING_ROARING) {
+        pthread_mutex_lock(&tdb->decoded->lock);
+        const struct decoded_bitarray *decoded = decode_bitarray(tdb, ba_hdr);
+        *output = *decoded->ba;
+        output->capacity = 0; // Storage owned by the cache
+        output->skip_index = decoded->skip_index;
+        pthread_mutex_unlock(&tdb->decoded->lock);
+        return;
+    }
     *output = (struct bitarray) {
         .size = ba_hdr->size,
         .array = (bitarray_word *)(tdb->mapping + ba_hdr->array),
         .start_mask = ba_hdr->start_mask,
-        .end_mask = ba_hdr->end_mask
+        .end_mask = ba_hdr->end_mask,
+        .start_bits = ~(bitarray_word)0,
+        .end_bits = ~(bitarray_word)0
     };
+    // Older databases use a shorter bit array header without the skip index
+    if (tdb->format_version >= FORMAT_SKIP_INDEX && ba_hdr->skip_index) {
+        output->skip_index = (struct bitarray_skip_index *)(tdb->mapping
+                                                         + ba_hdr->skip_index);
+    }
+}
+
+/**
+ * Returns true if the database records the number of bits set in each of its
+ * bit arrays.
+ */
+bool tersect_db_has_weights(const tersect_db *tdb)
+{
+    return tdb->format_version >= FORMAT_WEIGHT;
+}
+
+/**
+ * Genome header offset paired with the index of the genome in a list.
+ */
+struct genome_index {
+    tdb_offset offset;
+    size_t index;
+};
+
+static int genome_index_cmp(const void *a, const void *b)
+{
+    tdb_offset x = ((const struct genome_index *)a)->offset;
+    tdb_offset y = ((const struct genome_index *)b)->offset;
+    return (x > y) - (x < y);
+}
+
+/**
+ * Sums the statistics of the bit arrays of each of a list of genomes in a
+ * single pass over the bit arrays of each chromosome. Weights are only set if
+ * recorded in the database (see tersect_db_has_weights).
+ */
+void tersect_db_get_genome_stats(const tersect_db *tdb, size_t ngenomes,
+                                 const struct genome *genomes,
+                                 struct genome_stats *stats)
+{
+    struct genome_index *sorted = malloc(ngenomes * sizeof *sorted);
+    for (size_t i = 0; i < ngenomes; ++i) {
+        sorted[i] = (struct genome_index) {
+            .offset = (uintptr_t)genomes[i].hdr - tdb->mapping,
+            .index = i
+        };
+        stats[i] = (struct genome_stats) { 0 };
+    }
+    qsort(sorted, ngenomes, sizeof *sorted, genome_index_cmp);
+    tdb_offset chr_offset = tdb->hdr->chromosomes;
+    while (chr_offset) {
+        struct chrom_hdr *chr_hdr = (struct chrom_hdr *)(tdb->mapping
+                                                         + chr_offset);
+        tdb_offset offset = chr_hdr->bitarrays;
+        while (offset) {
+            struct bitarray_hdr *ba_hdr = (struct bitarray_hdr *)(tdb->mapping
+                                                                  + offset);
+            struct genome_index key = { .offset = ba_hdr->genome_offset };
+            struct genome_index *found = bsearch(&key, sorted, ngenomes,
+                                                 sizeof *sorted,
+                                                 genome_index_cmp);
+            // The same genome may appear more than once in the list
+            while (found != NULL && found > sorted
+                   && found[-1].offset == key.offset) {
+                --found;
+            }
+            for (; found != NULL && found < sorted + ngenomes
+                   && found->offset == key.offset; ++found) {
+                struct genome_stats *st = &stats[found->index];
+                if (tdb->format_version >= FORMAT_ENCODING
+                    && ba_hdr->encoding == TDB_ENCODING_ROARING) {
+                    st->size += ba_hdr->size;
+                } else {
+                    st->size += ba_hdr->size * sizeof(bitarray_word);
+                }
+                if (tdb->format_version >= FORMAT_WEIGHT) {
+                    st->weight += ba_hdr->weight;
+                }
+            }
+            offset = ba_hdr->next;
+        }
+        chr_offset = chr_hdr->next;
+    }
+    free(sorted);
+}
+
+/**
+ * Fills a position index in Eytzinger order through an in-order traversal
+ * starting at entry k. Returns the rank of the next sample to be placed.
+ */
+static uint32_t fill_position_index(struct position_sample *index,
+                                    uint32_t nsamples,
+                                    const struct variant *variants,
+                                    uint32_t rank, uint32_t k)
+{
+    if (k > nsamples) return rank;
+    rank = fill_position_index(index, nsamples, variants, rank, 2 * k);
+    index[k] = (struct position_sample) {
+        .position = variants[rank * POSITION_INDEX_INTERVAL].position,
+        .rank = rank
+    };
+    return fill_position_index(index, nsamples, variants, rank + 1,
+                               2 * k + 1);
+}
+
+/**
+ * Add the position index of a chromosome to the database.
+ */
+static tdb_offset tersect_db_add_position_index(tersect_db *tdb,
+                                                uint32_t variant_count,
+                                                const struct variant *variants,
+                                                uint32_t *nsamples)
+{
+    *nsamples = (variant_count + POSITION_INDEX_INTERVAL - 1)
+                / POSITION_INDEX_INTERVAL;
+    size_t size = (*nsamples + 1) * sizeof(struct position_sample);
+    tdb_offset offset = tersect_db_malloc(tdb, size + 7);
+    offset = (offset + 7) & ~(tdb_offset)7;
+    struct position_sample *index = (struct position_sample *)(tdb->mapping
+                                                               + offset);
+    index[0] = (struct position_sample) { 0 }; // Unused
+    fill_position_index(index, *nsamples, variants, 0, 1);
+    return offset;
+}
+
+/**
+ * Finds the index of the first variant of a chromosome at or after a
+ * position, or the variant count if there is none. The position index, if
+ * present, narrows the search down to the variants between two samples.
+ */
+static uint32_t find_variant(const tersect_db *tdb,
+                             const struct chromosome *chrom,
+                             uint64_t position)
+{
+    uint32_t lo = 0;
+    uint32_t hi = chrom->variant_count;
+    if (tdb->format_version >= FORMAT_POSITION_INDEX
+        && chrom->hdr->index_size) {
+        const struct position_sample *index = (struct position_sample *)
+            (tdb->mapping + chrom->hdr->position_index);
+        uint32_t nsamples = chrom->hdr->index_size;
+        uint32_t k = 1;
+        while (k <= nsamples) {
+            k = 2 * k + (index[k].position < position);
+        }
+        // Undoing the right turns taken after the last left one
+        while (k & 1) {
+            k >>= 1;
+        }
+        k >>= 1;
+        // First sample at or after the position
+        uint32_t rank = k ? index[k].rank : nsamples;
+        if (rank) {
+            lo = (rank - 1) * chrom->hdr->index_interval + 1;
+        }
+        if (rank < nsamples) {
+            hi = rank * chrom->hdr->index_interval;
+        }
+    }
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (chrom->variants[mid].position < position) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
 }
 
 void tersect_db_add_chromosome(tersect_db *tdb,
@@ -383,6 +1096,16 @@ void tersect_db_add_chromosome(tersect_db *tdb,
     tdb_offset name_offset = tersect_db_add_string(tdb, chr_name);
     tdb_offset var_offset = tersect_db_add_variants(tdb, variant_count,
                                                     variants);
+    uint32_t index_size;
+    tdb_offset index_offset = tersect_db_add_position_index(tdb, variant_count,
+                                                            variants,
+                                                            &index_size);
+    // Bit array headers of the genomes added so far, filled in later
+    uint32_t table_size = tdb->hdr->genome_count;
+    size_t table_bytes = table_size * sizeof(struct bitarray_hdr);
+    tdb_offset table_offset = tersect_db_malloc(tdb, table_bytes + 7);
+    table_offset = (table_offset + 7) & ~(tdb_offset)7;
+    memset((void *)(tdb->mapping + table_offset), 0, table_bytes);
     tdb_offset chr_offset = tersect_db_malloc(tdb, sizeof(struct chrom_hdr));
     struct chrom_hdr *chr_hdr = (struct chrom_hdr *)(tdb->mapping + chr_offset);
     *chr_hdr = (struct chrom_hdr) {
@@ -390,9 +1113,16 @@ void tersect_db_add_chromosome(tersect_db *tdb,
         .variants = var_offset,
         .variant_count = variant_count,
         .length = length ? length : variants[variant_count - 1].position,
-        .next = tdb->hdr->chromosomes
+        .next = tdb->hdr->chromosomes,
+        .bitarray_table = table_offset,
+        .table_size = table_size,
+        .index_interval = POSITION_INDEX_INTERVAL,
+        .index_size = index_size,
+        .position_index = index_offset
     };
     tdb->hdr->chromosomes = chr_offset;
+    directory_insert(&tdb->directories[DIRECTORY_CHROMOSOMES], chr_name,
+                     chr_offset, tdb->hdr->chromosome_count);
     ++tdb->hdr->chromosome_count;
 }
 
@@ -407,6 +1137,8 @@ void tersect_db_add_genome(tersect_db *tdb, const char *genome_name)
         .next = tdb->hdr->genomes
     };
     tdb->hdr->genomes = genome_offset;
+    directory_insert(&tdb->directories[DIRECTORY_GENOMES], genome_name,
+                     genome_offset, tdb->hdr->genome_count);
     ++tdb->hdr->genome_count;
 }
 
@@ -558,7 +1290,7 @@ error_t parse_contains_queries(const tersect_db *tdb,
         };
         struct tersect_db_interval ti;
         tersect_db_get_interval(tdb, &gi, &ti);
-        if (ti.interval.start_index > ti.interval.end_index) {
+        if (ti.nvariants == 0) {
             // site not found
             rc = E_PARSE_ALLELE_UNKNOWN;
             goto cleanup;
@@ -566,7 +1298,8 @@ error_t parse_contains_queries(const tersect_db *tdb,
         // Checking all variants on the same position
         for (size_t j = ti.interval.start_index;
              j <= ti.interval.end_index; ++j) {
-            if (variant.type == ti.chromosome.variants[j].type) {
+            if (ti.chromosome.variants[j].position == variant.position
+                && variant.type == ti.chromosome.variants[j].type) {
                 // Found variant
                 (*variant_index)[*nvars] = j;
                 (*out_intervals)[*nvars] = ti;
@@ -668,7 +1401,8 @@ error_t tersect_db_get_genomes(const tersect_db *tdb,
         char *genome_name = (char *)(tdb->mapping + gen_hdr->name);
         (*genomes)[*ngenomes] = (struct genome) {
             .name = genome_name,
-            .hdr = gen_hdr
+            .hdr = gen_hdr,
+            .ordinal = tdb->hdr->genome_count - 1 - i // List is newest first
         };
         if ((nmatch == 0 || matches_any_pattern(genome_name, matches, nmatch))
             && contains_all_variants(tdb, &(*genomes)[*ngenomes], vars_index,
@@ -732,28 +1466,26 @@ bool tersect_db_contains_chromosome(const tersect_db *tdb, const char *name)
     return tersect_db_find_chromosome(tdb, name) != NULL;
 }
 
+/**
+ * Finds the variants of a genomic interval. An interval without variants has
+ * nvariants set to zero, with both indices at the first variant following it.
+ */
 void tersect_db_get_interval(const tersect_db *tdb,
                              const struct genomic_interval *gi,
                              struct tersect_db_interval *ti)
 {
     tersect_db_get_chromosome(tdb, gi->chromosome, &ti->chromosome);
-    // TODO: binary search instead of linear search for interval boundaries
-    for (uint32_t i = 0; i < ti->chromosome.variant_count; ++i) {
-        if (ti->chromosome.variants[i].position >= gi->start_base) {
-            ti->interval.start_index = i;
-            break;
-        }
-    }
-    for (uint32_t i = ti->chromosome.variant_count; i > 0; --i) {
-        if (ti->chromosome.variants[i - 1].position <= gi->end_base) {
-            ti->interval.end_index = i - 1;
-            break;
-        }
+    uint32_t start = find_variant(tdb, &ti->chromosome, gi->start_base);
+    uint32_t end = find_variant(tdb, &ti->chromosome,
+                                (uint64_t)gi->end_base + 1);
+    if (end < start) {
+        end = start;
     }
-    ti->nvariants = 1 + ti->interval.end_index - ti->interval.start_index;
+    ti->interval.start_index = start;
+    ti->interval.end_index = end > start ? end - 1 : start;
+    ti->nvariants = end - start;
     // Rounding down to word index
-    ti->variants = &ti->chromosome.variants[(ti->interval.start_index
-                                             / bitarray_word_capacity)
+    ti->variants = &ti->chromosome.variants[(start / bitarray_word_capacity)
                                             * bitarray_word_capacity];
 }
 
@@ -766,54 +1498,28 @@ void tersect_db_get_bin_intervals(const tersect_db *tdb,
     struct chromosome chrom;
     tersect_db_get_chromosome(tdb, gi->chromosome, &chrom);
 
-    uint32_t region_size = gi->end_base - gi->start_base + 1;
+    uint64_t region_size = (uint64_t)gi->end_base - gi->start_base + 1;
     *nbins = (region_size + bin_size - 1) / bin_size;
     *bins = calloc(*nbins, sizeof **bins);
+
+    // Each bin ends where the next one starts
+    uint32_t start = find_variant(tdb, &chrom, gi->start_base);
     for (size_t i = 0; i < *nbins; ++i) {
         (*bins)[i].chromosome = chrom;
-    }
-
-    // Finding the first bin
-    for (uint32_t i = 0; i < chrom.variant_count; ++i) {
-        if (chrom.variants[i].position < gi->start_base) continue;
-        (*bins)[0].interval.start_index = i;
-        (*bins)[0].variants = &chrom.variants[(i / bitarray_word_capacity)
-                                              * bitarray_word_capacity];
-        (*bins)[0].nvariants = 1;
-        break;
-    }
-    size_t prev_bin = 0;
-
-    // Went through all variants without finding bin
-    if (!(*bins)[0].nvariants) return;
-
-    // Finding further bins
-    for (uint32_t i = (*bins)[0].interval.start_index + 1;
-         i < chrom.variant_count; ++i) {
-        if (chrom.variants[i].position > gi->end_base) {
-            // Close last bin
-            (*bins)[prev_bin].interval.end_index = i - 1;
-            break;
-        }
-        size_t bin = (chrom.variants[i].position - gi->start_base) / bin_size;
-        if (bin != prev_bin) {
-            // Close previous bin
-            (*bins)[prev_bin].interval.end_index = i - 1;
-            if (prev_bin + 1 == *nbins) {
-                // Closed last bin, we're done here
-                break;
-            }
-            // Start next bin
-            (*bins)[bin].interval.start_index = i;
-            (*bins)[bin].variants = &chrom.variants[(i / bitarray_word_capacity)
-                                                    * bitarray_word_capacity];
-            prev_bin = bin;
+        uint64_t bin_end = gi->start_base + (i + 1) * (uint64_t)bin_size;
+        if (bin_end > (uint64_t)gi->end_base + 1) {
+            bin_end = (uint64_t)gi->end_base + 1;
+        }
+        uint32_t end = find_variant(tdb, &chrom, bin_end);
+        if (end > start) {
+            (*bins)[i].interval.start_index = start;
+            (*bins)[i].interval.end_index = end - 1;
+            (*bins)[i].nvariants = end - start;
+            (*bins)[i].variants = &chrom.variants[(start
+                                                   / bitarray_word_capacity)
+                                                  * bitarray_word_capacity];
+            start = end;
         }
-        ++((*bins)[bin].nvariants);
-    }
-    if ((*bins)[prev_bin].interval.end_index == 0) {
-        // Last bin was not closed since the last variant was still within it
-        (*bins)[prev_bin].interval.end_index = chrom.variant_count - 1;
     }
 }
 
@@ -826,7 +1532,13 @@ error_t tersect_db_rename_genome(tersect_db *tdb, const char *old_name,
     }
     tdb_offset new_name_offset = tersect_db_add_string(tdb, new_name);
     // Have to find genome header again as adding the string can update mapping
-    gen_hdr = tersect_db_find_genome(tdb, old_name);
+    struct name_slot *slot = find_name(tdb, DIRECTORY_GENOMES, old_name);
+    struct name_slot renamed = *slot;
+    renamed.hash = name_hash(new_name);
+    struct name_directory *dir = get_directory(tdb, DIRECTORY_GENOMES);
+    directory_remove(dir, slot);
+    directory_place(dir, &renamed);
+    gen_hdr = (struct genome_hdr *)(tdb->mapping + renamed.hdr);
     gen_hdr->name = new_name_offset;
     return SUCCESS;
 }
@@ -896,6 +1608,19 @@ error_t tersect_db_parse_regions(const tersect_db *tdb, size_t nregions,
     return rc;
 }
 
+error_t tersect_db_parse_bin_size(const char *str, uint32_t *bin_size)
+{
+    char *end;
+    errno = 0;
+    long long size = strtoll(str, &end, 10);
+    if (end == str || *end != '\0' || errno == ERANGE
+        || size <= 0 || size > UINT32_MAX) {
+        return E_PARSE_BIN_SIZE;
+    }
+    *bin_size = size;
+    return SUCCESS;
+}
+
 /**
  * Returns all regions (covering entire chromosomes) in the database.
  */
@@ -31,13 +31,28 @@ SOFTWARE. */
 
 typedef uint64_t tdb_offset;
 
+/* Name directories of a database */
+#define DIRECTORY_GENOMES       0
+#define DIRECTORY_CHROMOSOMES   1
+#define DIRECTORY_COUNT         2
+
+struct decoded_bitarrays;
+struct name_directory;
+
 struct tersect_db {
     char *filename;
     HashMap *sequences;
     uintptr_t mapping;
+    size_t reserved; // Length of the mapping, may extend past the end of file
+    int fd; // Kept open while the database is writable, -1 otherwise
     struct tersect_db_hdr *hdr;
+    unsigned int format_version; // Minor version of the file format
+    struct decoded_bitarrays *decoded; // Cache of decoded Roaring bit arrays
+    // Name directories kept in memory, NULL for those stored in the file
+    struct name_directory *directories[DIRECTORY_COUNT];
 };
 
+// The name must be the first field of chromosome and genome headers
 struct chrom_hdr {
     tdb_offset name;
     tdb_offset variants;
@@ -45,6 +60,23 @@ struct chrom_hdr {
     uint32_t variant_count;
     uint32_t length;
     tdb_offset next;
+    // Since TersectDB 0.8, bit array headers indexed by genome ordinal
+    tdb_offset bitarray_table;
+    uint32_t table_size;
+    // Since TersectDB 0.9, sampled variant positions (see position_sample)
+    uint32_t index_interval;
+    uint32_t index_size;
+    tdb_offset position_index;
+};
+
+/**
+ * Entry of a position index, which samples the position of every n-th
+ * variant of a chromosome. Entries are stored in Eytzinger (breadth-first)
+ * order from index 1, the children of entry k being 2k and 2k + 1.
+ */
+struct position_sample {
+    uint32_t position;
+    uint32_t rank; // Index of the sample in position order
 };
 
 struct genome_hdr {
@@ -61,15 +93,39 @@ struct tersect_db_hdr {
     tdb_offset genomes;
     uint32_t genome_count;
     tdb_offset free_head;
+    tdb_offset directories[DIRECTORY_COUNT]; // Since TersectDB 0.7
+};
+
+/**
+ * Slot of a name directory. Empty slots have a zero header offset. Ordinals
+ * number chromosomes and genomes in the order they were added, from zero.
+ */
+struct name_slot {
+    uint64_t hash;
+    tdb_offset hdr;
+    uint64_t ordinal;
+};
+
+/**
+ * Open addressing (linear probing) hash table mapping the names of genomes or
+ * chromosomes to their headers. The capacity is a power of two.
+ */
+struct name_directory {
+    uint64_t capacity;
+    uint64_t count;
+    struct name_slot slots[];
 };
 
 struct bitarray_hdr {
     tdb_offset genome_offset;
-    size_t size;
+    size_t size; // In words for WAH, in bytes for Roaring bit arrays
     tdb_offset array;
     bitarray_word start_mask;
     bitarray_word end_mask;
     tdb_offset next;
+    tdb_offset skip_index; // Since TersectDB 0.3, zero if not present
+    uint32_t encoding; // Since TersectDB 0.4, TDB_ENCODING_WAH in older files
+    uint64_t weight; // Since TersectDB 0.6, number of bits set
 };
 
 struct variant {
@@ -27,8 +27,12 @@ SOFTWARE. */
 #include "tersect_db_internal.h"
 #include "version.h"
 
+#include <inttypes.h>
 #include <stdlib.h>
 
+// Number of set bit indices retrieved from a bit array at a time
+#define VCF_PRINT_BATCH 256
+
 /**
  * Format strings for printing out variants as VCF lines.
  * The positions in the array correspond to codes defined in snv.h.
@@ -41,26 +45,27 @@ SOFTWARE. */
  * ALT      (string)    alternate base, only one character for SNVs
  * QUAL     (float)     quality, not used by tersect (".")
  * FILTER   (string)    filter status, not used by tersect (".")
- * INFO     (string)    additional information, not used by tersect (".")
+ * INFO     (string)    additional information, only used by tersect when
+ *                      reporting allele counts (otherwise ".")
  */
 const char * const variant_format[] = {
-    "%s\t%u\t.\t%s\t.\t.\t.\n",     // 0    non-SNV variant
-    "%s\t%u\t.\tA\tC\t.\t.\t.\n",   // 1    SNV_A_C
-    "%s\t%u\t.\tA\tG\t.\t.\t.\n",   // 2    SNV_A_G
-    "%s\t%u\t.\tA\tT\t.\t.\t.\n",   // 3    SNV_A_T
-    "%s\t%u\t.\tC\tA\t.\t.\t.\n",   // 4    SNV_C_A
-    "%s\t%u\t.\tC\tG\t.\t.\t.\n",   // 5    SNV_C_G
-    "%s\t%u\t.\tC\tT\t.\t.\t.\n",   // 6    SNV_C_T
-    "%s\t%u\t.\tG\tA\t.\t.\t.\n",   // 7    SNV_G_A
-    "%s\t%u\t.\tG\tC\t.\t.\t.\n",   // 8    SNV_G_C
-    "%s\t%u\t.\tG\tT\t.\t.\t.\n",   // 9    SNV_G_T
-    "%s\t%u\t.\tT\tA\t.\t.\t.\n",   // 10   SNV_T_A
-    "%s\t%u\t.\tT\tC\t.\t.\t.\n",   // 11   SNV_T_C
-    "%s\t%u\t.\tT\tG\t.\t.\t.\n",   // 12   SNV_T_G
+    "%s\t%u\t.\t%s\t.\t.\t%s\n",     // 0    non-SNV variant
+    "%s\t%u\t.\tA\tC\t.\t.\t%s\n",   // 1    SNV_A_C
+    "%s\t%u\t.\tA\tG\t.\t.\t%s\n",   // 2    SNV_A_G
+    "%s\t%u\t.\tA\tT\t.\t.\t%s\n",   // 3    SNV_A_T
+    "%s\t%u\t.\tC\tA\t.\t.\t%s\n",   // 4    SNV_C_A
+    "%s\t%u\t.\tC\tG\t.\t.\t%s\n",   // 5    SNV_C_G
+    "%s\t%u\t.\tC\tT\t.\t.\t%s\n",   // 6    SNV_C_T
+    "%s\t%u\t.\tG\tA\t.\t.\t%s\n",   // 7    SNV_G_A
+    "%s\t%u\t.\tG\tC\t.\t.\t%s\n",   // 8    SNV_G_C
+    "%s\t%u\t.\tG\tT\t.\t.\t%s\n",   // 9    SNV_G_T
+    "%s\t%u\t.\tT\tA\t.\t.\t%s\n",   // 10   SNV_T_A
+    "%s\t%u\t.\tT\tC\t.\t.\t%s\n",   // 11   SNV_T_C
+    "%s\t%u\t.\tT\tG\t.\t.\t%s\n",   // 12   SNV_T_G
 };
 
-void vcf_print_header(const char *command, size_t nregions,
-                      char **region_strings)
+static void print_metadata(const char *command, size_t nregions,
+                           char **region_strings)
 {
     printf("##fileformat="VCF_FORMAT"\n");
     printf("##tersectVersion="TERSECT_VERSION"\n");
@@ -73,30 +78,72 @@ void vcf_print_header(const char *command, size_t nregions,
         }
         printf("\n");
     }
+}
+
+void vcf_print_header(const char *command, size_t nregions,
+                      char **region_strings)
+{
+    print_metadata(command, nregions, region_strings);
+    printf("#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\n");
+}
+
+void vcf_print_count_header(const char *command, size_t nregions,
+                            char **region_strings)
+{
+    print_metadata(command, nregions, region_strings);
+    printf("##INFO=<ID=AC,Number=A,Type=Integer,Description="
+           "\"Number of selected samples carrying the variant\">\n");
+    printf("##INFO=<ID=AF,Number=A,Type=Float,Description="
+           "\"Fraction of selected samples carrying the variant\">\n");
     printf("#CHROM\tPOS\tID\tREF\tALT\tQUAL\tFILTER\tINFO\n");
 }
 
-static inline void print_snv(const tersect_db *tdb, const struct variant v,
-                             const char *chr_name)
+static inline void print_snv(FILE *stream, const tersect_db *tdb,
+                             const struct variant v, const char *chr_name,
+                             const char *info)
 {
     if (v.type) {
         // SNV
-        printf(variant_format[v.type], chr_name, v.position);
+        fprintf(stream, variant_format[v.type], chr_name, v.position, info);
     } else {
         // InDel
-        printf(variant_format[0], chr_name, v.position,
-               (char *)(tdb->mapping + v.allele));
+        fprintf(stream, variant_format[0], chr_name, v.position,
+                (char *)(tdb->mapping + v.allele), info);
     }
 }
 
-void vcf_print_bitarray(const tersect_db *tdb, const struct bitarray *ba,
+void vcf_print_bitarray(FILE *stream, const tersect_db *tdb,
+                        const struct bitarray *ba,
                         const struct tersect_db_interval *ti)
 {
-    size_t allele_num;
-    size_t *allele_indices;
-    bitarray_get_set_indices(ba, &allele_num, &allele_indices);
-    for (size_t i = 0; i < allele_num; ++i) {
-        print_snv(tdb, ti->variants[allele_indices[i]], ti->chromosome.name);
-    }
-    free(allele_indices); // Allocated by bitarray_get_set_indices
+    struct bitarray_set_iterator it;
+    init_bitarray_set_iterator(&it, ba);
+    uint64_t indices[VCF_PRINT_BATCH];
+    size_t n;
+    do {
+        n = bitarray_set_iterator_next_batch(&it, VCF_PRINT_BATCH, indices);
+        for (size_t i = 0; i < n; ++i) {
+            print_snv(stream, tdb, ti->variants[indices[i]],
+                      ti->chromosome.name, ".");
+        }
+    } while (n == VCF_PRINT_BATCH);
+}
+
+void vcf_print_counts(const tersect_db *tdb, ba_count_it *it,
+                      uint64_t nsamples, const struct tersect_db_interval *ti)
+{
+    uint64_t indices[VCF_PRINT_BATCH];
+    uint64_t counts[VCF_PRINT_BATCH];
+    char info[64];
+    size_t n;
+    do {
+        n = bitarray_count_iterator_next_batch(it, VCF_PRINT_BATCH,
+                                               indices, counts);
+        for (size_t i = 0; i < n; ++i) {
+            snprintf(info, sizeof info, "AC=%"PRIu64";AF=%.4g", counts[i],
+                     nsamples ? (double)counts[i] / nsamples : 0.0);
+            print_snv(stdout, tdb, ti->variants[indices[i]],
+                      ti->chromosome.name, info);
+        }
+    } while (n == VCF_PRINT_BATCH);
 }
@@ -25,28 +25,194 @@ SOFTWARE. */
 #include "view.h"
 
 #include "ast.h"
+#include "explain.h"
+#include "optimizer.h"
 #include "query.h"
+#include "task_pool.h"
 #include "tersect_db.h"
 #include "vcf_writer.h"
 
 #include <getopt.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 
 /* Local flags for view */
 #define NO_HEADERS      2
+#define COUNT_ONLY      4
+#define NO_OPTIMIZE     8
+#define EXPLAIN         16
+#define ANALYZE         32
+#define JSON_OUTPUT     64
 static int local_flags = 0;
 
+/* Argument options without a short equivalent */
+#define NO_OPTIMIZE_OPTION  1000
+#define EXPLAIN_OPTION      1001
+#define ANALYZE_OPTION      1002
+#define JSON_OPTION         1003
+#define MMAP_HINTS_OPTION   1004
+
+// Regions evaluated ahead of the output, per thread
+#define REGIONS_PER_THREAD  4
+
 static void usage(FILE *stream)
 {
     fprintf(stream,
             "\n"
             "Usage:    tersect view [options] <db.tsi> <query> [region]...\n\n"
             "Options:\n"
+            "    -B, --bin-size INT      size of bins into which each region is split\n"
+            "                            (requires --count)\n"
+            "    -c, --count             print the number of variants in each region\n"
+            "                            instead of the variants themselves\n"
+            "        --analyze           evaluate each step of the query separately and\n"
+            "                            print its statistics for each region\n"
+            "        --explain           print the steps the query is evaluated in\n"
             "    -h, --help              print this help message\n"
+            "        --json              print --explain/--analyze output as JSON\n"
+            "        --mmap-hints STR    comma-separated database access hints (sequential,\n"
+            "                            random, willneed, populate, hugepages)\n"
             "    -n, --no-header         skip VCF header\n"
+            "        --no-optimize       evaluate the query exactly as written\n"
+            "    -t, --threads INT       number of threads evaluating the query [1]\n"
             "\n");
 }
 
+static inline void print_count(FILE *stream, const char *chromosome,
+                               uint32_t start_base, uint32_t end_base,
+                               uint64_t count)
+{
+    fprintf(stream, "%s\t%"PRIu32"\t%"PRIu32"\t%"PRIu64"\n",
+            chromosome, start_base, end_base, count);
+}
+
+static void print_bin_counts(FILE *stream, const tersect_db *tdb,
+                             struct ast_node *command,
+                             const struct genomic_interval *region,
+                             const struct tersect_db_interval *ti,
+                             uint32_t bin_size)
+{
+    size_t nbins;
+    struct tersect_db_interval *bins;
+    tersect_db_get_bin_intervals(tdb, region, bin_size, &nbins, &bins);
+    uint64_t *counts = malloc(nbins * sizeof *counts);
+    count_ast_bins(command, tdb, ti, nbins, bins, counts);
+    for (size_t i = 0; i < nbins; ++i) {
+        uint64_t start_base = region->start_base + (uint64_t)i * bin_size;
+        uint64_t end_base = start_base + bin_size - 1;
+        if (end_base > region->end_base) {
+            end_base = region->end_base;
+        }
+        print_count(stream, region->chromosome, start_base, end_base,
+                    counts[i]);
+    }
+    free(counts);
+    free(bins);
+}
+
+/**
+ * Evaluates a query over a region, printing either the resulting variants or
+ * their count (in bins if bin_size is non-zero).
+ */
+static void view_region(FILE *stream, const tersect_db *tdb,
+                        struct ast_node *command,
+                        const struct genomic_interval *region,
+                        uint32_t bin_size)
+{
+    struct tersect_db_interval ti;
+    tersect_db_get_interval(tdb, region, &ti);
+    if (local_flags & COUNT_ONLY) {
+        if (bin_size) {
+            print_bin_counts(stream, tdb, command, region, &ti, bin_size);
+        } else {
+            uint64_t count = ti.nvariants ? count_ast(command, tdb, &ti) : 0;
+            print_count(stream, region->chromosome, region->start_base,
+                        region->end_base, count);
+        }
+        return;
+    }
+    if (!ti.nvariants) return;
+    struct bitarray *result = eval_ast(command, tdb, &ti);
+    if (result == NULL) return;
+    vcf_print_bitarray(stream, tdb, result, &ti);
+    release_ast_result(command, result);
+}
+
+/**
+ * Region evaluated as a task, its output held until the output of all the
+ * preceding regions has been printed.
+ */
+struct region_task {
+    const tersect_db *tdb;
+    struct ast_node *command;
+    const struct genomic_interval *region;
+    uint32_t bin_size;
+    char *output;
+    size_t size;
+    struct task_group group;
+};
+
+static void run_region_task(void *arg)
+{
+    struct region_task *task = arg;
+    FILE *stream = open_memstream(&task->output, &task->size);
+    view_region(stream, task->tdb, task->command, task->region,
+                task->bin_size);
+    fclose(stream);
+}
+
+/**
+ * Evaluates regions on a pool of threads, which also evaluate independent
+ * parts of the query over each region in parallel. The output of each region
+ * is printed as soon as that of all the preceding ones has been, so that it is
+ * identical to that of evaluating the regions one after another. At most
+ * REGIONS_PER_THREAD regions per thread are in flight, limiting how much
+ * output is held in memory.
+ */
+static error_t view_regions_parallel(const tersect_db *tdb,
+                                     struct ast_node *command,
+                                     size_t nregions,
+                                     const struct genomic_interval *regions,
+                                     uint32_t bin_size, size_t nthreads)
+{
+    // The calling thread evaluates regions while waiting for their output
+    task_pool *pool = init_task_pool(nthreads - 1);
+    if (pool == NULL) return E_VIEW_THREADS;
+    prepare_ast(command, pool);
+    // Tasks of the regions in flight, reused in order as a ring
+    size_t window = nthreads * REGIONS_PER_THREAD;
+    if (window > nregions) window = nregions;
+    struct region_task *tasks = malloc(window * sizeof *tasks);
+    if (tasks == NULL && window) {
+        free_task_pool(pool);
+        return E_ALLOC;
+    }
+    for (size_t i = 0; i < nregions + window; ++i) {
+        struct region_task *task = &tasks[i % window];
+        if (i >= window) {
+            // Printing the oldest region in flight to free its task
+            task_pool_wait(pool, &task->group);
+            fwrite(task->output, 1, task->size, stdout);
+            free(task->output);
+        }
+        if (i < nregions) {
+            *task = (struct region_task) {
+                .tdb = tdb,
+                .command = command,
+                .region = &regions[i],
+                .bin_size = bin_size
+            };
+            task_pool_submit(pool, &task->group, run_region_task, task);
+        }
+    }
+    free(tasks);
+    free_task_pool(pool);
+    return SUCCESS;
+}
+
 error_t tersect_view_set(int argc, char **argv)
 {
     error_t rc = SUCCESS;
@@ -54,20 +220,64 @@ error_t tersect_view_set(int argc, char **argv)
     char *query = NULL;
     char **region_strings = NULL;
     size_t nregions = 0;
+    bool binning = false;
+    uint32_t bin_size = 0;
+    long nthreads = 1;
+    int access_hints = TDB_ACCESS_DEFAULT;
     static struct option loptions[] = {
+        {"bin-size", required_argument, NULL, 'B'},
+        {"count", no_argument, NULL, 'c'},
         {"help", no_argument, NULL, 'h'},
+        {"mmap-hints", required_argument, NULL, MMAP_HINTS_OPTION},
         {"no-headers", no_argument, NULL, 'n'},
+        {"no-optimize", no_argument, NULL, NO_OPTIMIZE_OPTION},
+        {"explain", no_argument, NULL, EXPLAIN_OPTION},
+        {"analyze", no_argument, NULL, ANALYZE_OPTION},
+        {"json", no_argument, NULL, JSON_OPTION},
+        {"threads", required_argument, NULL, 't'},
         {NULL, 0, NULL, 0}
     };
     int c;
-    while ((c = getopt_long(argc, argv, ":hn", loptions, NULL)) != -1) {
+    while ((c = getopt_long(argc, argv, ":B:chnt:", loptions, NULL)) != -1) {
         switch(c) {
+        case 'B':
+            binning = true;
+            if (tersect_db_parse_bin_size(optarg, &bin_size) != SUCCESS) {
+                usage(stderr);
+                return E_PARSE_BIN_SIZE;
+            }
+            break;
+        case 'c':
+            local_flags |= COUNT_ONLY;
+            break;
         case 'h':
             usage(stdout);
             return SUCCESS;
         case 'n':
             local_flags |= NO_HEADERS;
             break;
+        case MMAP_HINTS_OPTION:
+            if (tersect_db_parse_access(optarg, &access_hints)
+                != SUCCESS) {
+                usage(stderr);
+                return E_TSI_ACCESS_HINT;
+            }
+            break;
+        case NO_OPTIMIZE_OPTION:
+            local_flags |= NO_OPTIMIZE;
+            break;
+        case EXPLAIN_OPTION:
+            local_flags |= EXPLAIN;
+            break;
+        case ANALYZE_OPTION:
+            local_flags |= ANALYZE;
+            break;
+        case JSON_OPTION:
+            local_flags |= JSON_OUTPUT;
+            break;
+        case 't':
+            nthreads = strtol(optarg, NULL, 10);
+            break;
         default:
             usage(stderr);
             return SUCCESS;
@@ -86,13 +296,21 @@ error_t tersect_view_set(int argc, char **argv)
         return E_VIEW_NO_QUERY;
     }
     query = argv[1];
+    if (binning && (!(local_flags & COUNT_ONLY) || !bin_size)) {
+        usage(stderr);
+        return E_VIEW_BIN_NO_COUNT;
+    }
+    if (nthreads < 1) {
+        usage(stderr);
+        return E_VIEW_THREADS;
+    }
     argc -= 2;
     argv += 2;
     if (argc) {
         region_strings = argv;
         nregions = argc;
     }
-    tersect_db *tdb = tersect_db_open(db_filename);
+    tersect_db *tdb = tersect_db_open_readonly(db_filename, access_hints);
     if (tdb == NULL) return E_TSI_NOPEN;
     struct genomic_interval *regions;
     if (nregions) {
@@ -101,18 +319,50 @@ error_t tersect_view_set(int argc, char **argv)
         rc = tersect_db_get_regions(tdb, &nregions, &regions);
     }
     if (rc != SUCCESS) goto cleanup_1;
-    struct ast_node *command = run_set_parser(query, tdb);
-    if (command == NULL) goto cleanup_2;
+    struct query_result result;
+    struct query_error error;
+    rc = run_set_parser(query, tdb, &result, &error);
+    if (rc != SUCCESS) {
+        print_query_error(stderr, query, &error);
+        goto cleanup_2;
+    }
+    if (result.ast == NULL) {
+        // Query evaluates to a list of genomes
+        for (size_t i = 0; i < result.ngenomes; ++i) {
+            printf("%s\n", result.genomes[i].name);
+        }
+        free(result.genomes);
+        goto cleanup_2;
+    }
+    struct ast_node *command = result.ast;
+    if (!(local_flags & NO_OPTIMIZE)) {
+        command = optimize_ast(command, tdb);
+    }
+    if (local_flags & (EXPLAIN | ANALYZE)) {
+        bool optimized = !(local_flags & NO_OPTIMIZE);
+        bool json = local_flags & JSON_OUTPUT;
+        if (local_flags & ANALYZE) {
+            analyze_query(stdout, query, optimized, command, tdb, nregions,
+                          regions, json);
+        } else {
+            explain_query(stdout, query, optimized, command, tdb, json);
+        }
+        goto cleanup_3;
+    }
     if (!(local_flags & NO_HEADERS)) {
-        vcf_print_header(query, nregions, region_strings);
-    }
-    for (size_t i = 0; i < nregions; ++i) {
-        struct tersect_db_interval ti;
-        tersect_db_get_interval(tdb, &regions[i], &ti);
-        struct bitarray *result = eval_ast(command, tdb, &ti);
-        if (result == NULL) goto cleanup_3;
-        vcf_print_bitarray(tdb, result, &ti);
-        free_bitarray(result);
+        if (local_flags & COUNT_ONLY) {
+            printf("#CHROM\tSTART\tEND\tCOUNT\n");
+        } else {
+            vcf_print_header(query, nregions, region_strings);
+        }
+    }
+    if (nthreads > 1) {
+        rc = view_regions_parallel(tdb, command, nregions, regions, bin_size,
+                                   nthreads);
+    } else {
+        for (size_t i = 0; i < nregions; ++i) {
+            view_region(stdout, tdb, command, &regions[i], bin_size);
+        }
     }
 cleanup_3:
     free_ast(command);